@@ -0,0 +1,407 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "accesslog.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#endif
+
+namespace tthttpd {
+
+#ifndef _WIN32
+
+// what one side wrote to a ring is seen by the other before the index
+// that hands it over.
+#define ACCESSLOG_BARRIER() __sync_synchronize()
+
+// the batch is written out once it grows this large.
+#define ACCESSLOG_BATCH (64 * 1024)
+
+volatile sig_atomic_t AccessLog::reopen_requested = 0;
+
+AccessLog::AccessLog(const std::string& _path, int _format) {
+  path = _path;
+  format = _format;
+  fd = -1;
+  dropped = 0;
+  batch_time = 0;
+  batch_date[0] = 0;
+  running = false;
+  wake[0] = wake[1] = -1;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+AccessLog::~AccessLog() {
+  stop();
+  for (std::vector<Ring*>::iterator it = rings.begin(); it != rings.end(); it++)
+    delete *it;
+  if (fd >= 0) close(fd);
+  pthread_mutex_destroy(&mutex);
+}
+
+bool AccessLog::open_file() {
+  int newfd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (newfd < 0) {
+    fprintf(stderr, "could not open %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  fcntl(newfd, F_SETFD, FD_CLOEXEC);
+  if (format == FORMAT_BINARY) {
+    // a new file knows none of the strings of the last one.
+    struct stat st;
+    if (fstat(newfd, &st) == 0 && st.st_size == 0 && write(newfd, ACCESSLOG_MAGIC, 8) != 8) {}
+    strings.clear();
+  }
+  if (fd >= 0) close(fd);
+  fd = newfd;
+  return true;
+}
+
+bool AccessLog::start() {
+  if (running)
+    return true;
+  if (!open_file())
+    return false;
+  if (pipe(wake) < 0)
+    return false;
+  for (int i = 0; i < 2; i++)
+    fcntl(wake[i], F_SETFD, FD_CLOEXEC);
+  running = true;
+  if (pthread_create(&thread, NULL, loop_thread, this)) {
+    running = false;
+    stop();
+    return false;
+  }
+  return true;
+}
+
+void AccessLog::stop() {
+  if (running) {
+    running = false;
+    if (write(wake[1], "", 1) < 0) {}
+    pthread_join(thread, NULL);
+  }
+  if (wake[0] >= 0) close(wake[0]);
+  if (wake[1] >= 0) close(wake[1]);
+  wake[0] = wake[1] = -1;
+}
+
+void AccessLog::reopen() {
+  reopen_requested = 1;
+}
+
+AccessLog::Ring* AccessLog::attach() {
+  Ring* ring = NULL;
+  pthread_mutex_lock(&mutex);
+  for (std::vector<Ring*>::iterator it = rings.begin(); it != rings.end(); it++) {
+    if (!(*it)->in_use) {
+      ring = *it;
+      break;
+    }
+  }
+  if (!ring) {
+    ring = new Ring;
+    ring->head = ring->tail = 0;
+    ring->dropped = 0;
+    rings.push_back(ring);
+  }
+  ring->in_use = true;
+  pthread_mutex_unlock(&mutex);
+  return ring;
+}
+
+void AccessLog::detach(Ring* ring) {
+  // what is left in the ring is still written; the next thread to take
+  // it goes on after it.
+  pthread_mutex_lock(&mutex);
+  ring->in_use = false;
+  pthread_mutex_unlock(&mutex);
+}
+
+void AccessLog::log(Ring* ring, const Entry& entry) {
+  const StringSpan strings[5] = { entry.address, entry.user, entry.request, entry.referer, entry.agent };
+  Record record;
+  size_t size = sizeof(record);
+  for (int n = 0; n < 5; n++) {
+    size_t len = strings[n].len;
+    record.lengths[n] = (unsigned short) (len < ACCESSLOG_FIELD_MAX ? len : ACCESSLOG_FIELD_MAX);
+    size += record.lengths[n];
+  }
+  size = (size + 7) & ~7;
+  record.size = (unsigned short) size;
+  record.status = entry.status;
+  record.time = entry.time;
+  record.usec = entry.usec;
+  record.bytes = entry.bytes;
+
+  unsigned long head = ring->head;
+  unsigned long tail = ring->tail;
+  ACCESSLOG_BARRIER();
+  size_t pos = head % ACCESSLOG_RING;
+  size_t room = ACCESSLOG_RING - pos;
+  // a record is never split: one that does not fit before the end of the
+  // ring starts over at its beginning.
+  size_t skip = room < size ? room : 0;
+  if (head + skip + size - tail > ACCESSLOG_RING) {
+    ring->dropped++;
+    return;
+  }
+  if (skip) {
+    if (room >= sizeof(record)) {
+      Record mark;
+      memset(&mark, 0, sizeof(mark));
+      memcpy(ring->data + pos, &mark, sizeof(mark));
+    }
+    head += skip;
+    pos = 0;
+  }
+  char* p = ring->data + pos;
+  memcpy(p, &record, sizeof(record));
+  p += sizeof(record);
+  for (int n = 0; n < 5; n++) {
+    if (record.lengths[n])
+      memcpy(p, strings[n].ptr, record.lengths[n]);
+    p += record.lengths[n];
+  }
+  ACCESSLOG_BARRIER();
+  ring->head = head + size;
+}
+
+void* AccessLog::loop_thread(void* param) {
+  ((AccessLog*)param)->loop();
+  return NULL;
+}
+
+void AccessLog::loop() {
+  struct pollfd pfd;
+  pfd.fd = wake[0];
+  pfd.events = POLLIN;
+  bool done = false;
+  while (!done) {
+    pfd.revents = 0;
+    if (poll(&pfd, 1, ACCESSLOG_INTERVAL) < 0 && errno != EINTR)
+      break;
+    // what came before the signal still goes to the old file.
+    bool reopening = reopen_requested != 0;
+    done = pfd.revents != 0;
+
+    std::vector<Ring*> list;
+    pthread_mutex_lock(&mutex);
+    list = rings;
+    pthread_mutex_unlock(&mutex);
+    unsigned long long lost = 0;
+    for (std::vector<Ring*>::iterator it = list.begin(); it != list.end(); it++) {
+      drain(*it);
+      lost += (*it)->dropped;
+    }
+    flush();
+    if (lost > dropped) {
+      fprintf(stderr, "access log: %llu records dropped\n", lost - dropped);
+      dropped = lost;
+    }
+    if (reopening) {
+      reopen_requested = 0;
+      open_file();
+    }
+  }
+}
+
+void AccessLog::drain(Ring* ring) {
+  unsigned long head = ring->head;
+  ACCESSLOG_BARRIER();
+  unsigned long tail = ring->tail;
+  while (tail != head) {
+    size_t pos = tail % ACCESSLOG_RING;
+    size_t room = ACCESSLOG_RING - pos;
+    Record record;
+    if (room < sizeof(record)) {
+      tail += room;
+      continue;
+    }
+    memcpy(&record, ring->data + pos, sizeof(record));
+    if (!record.size) {
+      tail += room;
+      continue;
+    }
+    if (format == FORMAT_BINARY)
+      encode_record(&record, ring->data + pos + sizeof(record));
+    else
+      format_record(&record, ring->data + pos + sizeof(record));
+    tail += record.size;
+    if (batch.size() >= ACCESSLOG_BATCH)
+      flush();
+  }
+  ACCESSLOG_BARRIER();
+  ring->tail = tail;
+}
+
+// quotes and anything unprintable are escaped as \" and \xhh, so that a
+// client can not forge a line of its own.
+static void append_field(std::string& out, const char* p, size_t len, bool quoted) {
+  if (!len) {
+    out += '-';
+    return;
+  }
+  for (size_t n = 0; n < len; n++) {
+    unsigned char c = (unsigned char) p[n];
+    if (c < 0x20 || c >= 0x7f || c == '\\' || (quoted && c == '"')) {
+      char hex[8];
+      if (c == '"' || c == '\\')
+        sprintf(hex, "\\%c", c);
+      else
+        sprintf(hex, "\\x%02x", c);
+      out += hex;
+    } else
+      out += (char) c;
+  }
+}
+
+void AccessLog::format_record(const Record* record, const char* p) {
+  const char* fields[5];
+  for (int n = 0; n < 5; n++) {
+    fields[n] = p;
+    p += record->lengths[n];
+  }
+  if (record->time != batch_time) {
+    struct tm tm;
+    localtime_r(&record->time, &tm);
+    strftime(batch_date, sizeof(batch_date), "[%d/%b/%Y:%H:%M:%S %z]", &tm);
+    batch_time = record->time;
+  }
+  char buf[128];
+  append_field(batch, fields[0], record->lengths[0], false);
+  batch += " - ";
+  append_field(batch, fields[1], record->lengths[1], false);
+  batch += ' ';
+  batch += batch_date;
+  batch += " \"";
+  append_field(batch, fields[2], record->lengths[2], true);
+  if (record->bytes)
+    sprintf(buf, "\" %d %llu", record->status, record->bytes);
+  else
+    sprintf(buf, "\" %d -", record->status);
+  batch += buf;
+  if (format == FORMAT_COMBINED) {
+    batch += " \"";
+    append_field(batch, fields[3], record->lengths[3], true);
+    batch += "\" \"";
+    append_field(batch, fields[4], record->lengths[4], true);
+    batch += '"';
+  }
+  sprintf(buf, " %llu\n", record->usec);
+  batch += buf;
+}
+
+static void put_le(std::string& out, unsigned long long v, int bytes) {
+  for (int n = 0; n < bytes; n++) {
+    out += (char) (v & 0xff);
+    v >>= 8;
+  }
+}
+
+unsigned int AccessLog::intern(const char* p, size_t len) {
+  if (!len)
+    return 0;
+  std::string key(p, len);
+  std::map<std::string, unsigned int>::iterator it = strings.find(key);
+  if (it != strings.end())
+    return it->second;
+  if (strings.size() >= ACCESSLOG_STRINGS_MAX)
+    strings.clear();
+  unsigned int id = (unsigned int) strings.size() + 1;
+  strings[key] = id;
+  batch += 'S';
+  batch += '\0';
+  put_le(batch, len, 2);
+  put_le(batch, id, 4);
+  batch.append(p, len);
+  batch.append((8 - len % 8) % 8, '\0');
+  return id;
+}
+
+void AccessLog::encode_record(const Record* record, const char* p) {
+  const char* fields[5];
+  for (int n = 0; n < 5; n++) {
+    fields[n] = p;
+    p += record->lengths[n];
+  }
+  // the strings are defined first, so they come before the record.
+  unsigned char addr[16];
+  memset(addr, 0, sizeof(addr));
+  int family = 0;
+  std::string address(fields[0], record->lengths[0]);
+  if (inet_pton(AF_INET, address.c_str(), addr) == 1)
+    family = 4;
+  else if (inet_pton(AF_INET6, address.c_str(), addr) == 1)
+    family = 6;
+  else {
+    unsigned int id = intern(fields[0], record->lengths[0]);
+    for (int n = 0; n < 4; n++)
+      addr[n] = (unsigned char) (id >> (n * 8));
+  }
+  unsigned int ids[4];
+  for (int n = 0; n < 4; n++)
+    ids[n] = intern(fields[n + 1], record->lengths[n + 1]);
+
+  batch += 'A';
+  batch += (char) family;
+  put_le(batch, record->status, 2);
+  put_le(batch, record->usec < 0xffffffffULL ? record->usec : 0xffffffffULL, 4);
+  put_le(batch, (unsigned long long) record->time, 8);
+  put_le(batch, record->bytes, 8);
+  batch.append((const char*) addr, sizeof(addr));
+  // request, user, referer, agent
+  put_le(batch, ids[1], 4);
+  put_le(batch, ids[0], 4);
+  put_le(batch, ids[2], 4);
+  put_le(batch, ids[3], 4);
+}
+
+void AccessLog::flush() {
+  size_t done = 0;
+  while (fd >= 0 && done < batch.size()) {
+    ssize_t w = write(fd, batch.data() + done, batch.size() - done);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      break;
+    done += w;
+  }
+  batch.clear();
+}
+
+#endif
+
+}
+
+// vim:set et:
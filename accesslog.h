@@ -0,0 +1,151 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _ACCESSLOG_H_
+#define _ACCESSLOG_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <time.h>
+#include "utils.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#include <pthread.h>
+#endif
+
+namespace tthttpd {
+
+#ifndef _WIN32
+
+// bytes of records each thread can have waiting, and milliseconds between
+// two drains. a record that does not fit is dropped and counted.
+#define ACCESSLOG_RING (64 * 1024)
+#define ACCESSLOG_INTERVAL 10
+
+// longer strings, such as a huge User-Agent, are cut there.
+#define ACCESSLOG_FIELD_MAX 2048
+
+// the binary log: ACCESSLOG_MAGIC, then records of 8 byte multiples with
+// every number little-endian. an access record is ACCESSLOG_ACCESS_SIZE
+// bytes:
+//
+//    0  'A', address family (4, 6, or 0 for a name), status (2)
+//    4  microseconds taken (4)
+//    8  seconds since the epoch (8)
+//   16  body bytes sent (8)
+//   24  peer address (16); for a name, the id of its string
+//   40  ids of the request line, user, referer and user agent (4 each)
+//
+// strings are given ids as they are first seen, and a string record
+// defining one comes before anything using it: 'S', 0, length (2), id
+// (4), then the string padded to 8 bytes. id 0 is the empty string. ids
+// start over in each file, and after ACCESSLOG_STRINGS_MAX of them.
+#define ACCESSLOG_MAGIC "TTHL\1\0\0\0"
+#define ACCESSLOG_ACCESS_SIZE 56
+#define ACCESSLOG_STRINGS_MAX 65536
+
+// the access log, in Common or Combined Log Format with the time taken in
+// microseconds at the end, or in the binary format above. a response
+// thread puts its records, unformatted, into a ring of its own, and one
+// writer thread formats them and appends them to the file in batches, so
+// no request waits on another or on the disk. the file is opened again on
+// reopen(), as after rotating it.
+class AccessLog {
+public:
+  enum { FORMAT_COMMON, FORMAT_COMBINED, FORMAT_BINARY };
+  typedef struct {
+    time_t time;                // when the request came
+    unsigned long long usec;    // from then to its last byte
+    unsigned long long bytes;   // the body sent
+    int status;
+    StringSpan address;
+    StringSpan user;
+    StringSpan request;
+    StringSpan referer;
+    StringSpan agent;
+  } Entry;
+  // one producer's ring. `head' is only written by its thread and `tail'
+  // only by the writer, each on a cache line of its own.
+  class Ring {
+  private:
+    friend class AccessLog;
+    char pad_head[64];
+    volatile unsigned long head;
+    char pad_mid[64];
+    volatile unsigned long tail;
+    char pad_tail[64];
+    bool in_use;
+    unsigned long long dropped;
+    char data[ACCESSLOG_RING];
+  };
+  AccessLog(const std::string& path, int format);
+  ~AccessLog();
+  bool start();
+  void stop();
+  Ring* attach();
+  void detach(Ring* ring);
+  // queues a record; never blocks.
+  void log(Ring* ring, const Entry& entry);
+  // safe to call from a signal handler.
+  static void reopen();
+private:
+  typedef struct {
+    unsigned short size;        // of the record, strings included
+    unsigned short lengths[5];
+    int status;
+    time_t time;
+    unsigned long long usec;
+    unsigned long long bytes;
+  } Record;
+  std::string path;
+  int format;
+  int fd;
+  std::vector<Ring*> rings;
+  unsigned long long dropped;
+  std::string batch;
+  time_t batch_time;
+  char batch_date[64];
+  std::map<std::string, unsigned int> strings;
+  bool running;
+  int wake[2];
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  static volatile sig_atomic_t reopen_requested;
+  static void* loop_thread(void* param);
+  void loop();
+  bool open_file();
+  void drain(Ring* ring);
+  void format_record(const Record* record, const char* fields);
+  void encode_record(const Record* record, const char* fields);
+  unsigned int intern(const char* p, size_t len);
+  void flush();
+};
+
+#endif
+
+}
+
+#endif /* _ACCESSLOG_H_ */
+
+// vim:set et:
@@ -0,0 +1,119 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "arena.h"
+#include <stdlib.h>
+
+namespace tthttpd {
+
+ARENA_THREAD Arena* Arena::current_arena = NULL;
+
+void Arena::grow(size_t size) {
+  size_t want = sizeof(Chunk) + size;
+  size_t chunk = chunks ? chunks->size * 2 : ARENA_CHUNK;
+  if (chunk < want)
+    chunk = want;
+  Chunk* c = (Chunk*) malloc(chunk);
+  if (!c)
+    throw std::bad_alloc();
+  c->next = chunks;
+  c->size = chunk;
+  chunks = c;
+  ptr = (char*) (c + 1);
+  // the payload starts 16-aligned, as allocate() keeps it.
+  ptr += (16 - ((size_t) ptr & 15)) & 15;
+  end = (char*) c + chunk;
+}
+
+void Arena::reset() {
+  if (used > peak)
+    peak = used;
+  used = 0;
+  if (!chunks)
+    return;
+  if (chunks->next || chunks->size > ARENA_KEEP_MAX) {
+    // one chunk next time, big enough for the largest request seen so far
+    // but no bigger than a connection should keep.
+    release();
+    size_t size = peak + sizeof(Chunk) + 16;
+    if (size > ARENA_KEEP_MAX)
+      size = ARENA_KEEP_MAX;
+    grow(size - sizeof(Chunk));
+    return;
+  }
+  ptr = (char*) (chunks + 1);
+  ptr += (16 - ((size_t) ptr & 15)) & 15;
+}
+
+void Arena::release() {
+  while (chunks) {
+    Chunk* next = chunks->next;
+    free(chunks);
+    chunks = next;
+  }
+  ptr = end = NULL;
+}
+
+#ifdef TTHTTPD_DEBUG
+static ARENA_THREAD unsigned long long thread_allocations;
+
+unsigned long long Arena::allocations() {
+  return thread_allocations;
+}
+#endif
+
+}
+
+#ifdef TTHTTPD_DEBUG
+// replaced for the whole program, to count what each thread allocates.
+#if __cplusplus >= 201103L
+# define THROW_BAD_ALLOC
+# define THROW_NOTHING noexcept
+#else
+# define THROW_BAD_ALLOC throw(std::bad_alloc)
+# define THROW_NOTHING throw()
+#endif
+
+void* operator new(size_t size) THROW_BAD_ALLOC {
+  tthttpd::thread_allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](size_t size) THROW_BAD_ALLOC {
+  tthttpd::thread_allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void* p) THROW_NOTHING {
+  free(p);
+}
+void operator delete[](void* p) THROW_NOTHING {
+  free(p);
+}
+#endif
+
+// vim:set et:
@@ -0,0 +1,157 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <string>
+#include <map>
+#include <new>
+
+namespace tthttpd {
+
+#ifdef _MSC_VER
+# define ARENA_THREAD __declspec(thread)
+#else
+# define ARENA_THREAD __thread
+#endif
+
+#define ARENA_CHUNK 16384
+#define ARENA_KEEP_MAX (256 * 1024)  // the most a connection holds on to
+
+// a bump allocator for the data of one request. memory is handed out in
+// order and taken back only all at once, by reset() at the top of the
+// next request. reset() also folds the chunks a request needed into one,
+// so that a connection soon stops going to malloc at all.
+//
+// the arena a thread serves from is current(); an ArenaAllocator made
+// without one takes it, and with none falls back to the heap.
+class Arena {
+public:
+  Arena() : chunks(NULL), ptr(NULL), end(NULL), used(0), peak(0) {}
+  ~Arena() {
+    release();
+  }
+  void* allocate(size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+    if ((size_t) (end - ptr) < size)
+      grow(size);
+    void* p = ptr;
+    ptr += size;
+    used += size;
+    return p;
+  }
+  void reset();
+  size_t size() const {
+    return used;
+  }
+  static Arena* current() {
+    return current_arena;
+  }
+  static void use(Arena* arena) {
+    current_arena = arena;
+  }
+#ifdef TTHTTPD_DEBUG
+  // operator new calls made by this thread, counted in debug builds.
+  static unsigned long long allocations();
+#endif
+
+private:
+  typedef struct Chunk {
+    struct Chunk* next;
+    size_t size;
+  } Chunk;
+  Chunk* chunks;
+  char* ptr;
+  char* end;
+  size_t used;
+  size_t peak;
+  static ARENA_THREAD Arena* current_arena;
+  void grow(size_t size);
+  void release();
+  Arena(const Arena&);
+  Arena& operator=(const Arena&);
+};
+
+template <class T>
+class ArenaAllocator {
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  template <class U> struct rebind {
+    typedef ArenaAllocator<U> other;
+  };
+
+  ArenaAllocator() : arena(Arena::current()) {}
+  ArenaAllocator(Arena* _arena) : arena(_arena) {}
+  template <class U> ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+  pointer allocate(size_type n, const void* = 0) {
+    if (arena)
+      return (pointer) arena->allocate(n * sizeof(T));
+    return (pointer) ::operator new(n * sizeof(T));
+  }
+  void deallocate(pointer p, size_type) {
+    if (!arena)
+      ::operator delete(p);
+  }
+  void construct(pointer p, const T& value) {
+    new((void*) p) T(value);
+  }
+  void destroy(pointer p) {
+    p->~T();
+  }
+  pointer address(reference r) const {
+    return &r;
+  }
+  const_pointer address(const_reference r) const {
+    return &r;
+  }
+  size_type max_size() const {
+    return (size_t) -1 / sizeof(T);
+  }
+
+  Arena* arena;
+};
+
+template <class T, class U>
+inline bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena == b.arena;
+}
+template <class T, class U>
+inline bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena != b.arena;
+}
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char> > ArenaString;
+
+}
+
+#endif /* _ARENA_H_ */
+
+// vim:set et:
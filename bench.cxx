@@ -0,0 +1,549 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+// tthttpd-bench: drives a running server over many connections with a
+// mix of requests, and reports throughput and latency percentiles. every
+// connection walks the mix in the same order each run, so two runs differ
+// by the server only.
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+enum { KIND_SMALL, KIND_LARGE, KIND_REVALIDATE, KIND_LISTING, KIND_CGI, KINDS };
+static const char* kind_names[] = { "small", "large", "304", "dir", "cgi" };
+
+typedef struct {
+  std::string path;
+  int weight;
+  std::string request;  // ready to send
+} Kind;
+
+static Kind kinds[KINDS];
+static std::vector<int> schedule;  // kinds, in proportion to their weights
+static struct addrinfo* target;
+static std::string host;
+static int connections = 16;
+static int threads = 1;
+static int duration = 10;
+static int warmup = 0;
+static int depth = 1;
+static bool keep_alive = true;
+static unsigned long long started_usec, warm_usec, deadline_usec;
+
+static unsigned long long now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// what one thread saw.
+typedef struct {
+  std::vector<unsigned int> latencies[KINDS];
+  unsigned long long bytes;
+  unsigned long long classes[6];
+  unsigned long long errors;
+  unsigned long long connects;
+} Result;
+
+typedef struct {
+  int kind;
+  unsigned long long sent;
+} Pending;
+
+enum { ST_HEAD, ST_LENGTH, ST_CHUNK_LINE, ST_CHUNK_DATA, ST_TRAILER, ST_CLOSE };
+
+typedef struct {
+  int fd;
+  int next;             // position in the schedule
+  std::string out;
+  size_t out_pos;
+  std::deque<Pending> pending;
+  int state;
+  std::string line;
+  unsigned long long left;
+  int status;
+  bool close;
+  unsigned long long body;
+} Conn;
+
+static bool open_conn(Conn& c, Result& r) {
+  c.fd = socket(target->ai_family, target->ai_socktype, target->ai_protocol);
+  if (c.fd < 0)
+    return false;
+  fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) | O_NONBLOCK);
+  int on = 1;
+  setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  if (connect(c.fd, target->ai_addr, target->ai_addrlen) < 0 && errno != EINPROGRESS) {
+    close(c.fd);
+    c.fd = -1;
+    return false;
+  }
+  c.out.clear();
+  c.out_pos = 0;
+  c.pending.clear();
+  c.state = ST_HEAD;
+  c.line.clear();
+  c.close = false;
+  r.connects++;
+  return true;
+}
+
+static void fill_pipeline(Conn& c, unsigned long long t) {
+  int want = keep_alive ? depth : 1;
+  while ((int) c.pending.size() < want && t < deadline_usec) {
+    Pending p;
+    p.kind = schedule[c.next];
+    c.next = (c.next + 1) % schedule.size();
+    p.sent = t;
+    c.out += kinds[p.kind].request;
+    c.pending.push_back(p);
+  }
+}
+
+static void response_done(Conn& c, Result& r, unsigned long long t) {
+  Pending p = c.pending.front();
+  c.pending.pop_front();
+  if (t >= warm_usec && t < deadline_usec) {
+    r.latencies[p.kind].push_back((unsigned int) (t - p.sent));
+    r.classes[c.status >= 100 && c.status < 600 ? c.status / 100 : 0]++;
+    r.bytes += c.body;
+  }
+  c.state = ST_HEAD;
+  c.line.clear();
+}
+
+// starts on a response head; false if it makes no sense.
+static bool parse_head(Conn& c) {
+  const char* p = c.line.c_str();
+  if (strncmp(p, "HTTP/1.", 7) || c.line.size() < 12)
+    return false;
+  c.status = atoi(p + 9);
+  c.close = p[7] == '0' || !keep_alive;
+  bool chunked = false, has_length = false;
+  c.left = 0;
+  c.body = 0;
+  const char* h = strstr(p, "\r\n");
+  while (h && h[2] != '\r') {
+    h += 2;
+    if (!strncasecmp(h, "Content-Length:", 15)) {
+      c.left = strtoull(h + 15, NULL, 10);
+      has_length = true;
+    } else if (!strncasecmp(h, "Transfer-Encoding:", 18)) {
+      chunked = strstr(h, "chunked") && strstr(h, "chunked") < strstr(h, "\r\n");
+    } else if (!strncasecmp(h, "Connection:", 11)) {
+      const char* v = h + 11;
+      while (*v == ' ') v++;
+      if (!strncasecmp(v, "close", 5)) c.close = true;
+      else if (!strncasecmp(v, "keep-alive", 10)) c.close = !keep_alive;
+    }
+    h = strstr(h, "\r\n");
+  }
+  c.line.clear();
+  if (c.status == 304 || c.status == 204 || (c.status >= 100 && c.status < 200))
+    c.state = ST_HEAD + 100;  // done
+  else if (chunked)
+    c.state = ST_CHUNK_LINE;
+  else if (has_length)
+    c.state = c.left ? ST_LENGTH : ST_HEAD + 100;
+  else {
+    c.state = ST_CLOSE;
+    c.close = true;
+  }
+  return true;
+}
+
+// takes what was read; false on a broken response.
+static bool feed(Conn& c, Result& r, const char* p, size_t n, unsigned long long t) {
+  while (n) {
+    switch (c.state) {
+    case ST_HEAD:
+      c.line += *p++;
+      n--;
+      if (c.line.size() >= 4 && !memcmp(c.line.data() + c.line.size() - 4, "\r\n\r\n", 4)) {
+        if (c.pending.empty() || !parse_head(c))
+          return false;
+        if (c.state == ST_HEAD + 100) {
+          if (c.status >= 100 && c.status < 200)
+            c.state = ST_HEAD;  // an interim response; the real one follows
+          else
+            response_done(c, r, t);
+        }
+      } else if (c.line.size() > 65536)
+        return false;
+      break;
+    case ST_LENGTH:
+    case ST_CHUNK_DATA: {
+      size_t take = n < c.left ? n : (size_t) c.left;
+      c.left -= take;
+      c.body += take;
+      p += take;
+      n -= take;
+      if (!c.left) {
+        if (c.state == ST_LENGTH)
+          response_done(c, r, t);
+        else {
+          c.body -= 2;  // the CRLF after the chunk
+          c.state = ST_CHUNK_LINE;
+        }
+      }
+      break;
+    }
+    case ST_CHUNK_LINE:
+    case ST_TRAILER:
+      c.line += *p++;
+      n--;
+      if (c.line[c.line.size() - 1] != '\n')
+        break;
+      if (c.state == ST_CHUNK_LINE) {
+        unsigned long long size = strtoull(c.line.c_str(), NULL, 16);
+        c.line.clear();
+        if (size) {
+          c.left = size + 2;
+          c.state = ST_CHUNK_DATA;
+        } else
+          c.state = ST_TRAILER;
+      } else {
+        bool end = c.line == "\r\n" || c.line == "\n";
+        c.line.clear();
+        if (end)
+          response_done(c, r, t);
+      }
+      break;
+    case ST_CLOSE:
+      c.body += n;
+      n = 0;
+      break;
+    }
+  }
+  return true;
+}
+
+static void* bench_thread(void* param) {
+  int index = (int) (long) param;
+  Result* r = new Result;
+  r->bytes = r->errors = r->connects = 0;
+  memset(r->classes, 0, sizeof(r->classes));
+  int count = connections / threads + (index < connections % threads ? 1 : 0);
+  std::vector<Conn> conns(count);
+  for (int n = 0; n < count; n++) {
+    // each connection starts at its own place in the mix.
+    conns[n].next = (int) (((index + n * threads) * 7919L) % schedule.size());
+    if (!open_conn(conns[n], *r))
+      r->errors++;
+  }
+  std::vector<struct pollfd> pfds(count);
+  char buf[65536];
+  while (true) {
+    unsigned long long t = now();
+    bool busy = false;
+    for (int n = 0; n < count; n++) {
+      Conn& c = conns[n];
+      if (c.fd < 0 && t < deadline_usec && !open_conn(c, *r))
+        r->errors++;
+      if (c.fd >= 0)
+        fill_pipeline(c, t);
+      pfds[n].fd = c.fd;
+      pfds[n].events = POLLIN | (c.out_pos < c.out.size() ? POLLOUT : 0);
+      pfds[n].revents = 0;
+      if (c.fd >= 0 && !c.pending.empty())
+        busy = true;
+    }
+    if (!busy && t >= deadline_usec)
+      break;
+    int wait = t < deadline_usec ? (int) ((deadline_usec - t) / 1000) + 1 : 100;
+    if (poll(&pfds[0], count, wait) < 0 && errno != EINTR)
+      break;
+    t = now();
+    if (t >= deadline_usec + 1000000)
+      break;  // what is still on its way is not waited for long
+    for (int n = 0; n < count; n++) {
+      Conn& c = conns[n];
+      if (c.fd < 0 || !pfds[n].revents)
+        continue;
+      bool failed = false, closed = false;
+      if (pfds[n].revents & POLLOUT) {
+        ssize_t w = send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+        if (w > 0) {
+          c.out_pos += w;
+          if (c.out_pos == c.out.size()) {
+            c.out.clear();
+            c.out_pos = 0;
+          }
+        } else if (w < 0 && errno != EAGAIN && errno != EINTR)
+          failed = true;
+      }
+      if (!failed && (pfds[n].revents & (POLLIN | POLLHUP | POLLERR))) {
+        ssize_t got = recv(c.fd, buf, sizeof(buf), 0);
+        if (got > 0)
+          failed = !feed(c, *r, buf, got, t);
+        else if (got == 0)
+          closed = true;
+        else if (errno != EAGAIN && errno != EINTR)
+          failed = true;
+      }
+      if (closed && c.state == ST_CLOSE && !c.pending.empty()) {
+        response_done(c, *r, t);
+        closed = c.pending.empty();
+      }
+      if (failed || (closed && !c.pending.empty()))
+        r->errors++;
+      // a response saying close ends the connection once it is whole.
+      if (failed || closed || (c.close && c.state == ST_HEAD && c.line.empty())) {
+        close(c.fd);
+        c.fd = -1;
+      }
+    }
+  }
+  for (int n = 0; n < count; n++)
+    if (conns[n].fd >= 0) close(conns[n].fd);
+  return r;
+}
+
+// the Last-Modified of a path, for the 304 requests to send back.
+static std::string last_modified(const std::string& path) {
+  int fd = socket(target->ai_family, target->ai_socktype, target->ai_protocol);
+  if (fd < 0 || connect(fd, target->ai_addr, target->ai_addrlen) < 0) {
+    if (fd >= 0) close(fd);
+    return "";
+  }
+  std::string req = "HEAD " + path + " HTTP/1.0\r\nHost: " + host + "\r\n\r\n";
+  if (send(fd, req.data(), req.size(), MSG_NOSIGNAL) < 0) {}
+  std::string res;
+  char buf[4096];
+  ssize_t n;
+  while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+    res.append(buf, n);
+  close(fd);
+  size_t pos = res.find("\r\nLast-Modified: ");
+  if (pos == std::string::npos)
+    return "";
+  pos += 17;
+  return res.substr(pos, res.find("\r\n", pos) - pos);
+}
+
+static void usage() {
+  const char* lines[] = {
+    "  usage: tthttpd-bench [-c connections] [-t threads] [-d seconds] [-w seconds]",
+    "                       [-p depth] [-C] [-m kind=weight,...] [-u kind=path] host:port",
+    "  -c : connections, spread over the threads (16)",
+    "  -t : threads (1)",
+    "  -d : seconds to measure (10)",
+    "  -w : seconds to run first without measuring (0)",
+    "  -p : requests in flight on each connection (1)",
+    "  -C : close the connection after every request",
+    "  -m : the mix, by weight (small=1)",
+    "  -u : the path a kind asks for",
+    "  kinds: small (/index.html), large (/large.bin), 304 (/index.html, revalidated),",
+    "         dir (/), cgi (/test.cgi)",
+    NULL
+  };
+  for (const char** ptr = lines; *ptr; ptr++)
+    fprintf(stderr, "%s\n", *ptr);
+}
+
+static int find_kind(const std::string& name) {
+  for (int k = 0; k < KINDS; k++)
+    if (name == kind_names[k]) return k;
+  return -1;
+}
+
+static unsigned int percentile(std::vector<unsigned int>& v, double share) {
+  if (v.empty()) return 0;
+  size_t n = (size_t) (v.size() * share);
+  if (n >= v.size()) n = v.size() - 1;
+  std::nth_element(v.begin(), v.begin() + n, v.end());
+  return v[n];
+}
+
+static void print_latency(const char* label, std::vector<unsigned int>& v) {
+  unsigned long long sum = 0;
+  for (size_t n = 0; n < v.size(); n++)
+    sum += v[n];
+  printf("%-10s %10lu %8lluus %8uus %8uus %8uus %8uus\n", label, (unsigned long) v.size(),
+    v.empty() ? 0 : sum / v.size(), percentile(v, 0.5), percentile(v, 0.99), percentile(v, 0.999),
+    v.empty() ? 0 : *std::max_element(v.begin(), v.end()));
+}
+
+int main(int argc, char* argv[]) {
+  int c;
+  const char* defaults[] = { "/index.html", "/large.bin", "/index.html", "/", "/test.cgi" };
+  for (int k = 0; k < KINDS; k++) {
+    kinds[k].path = defaults[k];
+    kinds[k].weight = k == KIND_SMALL ? 1 : 0;
+  }
+  bool mixed = false;
+  while ((c = getopt(argc, argv, "c:t:d:w:p:Cm:u:h")) != -1) {
+    switch (c) {
+    case 'c': connections = atoi(optarg); break;
+    case 't': threads = atoi(optarg); break;
+    case 'd': duration = atoi(optarg); break;
+    case 'w': warmup = atoi(optarg); break;
+    case 'p': depth = atoi(optarg); break;
+    case 'C': keep_alive = false; break;
+    case 'm':
+    case 'u': {
+      if (c == 'm' && !mixed) {
+        for (int k = 0; k < KINDS; k++) kinds[k].weight = 0;
+        mixed = true;
+      }
+      std::string spec = optarg;
+      size_t start = 0;
+      while (start <= spec.size()) {
+        size_t end = c == 'm' ? spec.find(',', start) : std::string::npos;
+        if (end == std::string::npos) end = spec.size();
+        std::string item = spec.substr(start, end - start);
+        size_t eq = item.find('=');
+        int k = find_kind(item.substr(0, eq));
+        if (k < 0 || eq == std::string::npos) {
+          fprintf(stderr, "invalid -%c: %s\n", c, item.c_str());
+          return -1;
+        }
+        if (c == 'm')
+          kinds[k].weight = atoi(item.c_str() + eq + 1);
+        else
+          kinds[k].path = item.substr(eq + 1);
+        start = end + 1;
+      }
+      break;
+    }
+    default: usage(); return -1;
+    }
+  }
+  if (optind >= argc || connections < 1 || threads < 1 || duration < 1 || depth < 1) {
+    usage();
+    return -1;
+  }
+  if (threads > connections)
+    threads = connections;
+
+  std::string addr = argv[optind], port = "80";
+  size_t colon = addr.rfind(':');
+  if (colon != std::string::npos && addr.find(']', colon) == std::string::npos) {
+    port = addr.substr(colon + 1);
+    addr.resize(colon);
+  }
+  host = argv[optind];
+  if (addr.size() > 1 && addr[0] == '[')
+    addr = addr.substr(1, addr.size() - 2);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  int error = getaddrinfo(addr.c_str(), port.c_str(), &hints, &target);
+  if (error) {
+    fprintf(stderr, "%s: %s\n", argv[optind], gai_strerror(error));
+    return -1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int k = 0; k < KINDS; k++) {
+    Kind& kind = kinds[k];
+    kind.request = "GET " + kind.path + " HTTP/1.1\r\nHost: " + host + "\r\n";
+    if (k == KIND_REVALIDATE && kind.weight) {
+      std::string since = last_modified(kind.path);
+      if (since.empty())
+        fprintf(stderr, "no Last-Modified for %s; 304 will be 200\n", kind.path.c_str());
+      else
+        kind.request += "If-Modified-Since: " + since + "\r\n";
+    }
+    if (!keep_alive)
+      kind.request += "Connection: close\r\n";
+    kind.request += "\r\n";
+    for (int n = 0; n < kind.weight; n++)
+      schedule.push_back(k);
+  }
+  if (schedule.empty()) {
+    fprintf(stderr, "the mix is empty\n");
+    return -1;
+  }
+  // the kinds interleaved, rather than one weight's worth after another.
+  std::vector<int> spread(schedule.size());
+  for (size_t n = 0; n < schedule.size(); n++)
+    spread[(n * 7 + 3) % schedule.size()] = schedule[n];
+  if (schedule.size() % 7)
+    schedule = spread;
+
+  printf("%s: %d connections, %d threads, %s, pipeline %d, %ds",
+    host.c_str(), connections, threads, keep_alive ? "keep-alive" : "close", keep_alive ? depth : 1, duration);
+  if (warmup) printf(" after %ds warmup", warmup);
+  printf("\nmix:");
+  for (int k = 0; k < KINDS; k++)
+    if (kinds[k].weight) printf(" %s=%d (%s)", kind_names[k], kinds[k].weight, kinds[k].path.c_str());
+  printf("\n");
+
+  started_usec = now();
+  warm_usec = started_usec + warmup * 1000000ULL;
+  deadline_usec = warm_usec + duration * 1000000ULL;
+  std::vector<pthread_t> ids(threads);
+  for (int n = 0; n < threads; n++)
+    pthread_create(&ids[n], NULL, bench_thread, (void*) (long) n);
+  Result total;
+  total.bytes = total.errors = total.connects = 0;
+  memset(total.classes, 0, sizeof(total.classes));
+  for (int n = 0; n < threads; n++) {
+    void* ret;
+    pthread_join(ids[n], &ret);
+    Result* r = (Result*) ret;
+    for (int k = 0; k < KINDS; k++)
+      total.latencies[k].insert(total.latencies[k].end(), r->latencies[k].begin(), r->latencies[k].end());
+    total.bytes += r->bytes;
+    total.errors += r->errors;
+    total.connects += r->connects;
+    for (int i = 0; i < 6; i++)
+      total.classes[i] += r->classes[i];
+    delete r;
+  }
+  freeaddrinfo(target);
+
+  std::vector<unsigned int> all;
+  for (int k = 0; k < KINDS; k++)
+    all.insert(all.end(), total.latencies[k].begin(), total.latencies[k].end());
+  printf("requests:  %lu (%.1f/s)\n", (unsigned long) all.size(), (double) all.size() / duration);
+  printf("transfer:  %llu bytes (%.2f MB/s)\n", total.bytes, total.bytes / 1048576.0 / duration);
+  printf("responses: %llu 2xx, %llu 3xx, %llu 4xx, %llu 5xx, %llu errors, %llu connects\n",
+    total.classes[2], total.classes[3], total.classes[4], total.classes[5], total.errors, total.connects);
+  printf("%-10s %10s %10s %10s %10s %10s %10s\n", "latency", "count", "mean", "p50", "p99", "p99.9", "max");
+  print_latency("all", all);
+  for (int k = 0; k < KINDS; k++)
+    if (kinds[k].weight) print_latency(kind_names[k], total.latencies[k]);
+  return total.errors ? 1 : 0;
+}
+
+// vim:set et:
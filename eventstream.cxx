@@ -0,0 +1,363 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "eventstream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+namespace tthttpd {
+
+#ifndef _WIN32
+
+// the events kept per file, and the longest line taken as one event; a
+// longer one is cut there. without inotify, files are checked every
+// EVENTSTREAM_INTERVAL milliseconds.
+#define EVENTSTREAM_RING (1024 * 1024)
+#define EVENTSTREAM_LINE_MAX 65536
+#define EVENTSTREAM_INTERVAL 1000
+
+EventStreamHub::EventStreamHub() {
+  notify_fd = -1;
+  wake[0] = wake[1] = -1;
+  running = false;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+EventStreamHub::~EventStreamHub() {
+  stop();
+  pthread_mutex_destroy(&mutex);
+}
+
+bool EventStreamHub::start() {
+  if (running)
+    return true;
+  if (pipe(wake) < 0)
+    return false;
+  for (int i = 0; i < 2; i++) {
+    fcntl(wake[i], F_SETFD, FD_CLOEXEC);
+    fcntl(wake[i], F_SETFL, fcntl(wake[i], F_GETFL) | O_NONBLOCK);
+  }
+#ifdef HAVE_SYS_INOTIFY_H
+  notify_fd = inotify_init();
+  if (notify_fd >= 0) {
+    fcntl(notify_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(notify_fd, F_SETFL, fcntl(notify_fd, F_GETFL) | O_NONBLOCK);
+  }
+#endif
+  running = true;
+  if (pthread_create(&thread, NULL, loop_thread, this)) {
+    running = false;
+    stop();
+    return false;
+  }
+  return true;
+}
+
+void EventStreamHub::stop() {
+  if (running) {
+    running = false;
+    if (write(wake[1], "", 1) < 0) {}
+    pthread_join(thread, NULL);
+  }
+  for (std::vector<Client>::iterator it = clients.begin(); it != clients.end(); it++)
+    close(it->fd);
+  clients.clear();
+  for (std::vector<Stream>::iterator it = streams.begin(); it != streams.end(); it++)
+    if (it->fd >= 0) close(it->fd);
+  streams.clear();
+  for (std::vector<Pending>::iterator it = pending.begin(); it != pending.end(); it++)
+    close(it->fd);
+  pending.clear();
+  if (notify_fd >= 0) close(notify_fd);
+  if (wake[0] >= 0) close(wake[0]);
+  if (wake[1] >= 0) close(wake[1]);
+  notify_fd = wake[0] = wake[1] = -1;
+}
+
+void EventStreamHub::attach(int fd, const std::string& path, const std::string& last_id) {
+  Pending p;
+  p.fd = fd;
+  p.path = path;
+  p.last_id = last_id;
+  pthread_mutex_lock(&mutex);
+  pending.push_back(p);
+  pthread_mutex_unlock(&mutex);
+  if (write(wake[1], "", 1) < 0) {}
+}
+
+void* EventStreamHub::loop_thread(void* param) {
+  ((EventStreamHub*)param)->loop();
+  return NULL;
+}
+
+// the directory is watched rather than the file, which may not exist yet
+// or be replaced when logs are rotated. only what is appended after the
+// first client came is sent.
+int EventStreamHub::open_stream(const std::string& path) {
+  Stream stream;
+  stream.path = path;
+  size_t end_pos = path.find_last_of('/');
+  std::string dir = end_pos == std::string::npos ? "." : end_pos == 0 ? "/" : path.substr(0, end_pos);
+  stream.name = end_pos == std::string::npos ? path : path.substr(end_pos + 1);
+  stream.wd = -1;
+#ifdef HAVE_SYS_INOTIFY_H
+  if (notify_fd >= 0)
+    stream.wd = inotify_add_watch(notify_fd, dir.c_str(), IN_MODIFY | IN_CREATE | IN_MOVED_TO);
+#endif
+  stream.fd = open(path.c_str(), O_RDONLY);
+  stream.dev = 0;
+  stream.ino = 0;
+  struct stat st;
+  if (stream.fd >= 0 && fstat(stream.fd, &st) == 0) {
+    fcntl(stream.fd, F_SETFD, FD_CLOEXEC);
+    lseek(stream.fd, 0, SEEK_END);
+    stream.dev = st.st_dev;
+    stream.ino = st.st_ino;
+  }
+  stream.ring.resize(EVENTSTREAM_RING);
+  stream.head = 0;
+  streams.push_back(stream);
+  return (int)streams.size() - 1;
+}
+
+void EventStreamHub::read_stream(Stream& stream) {
+  // a new file under the name is read from its start.
+  struct stat st;
+  if (stat(stream.path.c_str(), &st) == 0 && (stream.fd < 0 || st.st_dev != stream.dev || st.st_ino != stream.ino)) {
+    int fd = open(stream.path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      if (stream.fd >= 0) close(stream.fd);
+      stream.fd = fd;
+      stream.dev = st.st_dev;
+      stream.ino = st.st_ino;
+      stream.partial.clear();
+    }
+  }
+  if (stream.fd < 0)
+    return;
+  // and a truncated one from its new end.
+  if (fstat(stream.fd, &st) == 0 && st.st_size < lseek(stream.fd, 0, SEEK_CUR)) {
+    lseek(stream.fd, 0, SEEK_SET);
+    stream.partial.clear();
+  }
+
+  char buf[65536];
+  ssize_t r;
+  while ((r = read(stream.fd, buf, sizeof(buf))) > 0) {
+    size_t pos = 0;
+    while (pos < (size_t)r) {
+      const char* eol = (const char*) memchr(buf + pos, '\n', r - pos);
+      size_t len = eol ? eol - (buf + pos) : r - pos;
+      stream.partial.append(buf + pos, len);
+      pos += len;
+      if (eol) {
+        pos++;
+        if (!stream.partial.empty() && stream.partial[stream.partial.size()-1] == '\r')
+          stream.partial.resize(stream.partial.size() - 1);
+        add_event(stream, stream.partial);
+        stream.partial.clear();
+      } else if (stream.partial.size() >= EVENTSTREAM_LINE_MAX) {
+        add_event(stream, stream.partial);
+        stream.partial.clear();
+      }
+    }
+  }
+}
+
+// "id: N\ndata: line\n\n", where N is the ring offset the event ends at,
+// which is where a client sending it back as Last-Event-ID goes on.
+void EventStreamHub::add_event(Stream& stream, const std::string& line) {
+  std::string body = "\ndata: " + line + "\n\n";
+  char id[32];
+  size_t digits = 1;
+  while (true) {
+    sprintf(id, "%llu", stream.head + 4 + digits + body.size());
+    if (strlen(id) == digits) break;
+    digits = strlen(id);
+  }
+  std::string event = std::string("id: ") + id + body;
+
+  size_t size = stream.ring.size();
+  size_t pos = (size_t)(stream.head % size);
+  size_t first = event.size() < size - pos ? event.size() : size - pos;
+  memcpy(&stream.ring[pos], event.data(), first);
+  memcpy(&stream.ring[0], event.data() + first, event.size() - first);
+  stream.head += event.size();
+}
+
+// false when the client is gone or was overtaken by the ring.
+bool EventStreamHub::send_events(Client& client) {
+  Stream& stream = streams[client.stream];
+  size_t size = stream.ring.size();
+  while (client.cursor < stream.head) {
+    if (stream.head - client.cursor > size)
+      return false;
+    size_t pos = (size_t)(client.cursor % size);
+    size_t len = (size_t)(stream.head - client.cursor);
+    if (len > size - pos)
+      len = size - pos;
+    ssize_t r = send(client.fd, &stream.ring[pos], len, 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (r <= 0) return false;
+    client.cursor += r;
+  }
+  return true;
+}
+
+void EventStreamHub::accept_pending() {
+  std::vector<Pending> list;
+  pthread_mutex_lock(&mutex);
+  list.swap(pending);
+  pthread_mutex_unlock(&mutex);
+
+  for (std::vector<Pending>::iterator it = list.begin(); it != list.end(); it++) {
+    int index = 0;
+    while (index < (int)streams.size() && streams[index].path != it->path)
+      index++;
+    if (index == (int)streams.size())
+      index = open_stream(it->path);
+    const Stream& stream = streams[index];
+    Client client;
+    client.fd = it->fd;
+    client.stream = index;
+    client.cursor = stream.head;
+    if (!it->last_id.empty()) {
+      // only the end of an event still in the ring is a place to go on
+      // from: "\n\n" just before it, and the next event's "id: " at it.
+      // any other id, as one from before a restart, gets new events only.
+      unsigned long long id = strtoull(it->last_id.c_str(), NULL, 10);
+      size_t size = stream.ring.size();
+      if (id >= 2 && id <= stream.head && stream.head - id + 2 <= size &&
+          stream.ring[(size_t)((id - 2) % size)] == '\n' &&
+          stream.ring[(size_t)((id - 1) % size)] == '\n' &&
+          (id == stream.head || stream.ring[(size_t)(id % size)] == 'i'))
+        client.cursor = id;
+    }
+    fcntl(client.fd, F_SETFL, fcntl(client.fd, F_GETFL) | O_NONBLOCK);
+    clients.push_back(client);
+  }
+}
+
+void EventStreamHub::loop() {
+  std::vector<struct pollfd> pfds;
+  char buf[4096];
+
+  while (running) {
+    pfds.clear();
+    struct pollfd pfd;
+    pfd.fd = wake[0];
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    pfds.push_back(pfd);
+    pfd.fd = notify_fd;
+    pfds.push_back(pfd);
+    for (std::vector<Client>::iterator it = clients.begin(); it != clients.end(); it++) {
+      pfd.fd = it->fd;
+      pfd.events = POLLIN;
+      if (it->cursor < streams[it->stream].head)
+        pfd.events |= POLLOUT;
+      pfds.push_back(pfd);
+    }
+
+    int r = poll(&pfds[0], pfds.size(), notify_fd < 0 ? EVENTSTREAM_INTERVAL : -1);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (!running)
+      break;
+
+    // clients are served before new events, so each one in pfds is still
+    // at its index; the ones dropped are swapped with the last.
+    size_t count = clients.size();
+    for (size_t i = count; i-- > 0;) {
+      short revents = pfds[2 + i].revents;
+      if (!revents)
+        continue;
+      bool gone = false;
+      if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        // nothing is expected from a client but its going away.
+        ssize_t n = recv(clients[i].fd, buf, sizeof(buf), 0);
+        gone = n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR);
+      }
+      if (!gone && (revents & POLLOUT))
+        gone = !send_events(clients[i]);
+      if (gone) {
+        close(clients[i].fd);
+        clients[i] = clients.back();
+        clients.pop_back();
+      }
+    }
+
+    if (notify_fd < 0) {
+      for (std::vector<Stream>::iterator it = streams.begin(); it != streams.end(); it++)
+        read_stream(*it);
+    }
+#ifdef HAVE_SYS_INOTIFY_H
+    if (notify_fd >= 0 && pfds[1].revents) {
+      long events[4096 / sizeof(long)];
+      ssize_t n;
+      std::vector<bool> changed(streams.size(), false);
+      while ((n = read(notify_fd, events, sizeof(events))) > 0) {
+        for (char* p = (char*) events; p < (char*) events + n;) {
+          struct inotify_event* ev = (struct inotify_event*) p;
+          for (size_t i = 0; i < streams.size(); i++) {
+            if (streams[i].wd == ev->wd && ev->len && streams[i].name == ev->name)
+              changed[i] = true;
+          }
+          p += sizeof(struct inotify_event) + ev->len;
+        }
+      }
+      for (size_t i = 0; i < streams.size(); i++)
+        if (changed[i]) read_stream(streams[i]);
+    }
+#endif
+
+    if (pfds[0].revents) {
+      while (read(wake[0], buf, sizeof(buf)) > 0) {}
+      accept_pending();
+    }
+  }
+}
+
+#endif
+
+}
+
+// vim:set et:
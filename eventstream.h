@@ -0,0 +1,97 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _EVENTSTREAM_H_
+#define _EVENTSTREAM_H_
+
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <pthread.h>
+#endif
+
+namespace tthttpd {
+
+#ifndef _WIN32
+
+// files tailed as text/event-stream for any number of clients, served by
+// one thread. each line appended to a file is read once, made into an
+// event and kept in a ring shared by the file's clients. a client is only
+// a cursor into that ring, and one that falls a whole ring behind is
+// dropped. event ids are ring offsets, so a client coming back with
+// Last-Event-ID resumes where it left off while the ring still has it.
+class EventStreamHub {
+public:
+  EventStreamHub();
+  ~EventStreamHub();
+  bool start();
+  void stop();
+  // takes over a client socket whose response headers were sent.
+  void attach(int fd, const std::string& path, const std::string& last_id);
+private:
+  typedef struct {
+    std::string path;
+    std::string name;
+    int fd;
+    int wd;
+    dev_t dev;
+    ino_t ino;
+    std::string partial;
+    std::vector<char> ring;
+    unsigned long long head;
+  } Stream;
+  typedef struct {
+    int fd;
+    int stream;
+    unsigned long long cursor;
+  } Client;
+  typedef struct {
+    int fd;
+    std::string path;
+    std::string last_id;
+  } Pending;
+  std::vector<Stream> streams;
+  std::vector<Client> clients;
+  std::vector<Pending> pending;
+  int notify_fd;
+  int wake[2];
+  bool running;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  static void* loop_thread(void* param);
+  void loop();
+  void accept_pending();
+  int open_stream(const std::string& path);
+  void read_stream(Stream& stream);
+  void add_event(Stream& stream, const std::string& line);
+  bool send_events(Client& client);
+};
+
+#endif
+
+}
+
+#endif /* _EVENTSTREAM_H_ */
+
+// vim:set et:
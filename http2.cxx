@@ -0,0 +1,1340 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "http2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#endif
+
+namespace tthttpd {
+
+#ifndef _WIN32
+
+// what we announce in SETTINGS, and how much we hold for the client and
+// for each stream.
+#define H2_FRAME_MAX 16384
+#define H2_STREAMS_MAX 100
+#define H2_WINDOW 262144
+#define H2_CONNECTION_WINDOW (16 * 1024 * 1024)
+#define H2_HEADER_MAX 65536
+#define H2_TABLE_SIZE 4096
+#define H2_STREAM_BUFFER 65536
+#define H2_OUTPUT_MAX 65536
+// seconds the client may leave our frames unread.
+#define H2_SEND_TIMEOUT 3
+
+enum {
+  H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+  H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION
+};
+
+enum {
+  H2_END_STREAM = 0x1,
+  H2_ACK = 0x1,
+  H2_END_HEADERS = 0x4,
+  H2_PADDED = 0x8,
+  H2_PRIORITY_FLAG = 0x20
+};
+
+enum {
+  H2_NO_ERROR, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR,
+  H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR,
+  H2_REFUSED_STREAM, H2_CANCEL, H2_COMPRESSION_ERROR, H2_CONNECT_ERROR,
+  H2_ENHANCE_YOUR_CALM
+};
+
+// the chunked response parser of a stream.
+enum { CHUNK_SIZE, CHUNK_DATA, CHUNK_CRLF, CHUNK_TRAILER, CHUNK_DONE };
+
+static const char* const hpack_static[][2] = {
+  {":authority", ""},
+  {":method", "GET"},
+  {":method", "POST"},
+  {":path", "/"},
+  {":path", "/index.html"},
+  {":scheme", "http"},
+  {":scheme", "https"},
+  {":status", "200"},
+  {":status", "204"},
+  {":status", "206"},
+  {":status", "304"},
+  {":status", "400"},
+  {":status", "404"},
+  {":status", "500"},
+  {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"},
+  {"accept-language", ""},
+  {"accept-ranges", ""},
+  {"accept", ""},
+  {"access-control-allow-origin", ""},
+  {"age", ""},
+  {"allow", ""},
+  {"authorization", ""},
+  {"cache-control", ""},
+  {"content-disposition", ""},
+  {"content-encoding", ""},
+  {"content-language", ""},
+  {"content-length", ""},
+  {"content-location", ""},
+  {"content-range", ""},
+  {"content-type", ""},
+  {"cookie", ""},
+  {"date", ""},
+  {"etag", ""},
+  {"expect", ""},
+  {"expires", ""},
+  {"from", ""},
+  {"host", ""},
+  {"if-match", ""},
+  {"if-modified-since", ""},
+  {"if-none-match", ""},
+  {"if-range", ""},
+  {"if-unmodified-since", ""},
+  {"last-modified", ""},
+  {"link", ""},
+  {"location", ""},
+  {"max-forwards", ""},
+  {"proxy-authenticate", ""},
+  {"proxy-authorization", ""},
+  {"range", ""},
+  {"referer", ""},
+  {"refresh", ""},
+  {"retry-after", ""},
+  {"server", ""},
+  {"set-cookie", ""},
+  {"strict-transport-security", ""},
+  {"transfer-encoding", ""},
+  {"user-agent", ""},
+  {"vary", ""},
+  {"via", ""},
+  {"www-authenticate", ""}
+};
+
+#define HPACK_STATIC_SIZE 61
+
+static const struct {
+  unsigned int code;
+  int bits;
+} hpack_huffman[257] = {
+  {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+  {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+  {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+  {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+  {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+  {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+  {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+  {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+  {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+  {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+  {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+  {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+  {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+  {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+  {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+  {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+  {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+  {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+  {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+  {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+  {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+  {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+  {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+  {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+  {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+  {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+  {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+  {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+  {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+  {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+  {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+  {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+  {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+  {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+  {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+  {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+  {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+  {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+  {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+  {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+  {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+  {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+  {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+  {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+  {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+  {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+  {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+  {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+  {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+  {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+  {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+  {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+  {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+  {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+  {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+  {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+  {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+  {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+  {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+  {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+  {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+  {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+  {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+  {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+  {0x3fffffff, 30}
+};
+
+// the Huffman code as a binary tree; a negative child is the symbol
+// -(child + 1).
+static short huffman_tree[256][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_init() {
+  int nodes = 1;
+  for (int sym = 0; sym < 257; sym++) {
+    int node = 0;
+    for (int n = hpack_huffman[sym].bits - 1; n > 0; n--) {
+      int bit = (hpack_huffman[sym].code >> n) & 1;
+      if (!huffman_tree[node][bit])
+        huffman_tree[node][bit] = nodes++;
+      node = huffman_tree[node][bit];
+    }
+    huffman_tree[node][hpack_huffman[sym].code & 1] = -(sym + 1);
+  }
+}
+
+static bool huffman_decode(const unsigned char* data, size_t size, std::string& s) {
+  pthread_once(&huffman_once, huffman_init);
+  int node = 0, depth = 0;
+  bool ones = true;
+  for (size_t n = 0; n < size; n++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      int b = (data[n] >> bit) & 1;
+      int next = huffman_tree[node][b];
+      if (next < 0) {
+        if (next == -257)
+          return false;
+        s += (char)(-next - 1);
+        node = depth = 0;
+        ones = true;
+      } else if (next == 0)
+        return false;
+      else {
+        node = next;
+        depth++;
+        ones = ones && b;
+      }
+    }
+  }
+  // what is left must be a prefix of EOS shorter than a byte.
+  return depth < 8 && ones;
+}
+
+static size_t huffman_length(const std::string& s) {
+  size_t bits = 0;
+  for (size_t n = 0; n < s.size(); n++)
+    bits += hpack_huffman[(unsigned char) s[n]].bits;
+  return (bits + 7) / 8;
+}
+
+static void huffman_encode(const std::string& s, std::string& out) {
+  unsigned long long bits = 0;
+  int nbits = 0;
+  for (size_t n = 0; n < s.size(); n++) {
+    const int sym = (unsigned char) s[n];
+    bits = (bits << hpack_huffman[sym].bits) | hpack_huffman[sym].code;
+    nbits += hpack_huffman[sym].bits;
+    while (nbits >= 8) {
+      nbits -= 8;
+      out += (char)(bits >> nbits);
+    }
+    bits &= (1ULL << nbits) - 1;
+  }
+  if (nbits)
+    out += (char)((bits << (8 - nbits)) | (0xff >> nbits));
+}
+
+static void hpack_put_integer(std::string& out, unsigned char first, int prefix, size_t value) {
+  size_t max = (1 << prefix) - 1;
+  if (value < max) {
+    out += (char)(first | value);
+    return;
+  }
+  out += (char)(first | max);
+  for (value -= max; value >= 128; value /= 128)
+    out += (char)(value % 128 + 128);
+  out += (char) value;
+}
+
+static bool hpack_get_integer(const unsigned char*& p, const unsigned char* end, int prefix, size_t& value) {
+  size_t max = (1 << prefix) - 1;
+  value = *p++ & max;
+  if (value < max)
+    return true;
+  for (int shift = 0; p < end && shift < 28; shift += 7) {
+    unsigned char b = *p++;
+    value += (size_t)(b & 127) << shift;
+    if (!(b & 128))
+      return true;
+  }
+  return false;
+}
+
+static void hpack_put_string(std::string& out, const std::string& s) {
+  size_t length = huffman_length(s);
+  if (length < s.size()) {
+    hpack_put_integer(out, 0x80, 7, length);
+    huffman_encode(s, out);
+  } else {
+    hpack_put_integer(out, 0, 7, s.size());
+    out += s;
+  }
+}
+
+static bool hpack_get_string(const unsigned char*& p, const unsigned char* end, std::string& s) {
+  if (p >= end)
+    return false;
+  bool huffman = (*p & 0x80) != 0;
+  size_t length;
+  if (!hpack_get_integer(p, end, 7, length) || length > (size_t)(end - p))
+    return false;
+  s.clear();
+  if (huffman) {
+    if (!huffman_decode(p, length, s))
+      return false;
+  } else
+    s.assign((const char*) p, length);
+  p += length;
+  return true;
+}
+
+static size_t hpack_entry_size(const HeaderField& field) {
+  return field.first.size() + field.second.size() + 32;
+}
+
+HpackDecoder::HpackDecoder() {
+  size = 0;
+  limit = max_size = H2_TABLE_SIZE;
+}
+
+bool HpackDecoder::lookup(size_t index, HeaderField& field) const {
+  if (index == 0)
+    return false;
+  if (index <= HPACK_STATIC_SIZE) {
+    field.first = hpack_static[index - 1][0];
+    field.second = hpack_static[index - 1][1];
+    return true;
+  }
+  index -= HPACK_STATIC_SIZE + 1;
+  if (index >= table.size())
+    return false;
+  field = table[index];
+  return true;
+}
+
+void HpackDecoder::insert(const HeaderField& field) {
+  size_t entry = hpack_entry_size(field);
+  while (!table.empty() && size + entry > limit) {
+    size -= hpack_entry_size(table.back());
+    table.pop_back();
+  }
+  if (entry <= limit) {
+    table.push_front(field);
+    size += entry;
+  }
+}
+
+bool HpackDecoder::decode(const unsigned char* data, size_t length, HeaderList& headers) {
+  const unsigned char* p = data;
+  const unsigned char* end = data + length;
+  size_t total = 0;
+  while (p < end) {
+    HeaderField field;
+    size_t index;
+    if (*p & 0x80) {
+      if (!hpack_get_integer(p, end, 7, index) || !lookup(index, field))
+        return false;
+    } else if ((*p & 0xe0) == 0x20) {
+      // dynamic table size update
+      if (!hpack_get_integer(p, end, 5, index) || index > max_size)
+        return false;
+      limit = index;
+      while (!table.empty() && size > limit) {
+        size -= hpack_entry_size(table.back());
+        table.pop_back();
+      }
+      continue;
+    } else {
+      bool indexing = (*p & 0xc0) == 0x40;
+      if (!hpack_get_integer(p, end, indexing ? 6 : 4, index))
+        return false;
+      if (index) {
+        if (!lookup(index, field))
+          return false;
+      } else if (!hpack_get_string(p, end, field.first))
+        return false;
+      if (!hpack_get_string(p, end, field.second))
+        return false;
+      if (indexing)
+        insert(field);
+    }
+    total += hpack_entry_size(field);
+    if (total > H2_HEADER_MAX)
+      return false;
+    headers.push_back(field);
+  }
+  return true;
+}
+
+HpackEncoder::HpackEncoder() {
+  size = 0;
+  limit = H2_TABLE_SIZE;
+  resized = false;
+}
+
+void HpackEncoder::set_max_size(size_t max_size) {
+  max_size = std::min(max_size, (size_t) H2_TABLE_SIZE);
+  if (max_size == limit)
+    return;
+  limit = max_size;
+  resized = true;
+  while (!table.empty() && size > limit) {
+    size -= hpack_entry_size(table.back());
+    table.pop_back();
+  }
+}
+
+void HpackEncoder::insert(const HeaderField& field) {
+  size_t entry = hpack_entry_size(field);
+  while (!table.empty() && size + entry > limit) {
+    size -= hpack_entry_size(table.back());
+    table.pop_back();
+  }
+  if (entry <= limit) {
+    table.push_front(field);
+    size += entry;
+  }
+}
+
+void HpackEncoder::encode(const HeaderList& headers, std::string& out) {
+  // fields that change from response to response only fill the table.
+  static const char* const literals[] = {
+    "age", "content-length", "content-range", "date", "etag", "expires",
+    "last-modified", "location", "set-cookie", NULL
+  };
+  if (resized) {
+    hpack_put_integer(out, 0x20, 5, limit);
+    resized = false;
+  }
+  for (HeaderList::const_iterator it = headers.begin(); it != headers.end(); it++) {
+    size_t index = 0, name_index = 0;
+    for (size_t n = 0; n < HPACK_STATIC_SIZE && !index; n++) {
+      if (it->first != hpack_static[n][0]) continue;
+      if (!name_index) name_index = n + 1;
+      if (it->second == hpack_static[n][1]) index = n + 1;
+    }
+    for (size_t n = 0; n < table.size() && !index; n++) {
+      if (it->first != table[n].first) continue;
+      if (!name_index) name_index = n + HPACK_STATIC_SIZE + 1;
+      if (it->second == table[n].second) index = n + HPACK_STATIC_SIZE + 1;
+    }
+    if (index) {
+      hpack_put_integer(out, 0x80, 7, index);
+      continue;
+    }
+    bool indexing = true;
+    for (const char* const* literal = literals; *literal && indexing; literal++)
+      indexing = it->first != *literal;
+    hpack_put_integer(out, indexing ? 0x40 : 0, indexing ? 6 : 4, name_index);
+    if (!name_index)
+      hpack_put_string(out, it->first);
+    hpack_put_string(out, it->second);
+    if (indexing)
+      insert(*it);
+  }
+}
+
+static void put32(unsigned char* p, unsigned long value) {
+  p[0] = (unsigned char)(value >> 24);
+  p[1] = (unsigned char)(value >> 16);
+  p[2] = (unsigned char)(value >> 8);
+  p[3] = (unsigned char) value;
+}
+
+static unsigned long get32(const unsigned char* p) {
+  return ((unsigned long) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+Http2Session::Http2Session(const server::HttpdInfo& _info, int _sock, void* (*_handler)(void*)) : info(_info) {
+  sock = _sock;
+  handler = _handler;
+  block_id = 0;
+  block_end_stream = false;
+  block_weight = 16;
+  last_id = 0;
+  send_window = initial_window = 65535;
+  credit = 0;
+  max_frame = 16384;
+  vclock = 0;
+  sent_at = time(NULL);
+  goaway_received = false;
+  failed = false;
+}
+
+Http2Session::~Http2Session() {
+  // a stream thread still at work sees its client go away.
+  for (std::map<unsigned int, Stream>::iterator it = streams.begin(); it != streams.end(); it++)
+    if (it->second.fd >= 0)
+      close(it->second.fd);
+}
+
+void Http2Session::frame(int type, int flags, unsigned int id, const char* data, size_t size) {
+  unsigned char head[9];
+  head[0] = (unsigned char)(size >> 16);
+  head[1] = (unsigned char)(size >> 8);
+  head[2] = (unsigned char) size;
+  head[3] = (unsigned char) type;
+  head[4] = (unsigned char) flags;
+  put32(head + 5, id & 0x7fffffff);
+  out.append((const char*) head, 9);
+  if (size)
+    out.append(data, size);
+}
+
+void Http2Session::connection_error(int code) {
+  unsigned char payload[8];
+  put32(payload, last_id);
+  put32(payload + 4, code);
+  frame(H2_GOAWAY, 0, 0, (const char*) payload, 8);
+  failed = true;
+}
+
+void Http2Session::reset(unsigned int id, int code) {
+  unsigned char payload[4];
+  put32(payload, code);
+  frame(H2_RST_STREAM, 0, id, (const char*) payload, 4);
+  close_stream(id);
+}
+
+void Http2Session::close_stream(unsigned int id) {
+  std::map<unsigned int, Stream>::iterator it = streams.find(id);
+  if (it == streams.end())
+    return;
+  if (it->second.fd >= 0)
+    close(it->second.fd);
+  streams.erase(it);
+}
+
+// applies a SETTINGS payload from the client. returns false on a
+// connection error.
+bool Http2Session::settings(const unsigned char* data, size_t size) {
+  for (size_t n = 0; n + 6 <= size; n += 6) {
+    int param = (data[n] << 8) | data[n + 1];
+    unsigned long value = get32(data + n + 2);
+    switch (param) {
+    case 1:  // HEADER_TABLE_SIZE
+      encoder.set_max_size(value);
+      break;
+    case 2:  // ENABLE_PUSH; we never push.
+      if (value > 1) {
+        connection_error(H2_PROTOCOL_ERROR);
+        return false;
+      }
+      break;
+    case 4:  // INITIAL_WINDOW_SIZE
+      if (value > 0x7fffffff) {
+        connection_error(H2_FLOW_CONTROL_ERROR);
+        return false;
+      }
+      for (std::map<unsigned int, Stream>::iterator it = streams.begin(); it != streams.end(); it++)
+        it->second.send_window += (long long) value - initial_window;
+      initial_window = value;
+      break;
+    case 5:  // MAX_FRAME_SIZE
+      if (value < 16384 || value > 16777215) {
+        connection_error(H2_PROTOCOL_ERROR);
+        return false;
+      }
+      max_frame = value;
+      break;
+    }
+  }
+  return true;
+}
+
+bool Http2Session::upgrade(const std::string& settings_b64, const std::string& request) {
+  // HTTP2-Settings is base64url without padding.
+  std::string encoded = settings_b64;
+  std::replace(encoded.begin(), encoded.end(), '-', '+');
+  std::replace(encoded.begin(), encoded.end(), '_', '/');
+  std::string payload = base64_decode(encoded);
+  if (payload.size() % 6 || !settings((const unsigned char*) payload.data(), payload.size()))
+    return false;
+  last_id = 1;
+  Stream& stream = new_stream(1, 16);
+  stream.request = request;
+  stream.head_left = request.size();
+  stream.remote_closed = true;
+  start_stream(1, stream);
+  return true;
+}
+
+bool Http2Session::input() {
+  size_t pos = 0;
+  while (!failed && in.size() - pos >= 9) {
+    const unsigned char* head = (const unsigned char*) in.data() + pos;
+    size_t size = (head[0] << 16) | (head[1] << 8) | head[2];
+    int type = head[3], flags = head[4];
+    unsigned int id = get32(head + 5) & 0x7fffffff;
+    if (size > H2_FRAME_MAX) {
+      connection_error(H2_FRAME_SIZE_ERROR);
+      return false;
+    }
+    if (in.size() - pos < 9 + size)
+      break;
+    // nothing may come between a header block and its continuations.
+    if (block_id && (type != H2_CONTINUATION || id != block_id)) {
+      connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    if (!dispatch(type, flags, id, head + 9, size))
+      return false;
+    pos += 9 + size;
+  }
+  in.erase(0, pos);
+  return !failed;
+}
+
+bool Http2Session::dispatch(int type, int flags, unsigned int id, const unsigned char* data, size_t size) {
+  std::map<unsigned int, Stream>::iterator it = streams.find(id);
+  switch (type) {
+  case H2_DATA: {
+    if (!id) {
+      connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    // the connection window is given back as soon as data arrives; what
+    // is held for the streams is bounded by their own windows.
+    credit += size;
+    if (credit >= H2_CONNECTION_WINDOW / 2) {
+      unsigned char payload[4];
+      put32(payload, (unsigned long) credit);
+      frame(H2_WINDOW_UPDATE, 0, 0, (const char*) payload, 4);
+      credit = 0;
+    }
+    size_t pad = 0;
+    if (flags & H2_PADDED) {
+      if (!size || (size_t) data[0] + 1 > size) {
+        connection_error(H2_PROTOCOL_ERROR);
+        return false;
+      }
+      pad = data[0] + 1;
+    }
+    if (it == streams.end() || it->second.remote_closed) {
+      if (id > last_id) {
+        connection_error(H2_PROTOCOL_ERROR);
+        return false;
+      }
+      reset(id, H2_STREAM_CLOSED);
+      return true;
+    }
+    Stream& stream = it->second;
+    stream.recv_window -= size;
+    if (stream.recv_window < 0) {
+      reset(id, H2_FLOW_CONTROL_ERROR);
+      return true;
+    }
+    stream.credit += pad;
+    size -= pad;
+    if (stream.chunked_body && size) {
+      char head[32];
+      int head_len = sprintf(head, "%lx\r\n", (unsigned long) size);
+      stream.request.append(head, head_len);
+      stream.framing += head_len + 2;
+    }
+    stream.request.append((const char*) data + (pad ? 1 : 0), size);
+    if (stream.chunked_body && size)
+      stream.request += "\r\n";
+    if (flags & H2_END_STREAM)
+      end_request(stream);
+    else
+      update_window(id, stream);
+    return true;
+  }
+  case H2_HEADERS: {
+    if (!id || !(id & 1)) {
+      connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    size_t off = 0, pad = 0;
+    int weight = 16;
+    if (flags & H2_PADDED) {
+      if (size < 1) {
+        connection_error(H2_PROTOCOL_ERROR);
+        return false;
+      }
+      pad = data[0];
+      off = 1;
+    }
+    if (flags & H2_PRIORITY_FLAG) {
+      if (size < off + 5) {
+        connection_error(H2_PROTOCOL_ERROR);
+        return false;
+      }
+      // dependencies are not followed; the weight alone orders streams.
+      weight = data[off + 4] + 1;
+      off += 5;
+    }
+    if (off + pad > size) {
+      connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    block.assign((const char*) data + off, size - off - pad);
+    block_id = id;
+    block_end_stream = (flags & H2_END_STREAM) != 0;
+    block_weight = weight;
+    if (flags & H2_END_HEADERS)
+      return end_headers();
+    return true;
+  }
+  case H2_CONTINUATION:
+    if (!block_id) {
+      connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    block.append((const char*) data, size);
+    if (block.size() > H2_HEADER_MAX) {
+      connection_error(H2_ENHANCE_YOUR_CALM);
+      return false;
+    }
+    if (flags & H2_END_HEADERS)
+      return end_headers();
+    return true;
+  case H2_PRIORITY:
+    if (!id) {
+      connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    if (size != 5) {
+      reset(id, H2_FRAME_SIZE_ERROR);
+      return true;
+    }
+    if (it != streams.end())
+      it->second.weight = data[4] + 1;
+    return true;
+  case H2_RST_STREAM:
+    if (!id || id > last_id) {
+      connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    if (size != 4) {
+      connection_error(H2_FRAME_SIZE_ERROR);
+      return false;
+    }
+    close_stream(id);
+    return true;
+  case H2_SETTINGS:
+    if (id) {
+      connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    if ((flags & H2_ACK) ? size != 0 : size % 6 != 0) {
+      connection_error(H2_FRAME_SIZE_ERROR);
+      return false;
+    }
+    if (flags & H2_ACK)
+      return true;
+    if (!settings(data, size))
+      return false;
+    frame(H2_SETTINGS, H2_ACK, 0, NULL, 0);
+    return true;
+  case H2_PUSH_PROMISE:
+    connection_error(H2_PROTOCOL_ERROR);
+    return false;
+  case H2_PING:
+    if (id) {
+      connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    if (size != 8) {
+      connection_error(H2_FRAME_SIZE_ERROR);
+      return false;
+    }
+    if (!(flags & H2_ACK))
+      frame(H2_PING, H2_ACK, 0, (const char*) data, 8);
+    return true;
+  case H2_GOAWAY:
+    if (id) {
+      connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    goaway_received = true;
+    return true;
+  case H2_WINDOW_UPDATE: {
+    if (size != 4) {
+      connection_error(H2_FRAME_SIZE_ERROR);
+      return false;
+    }
+    long long increment = get32(data) & 0x7fffffff;
+    if (!id) {
+      send_window += increment;
+      if (!increment || send_window > 0x7fffffff) {
+        connection_error(increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+        return false;
+      }
+    } else if (it != streams.end()) {
+      it->second.send_window += increment;
+      if (!increment)
+        reset(id, H2_PROTOCOL_ERROR);
+      else if (it->second.send_window > 0x7fffffff)
+        reset(id, H2_FLOW_CONTROL_ERROR);
+    }
+    return true;
+  }
+  }
+  // unknown frame types are ignored.
+  return true;
+}
+
+bool Http2Session::end_headers() {
+  unsigned int id = block_id;
+  HeaderList headers;
+  block_id = 0;
+  // the block is decoded even when the stream is refused, to keep the
+  // dynamic table in step with the client.
+  if (!decoder.decode((const unsigned char*) block.data(), block.size(), headers)) {
+    connection_error(H2_COMPRESSION_ERROR);
+    return false;
+  }
+  block.clear();
+  std::map<unsigned int, Stream>::iterator it = streams.find(id);
+  if (it != streams.end()) {
+    // trailers, which end the request and are not passed on.
+    if (!block_end_stream || it->second.remote_closed)
+      reset(id, H2_PROTOCOL_ERROR);
+    else
+      end_request(it->second);
+    return true;
+  }
+  if (id <= last_id) {
+    connection_error(H2_PROTOCOL_ERROR);
+    return false;
+  }
+  last_id = id;
+  if (goaway_received || streams.size() >= H2_STREAMS_MAX) {
+    reset(id, H2_REFUSED_STREAM);
+    return true;
+  }
+  open_stream(id, headers, block_end_stream);
+  return true;
+}
+
+Http2Session::Stream& Http2Session::new_stream(unsigned int id, int weight) {
+  Stream& stream = streams[id];
+  stream.fd = -1;
+  stream.head_left = 0;
+  stream.chunked_body = false;
+  stream.framing = 0;
+  stream.remote_closed = false;
+  stream.recv_window = H2_WINDOW;
+  stream.credit = 0;
+  stream.headers_sent = false;
+  stream.eof = false;
+  stream.chunked = false;
+  stream.chunk_state = CHUNK_SIZE;
+  stream.chunk_left = 0;
+  stream.send_window = initial_window;
+  stream.weight = weight;
+  stream.vtime = vclock;
+  return stream;
+}
+
+// turns the request headers into an HTTP/1.1 request head for the stream.
+void Http2Session::open_stream(unsigned int id, const HeaderList& headers, bool end_stream) {
+  std::string method, path, authority, cookie, fields;
+  bool has_host = false, has_length = false, regular = false;
+  int weight = block_weight;
+  for (HeaderList::const_iterator it = headers.begin(); it != headers.end(); it++) {
+    const std::string& name = it->first;
+    const std::string& value = it->second;
+    // nothing may break out of its line in the HTTP/1.1 head.
+    if (name.empty() || name.find_first_of("\r\n", 0) != std::string::npos ||
+        value.find_first_of(std::string("\r\n\0", 3)) != std::string::npos) {
+      reset(id, H2_PROTOCOL_ERROR);
+      return;
+    }
+    if (name[0] == ':') {
+      if (regular) {
+        reset(id, H2_PROTOCOL_ERROR);
+        return;
+      }
+      if (name == ":method")
+        method = value;
+      else if (name == ":path")
+        path = value;
+      else if (name == ":authority")
+        authority = value;
+      else if (name != ":scheme") {
+        reset(id, H2_PROTOCOL_ERROR);
+        return;
+      }
+      continue;
+    }
+    regular = true;
+    if (name.find_first_of(": \tABCDEFGHIJKLMNOPQRSTUVWXYZ") != std::string::npos) {
+      reset(id, H2_PROTOCOL_ERROR);
+      return;
+    }
+    if (name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+        name == "transfer-encoding" || name == "upgrade" || name == "te")
+      continue;
+    if (name == "cookie") {
+      // split cookies are joined again for HTTP/1.1.
+      if (!cookie.empty()) cookie += "; ";
+      cookie += value;
+      continue;
+    }
+    if (name == "host")
+      has_host = true;
+    else if (name == "content-length")
+      has_length = true;
+    else if (name == "priority") {
+      // RFC 9218 urgency 0 (first) to 7 (last) as a weight.
+      size_t u = value.find("u=");
+      if (u != std::string::npos && value[u + 2] >= '0' && value[u + 2] <= '7')
+        weight = 256 >> (value[u + 2] - '0');
+    }
+    fields += name + ": " + value + "\r\n";
+  }
+  if (method.empty() || path.empty() || path.find(' ') != std::string::npos) {
+    reset(id, H2_PROTOCOL_ERROR);
+    return;
+  }
+  Stream& stream = new_stream(id, weight);
+  stream.request = method + " " + path + " HTTP/1.1\r\n";
+  if (!has_host && !authority.empty())
+    stream.request += "Host: " + authority + "\r\n";
+  stream.request += fields;
+  if (!cookie.empty())
+    stream.request += "Cookie: " + cookie + "\r\n";
+  stream.request += "Connection: close\r\n";
+  if (!end_stream && !has_length) {
+    // a body of no length goes on chunked, as it comes.
+    stream.request += "Transfer-Encoding: chunked\r\n";
+    stream.chunked_body = true;
+  }
+  stream.request += "\r\n";
+  stream.head_left = stream.request.size();
+  stream.remote_closed = end_stream;
+  start_stream(id, stream);
+}
+
+// hands the stream to a thread of its own, at the other end of a socket
+// pair.
+void Http2Session::start_stream(unsigned int id, Stream& stream) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    reset(id, H2_REFUSED_STREAM);
+    return;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  server::HttpdInfo* param = new server::HttpdInfo(info);
+  param->msgsock = fds[1];
+  param->stream = true;
+  pthread_t pth;
+  if (pthread_create(&pth, NULL, handler, param) != 0) {
+    delete param;
+    close(fds[0]);
+    close(fds[1]);
+    reset(id, H2_REFUSED_STREAM);
+    return;
+  }
+  pthread_detach(pth);
+  stream.fd = fds[0];
+}
+
+void Http2Session::end_request(Stream& stream) {
+  stream.remote_closed = true;
+  if (stream.chunked_body) {
+    stream.request += "0\r\n\r\n";
+    stream.framing += 5;
+  }
+}
+
+void Http2Session::update_window(unsigned int id, Stream& stream) {
+  if (stream.remote_closed || stream.credit < H2_WINDOW / 2)
+    return;
+  unsigned char payload[4];
+  put32(payload, (unsigned long) stream.credit);
+  frame(H2_WINDOW_UPDATE, 0, id, (const char*) payload, 4);
+  stream.recv_window += stream.credit;
+  stream.credit = 0;
+}
+
+// answers a stream here, without a handler.
+void Http2Session::respond(unsigned int id, const char* status) {
+  HeaderList headers;
+  headers.push_back(HeaderField(":status", status));
+  headers.push_back(HeaderField("content-length", "0"));
+  send_headers(id, headers, true);
+  reset(id, H2_NO_ERROR);
+}
+
+// writes what the stream has of its request to the handler.
+void Http2Session::stream_input(unsigned int id, Stream& stream) {
+  while (!stream.request.empty()) {
+    ssize_t n = send(stream.fd, stream.request.data(), stream.request.size(), 0);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        break;
+      // the handler did not want the body, as for a 401.
+      stream.request.clear();
+      stream.framing = 0;
+      break;
+    }
+    // only the body counts against the window. chunk framing is taken off
+    // as soon as it could have gone, which at worst gives credit late.
+    size_t head = std::min((size_t) n, stream.head_left);
+    size_t framing = std::min((size_t) n - head, stream.framing);
+    stream.head_left -= head;
+    stream.framing -= framing;
+    stream.credit += n - head - framing;
+    stream.request.erase(0, n);
+  }
+  update_window(id, stream);
+}
+
+// reads the response of the handler: the head once, then the body.
+void Http2Session::stream_output(unsigned int id, Stream& stream) {
+  char buf[16384];
+  ssize_t n = recv(stream.fd, buf, sizeof(buf), 0);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+  if (n <= 0) {
+    close(stream.fd);
+    stream.fd = -1;
+    if (!stream.headers_sent)
+      reset(id, H2_INTERNAL_ERROR);
+    else
+      stream.eof = true;
+    return;
+  }
+  if (stream.eof)
+    return;
+  stream.in.append(buf, n);
+  if (!stream.headers_sent && !stream_headers(id, stream))
+    return;
+  stream_body(stream);
+}
+
+bool Http2Session::stream_headers(unsigned int id, Stream& stream) {
+  while (true) {
+    size_t end = stream.in.find("\r\n\r\n"), skip = 4;
+    size_t lf = stream.in.find("\n\n");
+    if (lf != std::string::npos && (end == std::string::npos || lf < end)) {
+      end = lf;
+      skip = 2;
+    }
+    if (end == std::string::npos) {
+      if (stream.in.size() > H2_HEADER_MAX)
+        reset(id, H2_INTERNAL_ERROR);
+      return false;
+    }
+    std::vector<std::string> lines;
+    split_string(stream.in.substr(0, end), "\n", lines);
+    stream.in.erase(0, end + skip);
+    for (size_t n = 0; n < lines.size(); n++)
+      if (!lines[n].empty() && lines[n][lines[n].size() - 1] == '\r')
+        lines[n].resize(lines[n].size() - 1);
+
+    HeaderList headers;
+    std::string status = lines.empty() ? "" : lines[0];
+    size_t sp = status.find(' ');
+    status = sp == std::string::npos ? "" : status.substr(sp + 1, 3);
+    if (status.size() != 3 || !isdigit(status[0])) {
+      reset(id, H2_INTERNAL_ERROR);
+      return false;
+    }
+    headers.push_back(HeaderField(":status", status));
+    for (size_t n = 1; n < lines.size(); n++) {
+      size_t colon = lines[n].find(':');
+      if (colon == std::string::npos) continue;
+      std::string name = trim_string(lines[n].substr(0, colon));
+      std::string value = trim_string(lines[n].substr(colon + 1));
+      std::transform(name.begin(), name.end(), name.begin(), tolower);
+      if (name == "transfer-encoding") {
+        if (value.find("chunked") != std::string::npos)
+          stream.chunked = true;
+        continue;
+      }
+      if (name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "upgrade")
+        continue;
+      headers.push_back(HeaderField(name, value));
+    }
+    if (status[0] == '1') {
+      // interim responses (100 Continue) go out as they are.
+      send_headers(id, headers, false);
+      continue;
+    }
+    send_headers(id, headers, false);
+    stream.headers_sent = true;
+    return true;
+  }
+}
+
+// takes the body bytes in `in', chunked or not, over to `out'.
+void Http2Session::stream_body(Stream& stream) {
+  if (!stream.chunked) {
+    stream.out += stream.in;
+    stream.in.clear();
+    return;
+  }
+  while (!stream.in.empty() && stream.chunk_state != CHUNK_DONE) {
+    if (stream.chunk_state == CHUNK_DATA) {
+      size_t n = std::min((size_t) stream.chunk_left, stream.in.size());
+      stream.out.append(stream.in, 0, n);
+      stream.in.erase(0, n);
+      stream.chunk_left -= n;
+      if (!stream.chunk_left)
+        stream.chunk_state = CHUNK_CRLF;
+      continue;
+    }
+    size_t eol = stream.in.find('\n');
+    if (eol == std::string::npos)
+      break;
+    std::string line = stream.in.substr(0, eol);
+    if (!line.empty() && line[line.size() - 1] == '\r')
+      line.resize(line.size() - 1);
+    stream.in.erase(0, eol + 1);
+    if (stream.chunk_state == CHUNK_CRLF)
+      stream.chunk_state = CHUNK_SIZE;
+    else if (stream.chunk_state == CHUNK_SIZE) {
+      stream.chunk_left = strtoul(line.c_str(), NULL, 16);
+      stream.chunk_state = stream.chunk_left ? CHUNK_DATA : CHUNK_TRAILER;
+    } else if (line.empty())
+      stream.chunk_state = CHUNK_DONE;
+  }
+  if (stream.chunk_state == CHUNK_DONE) {
+    stream.in.clear();
+    stream.eof = true;
+  }
+}
+
+void Http2Session::send_headers(unsigned int id, const HeaderList& headers, bool end_stream) {
+  std::string encoded;
+  encoder.encode(headers, encoded);
+  size_t pos = 0;
+  do {
+    size_t n = std::min(encoded.size() - pos, max_frame);
+    int flags = pos + n == encoded.size() ? H2_END_HEADERS : 0;
+    if (!pos && end_stream)
+      flags |= H2_END_STREAM;
+    frame(pos ? H2_CONTINUATION : H2_HEADERS, flags, id, encoded.data() + pos, n);
+    pos += n;
+  } while (pos < encoded.size());
+}
+
+// queues DATA frames while the client keeps up. each frame goes to the
+// stream furthest behind in sent bytes divided by its weight, so streams
+// share the connection by weight and none waits for another to finish.
+void Http2Session::schedule() {
+  while (out.size() < H2_OUTPUT_MAX) {
+    std::map<unsigned int, Stream>::iterator best = streams.end();
+    for (std::map<unsigned int, Stream>::iterator it = streams.begin(); it != streams.end(); it++) {
+      Stream& s = it->second;
+      if (!s.headers_sent)
+        continue;
+      bool ready = s.out.empty() ? s.eof : (s.send_window > 0 && send_window > 0);
+      if (ready && (best == streams.end() || s.vtime < best->second.vtime))
+        best = it;
+    }
+    if (best == streams.end())
+      break;
+    unsigned int id = best->first;
+    Stream& stream = best->second;
+    size_t n = std::min(stream.out.size(), max_frame);
+    if (n) {
+      n = (size_t) std::min((long long) n, stream.send_window);
+      n = (size_t) std::min((long long) n, send_window);
+    }
+    bool end = stream.eof && n == stream.out.size();
+    frame(H2_DATA, end ? H2_END_STREAM : 0, id, stream.out.data(), n);
+    stream.out.erase(0, n);
+    stream.send_window -= n;
+    send_window -= n;
+    vclock = stream.vtime;
+    stream.vtime += (n + 9) * 256 / stream.weight;
+    if (end) {
+      if (stream.remote_closed)
+        close_stream(id);
+      else
+        reset(id, H2_NO_ERROR);
+    }
+  }
+}
+
+bool Http2Session::flush(bool block) {
+  while (!out.empty()) {
+    ssize_t n = send(sock, out.data(), out.size(), 0);
+    if (n > 0) {
+      out.erase(0, n);
+      sent_at = time(NULL);
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      if (!block)
+        return true;
+      struct pollfd pfd;
+      pfd.fd = sock;
+      pfd.events = POLLOUT;
+      if (poll(&pfd, 1, H2_SEND_TIMEOUT * 1000) <= 0)
+        return false;
+      continue;
+    }
+    return false;
+  }
+  sent_at = time(NULL);
+  return true;
+}
+
+void Http2Session::serve(size_t consumed) {
+  static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+  size_t preface_left = 24 - consumed;
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+  // our SETTINGS come first, ahead of anything an upgrade queued.
+  std::string queued;
+  queued.swap(out);
+  unsigned char payload[18];
+  payload[0] = 0; payload[1] = 3;  // MAX_CONCURRENT_STREAMS
+  put32(payload + 2, H2_STREAMS_MAX);
+  payload[6] = 0; payload[7] = 4;  // INITIAL_WINDOW_SIZE
+  put32(payload + 8, H2_WINDOW);
+  payload[12] = 0; payload[13] = 6;  // MAX_HEADER_LIST_SIZE
+  put32(payload + 14, H2_HEADER_MAX);
+  frame(H2_SETTINGS, 0, 0, (const char*) payload, 18);
+  put32(payload, H2_CONNECTION_WINDOW - 65535);
+  frame(H2_WINDOW_UPDATE, 0, 0, (const char*) payload, 4);
+  out += queued;
+
+  std::vector<struct pollfd> pfds;
+  std::vector<unsigned int> ids;
+  while (!failed) {
+    // keep framing while the client takes it all, so no stream is left
+    // with data and nothing to wake us.
+    bool flushed = true;
+    do {
+      schedule();
+      size_t queued = out.size();
+      if (!flush(false)) {
+        flushed = false;
+        break;
+      }
+      if (!queued) break;
+    } while (out.empty());
+    if (!flushed)
+      break;
+    if (goaway_received && streams.empty() && out.empty())
+      break;
+    if (!out.empty() && time(NULL) - sent_at > H2_SEND_TIMEOUT)
+      break;
+    pfds.clear();
+    ids.clear();
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = out.size() < H2_OUTPUT_MAX * 2 ? POLLIN : 0;
+    if (!out.empty())
+      pfd.events |= POLLOUT;
+    pfd.revents = 0;
+    pfds.push_back(pfd);
+    for (std::map<unsigned int, Stream>::iterator it = streams.begin(); it != streams.end(); it++) {
+      Stream& s = it->second;
+      if (s.fd < 0) continue;
+      pfd.fd = s.fd;
+      pfd.events = 0;
+      if (!s.request.empty())
+        pfd.events |= POLLOUT;
+      if (s.out.size() < H2_STREAM_BUFFER)
+        pfd.events |= POLLIN;
+      if (!pfd.events) continue;
+      pfds.push_back(pfd);
+      ids.push_back(it->first);
+    }
+    if (poll(&pfds[0], pfds.size(), out.empty() ? -1 : 1000) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      char buf[16384];
+      ssize_t n = recv(sock, buf, sizeof(buf), 0);
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        break;
+      if (n > 0) {
+        size_t skip = 0;
+        if (preface_left) {
+          skip = std::min((size_t) n, preface_left);
+          if (memcmp(buf, preface + 24 - preface_left, skip)) {
+            connection_error(H2_PROTOCOL_ERROR);
+            break;
+          }
+          preface_left -= skip;
+        }
+        in.append(buf + skip, n - skip);
+        if (!input())
+          break;
+      }
+    }
+    for (size_t n = 1; n < pfds.size(); n++) {
+      if (!pfds[n].revents) continue;
+      std::map<unsigned int, Stream>::iterator it = streams.find(ids[n - 1]);
+      if (it == streams.end() || it->second.fd != pfds[n].fd) continue;
+      if (pfds[n].revents & (POLLOUT | POLLERR))
+        stream_input(it->first, it->second);
+      it = streams.find(ids[n - 1]);
+      if (it != streams.end() && it->second.fd >= 0 && (pfds[n].revents & (POLLIN | POLLHUP | POLLERR)))
+        stream_output(it->first, it->second);
+    }
+  }
+  if (failed)
+    flush(true);
+}
+
+#endif
+
+}
+
+// vim:set et:
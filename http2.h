@@ -0,0 +1,161 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _HTTP2_H_
+#define _HTTP2_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <time.h>
+
+#include "httpd.h"
+
+namespace tthttpd {
+
+#ifndef _WIN32
+
+typedef std::pair<std::string, std::string> HeaderField;
+typedef std::vector<HeaderField> HeaderList;
+
+// HPACK (RFC 7541) header block decoding, with the dynamic table the
+// client fills. `max_size' is what we announced in SETTINGS.
+class HpackDecoder {
+public:
+  HpackDecoder();
+  bool decode(const unsigned char* data, size_t size, HeaderList& headers);
+private:
+  std::deque<HeaderField> table;
+  size_t size;
+  size_t limit;
+  size_t max_size;
+  bool lookup(size_t index, HeaderField& field) const;
+  void insert(const HeaderField& field);
+};
+
+// HPACK encoding of response headers. fields that repeat from response
+// to response (content-type, server, ...) go to the dynamic table; those
+// that rarely do (date, content-length, ...) are sent as literals.
+class HpackEncoder {
+public:
+  HpackEncoder();
+  // the client's SETTINGS_HEADER_TABLE_SIZE.
+  void set_max_size(size_t size);
+  void encode(const HeaderList& headers, std::string& out);
+private:
+  std::deque<HeaderField> table;
+  size_t size;
+  size_t limit;
+  bool resized;
+  void insert(const HeaderField& field);
+};
+
+// one HTTP/2 connection, in prior knowledge, h2c upgrade or ALPN "h2".
+// every stream is one HTTP/1.1 exchange with `handler' (response_thread)
+// over a socket pair, so static files, listings, CGI and the upstreams
+// all work as they do for HTTP/1.1, each stream on its own thread. this
+// thread does the framing: it hands request headers and bodies to the
+// streams under flow control, and sends their responses back as DATA
+// frames picked by stream weight.
+class Http2Session {
+public:
+  Http2Session(const server::HttpdInfo& info, int sock, void* (*handler)(void*));
+  ~Http2Session();
+  // takes the request of an h2c upgrade as stream 1. `settings' is the
+  // HTTP2-Settings header.
+  bool upgrade(const std::string& settings, const std::string& request);
+  // runs the connection until either side is done with it. `consumed' is
+  // how much of the client preface was already read.
+  void serve(size_t consumed);
+private:
+  typedef struct {
+    int fd;
+    std::string request;    // head and body not yet written to `fd'
+    size_t head_left;       // bytes of `request' that are the head
+    bool chunked_body;      // a body of no length, passed on in chunks
+    size_t framing;         // bytes of `request' that are chunk framing
+    bool remote_closed;     // END_STREAM received
+    long long recv_window;
+    long long credit;       // body taken since the last WINDOW_UPDATE
+    std::string in;         // response bytes not yet parsed
+    std::string out;        // response body waiting for DATA frames
+    bool headers_sent;
+    bool eof;               // the response is complete
+    bool chunked;
+    int chunk_state;
+    unsigned long chunk_left;
+    long long send_window;
+    int weight;
+    unsigned long long vtime;
+  } Stream;
+  server::HttpdInfo info;
+  int sock;
+  void* (*handler)(void*);
+  std::map<unsigned int, Stream> streams;
+  HpackDecoder decoder;
+  HpackEncoder encoder;
+  std::string in;
+  std::string out;
+  std::string block;
+  unsigned int block_id;
+  bool block_end_stream;
+  int block_weight;
+  unsigned int last_id;
+  long long send_window;
+  long long credit;
+  long long initial_window;
+  size_t max_frame;
+  unsigned long long vclock;
+  time_t sent_at;
+  bool goaway_received;
+  bool failed;
+  void frame(int type, int flags, unsigned int id, const char* data, size_t size);
+  void connection_error(int code);
+  void reset(unsigned int id, int code);
+  bool settings(const unsigned char* data, size_t size);
+  bool input();
+  bool dispatch(int type, int flags, unsigned int id, const unsigned char* data, size_t size);
+  bool end_headers();
+  Stream& new_stream(unsigned int id, int weight);
+  void open_stream(unsigned int id, const HeaderList& headers, bool end_stream);
+  void start_stream(unsigned int id, Stream& stream);
+  void end_request(Stream& stream);
+  void update_window(unsigned int id, Stream& stream);
+  void respond(unsigned int id, const char* status);
+  void stream_input(unsigned int id, Stream& stream);
+  void stream_output(unsigned int id, Stream& stream);
+  bool stream_headers(unsigned int id, Stream& stream);
+  void stream_body(Stream& stream);
+  void send_headers(unsigned int id, const HeaderList& headers, bool end_stream);
+  void close_stream(unsigned int id);
+  void schedule();
+  bool flush(bool block);
+};
+
+#endif
+
+}
+
+#endif /* _HTTP2_H_ */
+
+// vim:set et:
@@ -24,6 +24,14 @@
 #include "config.h"
 #endif
 #include "httpd.h"
+#include "upstream.h"
+#include "websocket.h"
+#include "eventstream.h"
+#include "tls.h"
+#include "http2.h"
+#include "status.h"
+#include "accesslog.h"
+#include "arena.h"
 #include <time.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -39,6 +47,11 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #endif
 
 #if defined (__SVR4) && defined (__sun)
@@ -81,6 +94,10 @@ typedef int socklen_t;
 #define strnicmp(x, y, z) strncasecmp(x, y, z)
 #endif
 
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
 #if !defined(EWOULDBLOCK) && defined(WSAEWOULDBLOCK)
 #define EWOULDBLOCK WSAEWOULDBLOCK
 #endif
@@ -104,6 +121,22 @@ typedef long fd_mask;
 
 #define VERBOSE(x) (httpd->verbose_mode >= x)
 
+// limits for CGI responses: the size of the header block, the output kept
+// while the request body is still being sent, and the number of local
+// redirects (Location: /path) followed for one request.
+#define CGI_HEADER_MAX 65536
+#define CGI_BUFFER_MAX (1024 * 1024)
+#define CGI_REDIRECT_MAX 10
+
+// seconds a proxied backend may keep us waiting for a response or its body.
+#define PROXY_TIMEOUT 60
+
+// a request body left unread is read and dropped to keep the connection
+// if no more than this is left; otherwise the connection is closed, after
+// reading what the client still sends for up to REQ_LINGER seconds.
+#define REQ_DRAIN_MAX (256 * 1024)
+#define REQ_LINGER 2
+
 #if !defined(HAVE_GETADDRINFO) && defined(_WIN32_WINNT) && _WIN32_WINNT < 0x0501
 int inet_aton(const char *cp, struct in_addr *addr) {
   register unsigned int val;
@@ -319,10 +352,36 @@ typedef struct {
   int read;
   int write;
   pid_t process;
+  int pidfd;
 #endif
   unsigned long size;
+  bool cgi;  // the output is a CGI response, headers first
+  FastCGIRequest* fcgi;
 } RES_INFO;
 
+// events reported by res_poll().
+enum {
+  RES_EV_OUTPUT = 1,  // output of the CGI is readable or has ended
+  RES_EV_INPUT = 2,   // stdin of the CGI has room
+  RES_EV_CLIENT = 4,  // the client socket is readable
+  RES_EV_EXIT = 8     // the CGI process has exited
+};
+
+// a RES_INFO lasts no longer than its request, so it comes from the arena.
+static RES_INFO* res_new() {
+  return ArenaAllocator<RES_INFO>().allocate(1);
+}
+
+static void res_delete(RES_INFO* res_info) {
+  ArenaAllocator<RES_INFO>().deallocate(res_info, 1);
+}
+
+// whether `path' ends in "." and `ext'.
+static bool res_hasext(StringSpan path, const std::string& ext) {
+  return path.len > ext.size() && path.ptr[path.len - ext.size() - 1] == '.' &&
+    !memcmp(path.ptr + path.len - ext.size(), ext.data(), ext.size());
+}
+
 bool operator<(const server::ListInfo& left, const server::ListInfo& right) {
   return left.name < right.name;
 }
@@ -371,7 +430,7 @@ static bool filetime2unixtime(const FILETIME* ft, struct tm* tm) {
 }
 #endif
 
-static std::string res_curtime(int diff = 0) {
+static ArenaString res_curtime(int diff = 0) {
   time_t tt = time(NULL) + diff;
   struct tm* p = gmtime(&tt);
 
@@ -410,6 +469,263 @@ static void my_perror(std::string mes) {
 #endif
 }
 
+void server::AcceptIPs::insert(std::vector<Node>& nodes, const unsigned char* addr, int bits, int rule) {
+  int cur = 0;
+  for (int n = 0; n < bits; n++) {
+    int bit = (addr[n / 8] >> (7 - n % 8)) & 1;
+    if (!nodes[cur].child[bit]) {
+      Node node = {{0, 0}, RULE_NONE};
+      nodes.push_back(node);
+      nodes[cur].child[bit] = (int)nodes.size() - 1;
+    }
+    cur = nodes[cur].child[bit];
+  }
+  nodes[cur].rule = rule;
+}
+
+int server::AcceptIPs::lookup(const std::vector<Node>& nodes, const unsigned char* addr, int bits) {
+  int cur = 0;
+  int rule = nodes[0].rule;
+  for (int n = 0; n < bits; n++) {
+    cur = nodes[cur].child[(addr[n / 8] >> (7 - n % 8)) & 1];
+    if (!cur) break;
+    if (nodes[cur].rule != RULE_NONE) rule = nodes[cur].rule;
+  }
+  return rule;
+}
+
+#ifdef AF_INET6
+// the first 12 bytes of an IPv4 address in IPv6 form, ::ffff:a.b.c.d.
+static const unsigned char v4mapped[12] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+#endif
+
+bool server::AcceptIPs::add(const std::string& cidr, bool allow) {
+  std::string host = cidr;
+  int bits = -1;
+  size_t end_pos = host.find('/');
+  if (end_pos != std::string::npos) {
+    const char* ptr = host.c_str() + end_pos + 1;
+    char* end = NULL;
+    bits = (int)strtol(ptr, &end, 10);
+    if (!*ptr || *end || bits < 0) return false;
+    host.resize(end_pos);
+  }
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = AI_NUMERICHOST;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), NULL, &hints, &res))
+    return false;
+
+  bool ret = true;
+  int rule = allow ? RULE_ALLOW : RULE_DENY;
+  if (res->ai_family == AF_INET) {
+    if (bits < 0) bits = 32;
+    if (bits > 32) ret = false;
+    else insert(nodes4, (unsigned char*)
+        &((struct sockaddr_in*)res->ai_addr)->sin_addr, bits, rule);
+  }
+#ifdef AF_INET6
+  else if (res->ai_family == AF_INET6) {
+    unsigned char* addr = (unsigned char*)
+        &((struct sockaddr_in6*)res->ai_addr)->sin6_addr;
+    if (bits < 0) bits = 128;
+    if (bits > 128) ret = false;
+    // v4-mapped peers are looked up in nodes4, so their rules go there.
+    else if (bits >= 96 && !memcmp(addr, v4mapped, sizeof(v4mapped)))
+      insert(nodes4, addr + 12, bits - 96, rule);
+    else insert(nodes6, addr, bits, rule);
+  }
+#endif
+  else
+    ret = false;
+  freeaddrinfo(res);
+  if (ret) rules++;
+  if (ret && allow) allows++;
+  return ret;
+}
+
+bool server::AcceptIPs::accept(const struct sockaddr* sa) const {
+  int rule = RULE_NONE;
+  if (sa->sa_family == AF_INET) {
+    rule = lookup(nodes4, (const unsigned char*)
+        &((const struct sockaddr_in*)sa)->sin_addr, 32);
+  }
+#ifdef AF_INET6
+  else if (sa->sa_family == AF_INET6) {
+    const unsigned char* addr = (const unsigned char*)
+        &((const struct sockaddr_in6*)sa)->sin6_addr;
+    // IPv4 peers on a dual-stack listener are matched against IPv4 rules.
+    if (!memcmp(addr, v4mapped, sizeof(v4mapped)))
+      rule = lookup(nodes4, addr + 12, 32);
+    else
+      rule = lookup(nodes6, addr, 128);
+  }
+#endif
+  if (rule == RULE_NONE)
+    return allows == 0;
+  return rule == RULE_ALLOW;
+}
+
+unsigned int server::Router::method_mask(const std::string& method) {
+  if (method == "GET") return METHOD_GET;
+  if (method == "HEAD") return METHOD_HEAD;
+  if (method == "POST") return METHOD_POST;
+  if (method == "PUT") return METHOD_PUT;
+  if (method == "DELETE") return METHOD_DELETE;
+  if (method == "OPTIONS") return METHOD_OPTIONS;
+  if (method == "PATCH") return METHOD_PATCH;
+  if (method == "TRACE") return METHOD_TRACE;
+  if (method == "CONNECT") return METHOD_CONNECT;
+  return METHOD_OTHER;
+}
+
+void server::Router::clear() {
+  nodes.assign(1, Node());
+}
+
+int server::Router::child(int node, const char* seg, size_t len) const {
+  const Children& children = nodes[node].children;
+  size_t lo = 0, hi = children.size();
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    int r = children[mid].first.compare(0, std::string::npos, seg, len);
+    if (r == 0) return children[mid].second;
+    if (r < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return -1;
+}
+
+void server::Router::add(const std::string& path, const Rule& rule) {
+  int cur = 0;
+  size_t pos = 0, end_pos;
+  while ((end_pos = path.find('/', pos)) != std::string::npos) {
+    std::string seg = path.substr(pos, end_pos - pos);
+    int next = child(cur, seg.c_str(), seg.size());
+    if (next < 0) {
+      next = (int)nodes.size();
+      nodes.push_back(Node());
+      Children& children = nodes[cur].children;
+      Children::iterator it = children.begin();
+      while (it != children.end() && it->first < seg) it++;
+      children.insert(it, std::make_pair(seg, next));
+    }
+    cur = next;
+    pos = end_pos + 1;
+  }
+  nodes[cur].rules.push_back(rule);
+  nodes[cur].rules.back().rest = path.substr(pos);
+}
+
+void server::Router::compile(const RequestAliases& aliases, const RequestProxies& proxies, const BasicAuths& auths, const AcceptAuths& accepts) {
+  clear();
+  Rule rule;
+  rule.order = 0;
+  rule.methods = METHOD_ANY;
+
+  for (RequestAliases::const_iterator it = aliases.begin(); it != aliases.end(); it++) {
+    rule.type = it->second[0] == '@' ? RULE_MOUNT : RULE_ALIAS;
+    rule.data = &it->second;
+    add(it->first, rule);
+  }
+
+  rule.type = RULE_PROXY;
+  for (RequestProxies::const_iterator it = proxies.begin(); it != proxies.end(); it++) {
+    rule.data = &it->second;
+    add(it->first, rule);
+  }
+
+  rule.type = RULE_AUTH;
+  for (BasicAuths::const_iterator it = auths.begin(); it != auths.end(); it++) {
+    std::vector<std::string> methods;
+    split_string(it->method, "/", methods);
+    rule.methods = methods.empty() ? METHOD_ANY : 0;
+    rule.others.clear();
+    for (std::vector<std::string>::iterator it_method = methods.begin(); it_method != methods.end(); it_method++) {
+      unsigned int bit = method_mask(*it_method);
+      rule.methods |= bit;
+      if (bit == METHOD_OTHER)
+        rule.others.push_back(*it_method);
+    }
+    rule.order = (int)(it - auths.begin());
+    rule.data = &*it;
+    add(it->target, rule);
+  }
+
+  rule.type = RULE_ACCEPT;
+  rule.order = 0;
+  rule.methods = METHOD_ANY;
+  rule.others.clear();
+  for (AcceptAuths::const_iterator it = accepts.begin(); it != accepts.end(); it++) {
+    rule.data = &it->second;
+    add(it->first, rule);
+  }
+}
+
+void server::Router::match(const std::string& path, const std::string& method, Route& route) const {
+  unsigned int mask = method_mask(method);
+  int auth_order = -1;
+  int cur = 0;
+  const char* ptr = path.c_str();
+  const char* end = ptr + path.size();
+
+  route.alias = NULL;
+  route.mount = NULL;
+  route.mount_len = 0;
+  route.proxy = NULL;
+  route.auth = NULL;
+  route.accepts.clear();
+  while (true) {
+    const std::vector<Rule>& rules = nodes[cur].rules;
+    for (std::vector<Rule>::const_iterator it = rules.begin(); it != rules.end(); it++) {
+      size_t len = it->rest.size();
+      if ((size_t)(end - ptr) < len || memcmp(ptr, it->rest.c_str(), len)) continue;
+      switch (it->type) {
+      case RULE_ALIAS:
+        if (ptr + len == end) route.alias = (const std::string*)it->data;
+        break;
+      case RULE_MOUNT:
+      case RULE_PROXY:
+        // whole segments only: "/app" is not mounted on "/apple".
+        if (!len || ptr + len == end || ptr[len] == '/' || ptr[len - 1] == '/') {
+          if (it->type == RULE_PROXY) {
+            route.proxy = (const std::string*)it->data;
+            route.mount = NULL;
+          } else {
+            route.mount = (const std::string*)it->data;
+            route.proxy = NULL;
+          }
+          route.mount_len = ptr + len - path.c_str();
+        }
+        break;
+      case RULE_AUTH:
+        // the first matching entry of basic_auths wins, as it always did.
+        if (!(it->methods & mask)) break;
+        // a method without a bit of its own is matched by name.
+        if (mask == METHOD_OTHER && it->methods != METHOD_ANY &&
+            std::find(it->others.begin(), it->others.end(), method) == it->others.end())
+          break;
+        if (auth_order < 0 || it->order < auth_order) {
+          route.auth = (const BasicAuthInfo*)it->data;
+          auth_order = it->order;
+        }
+        break;
+      case RULE_ACCEPT:
+        route.accepts.push_back((const AcceptAuth*)it->data);
+        break;
+      }
+    }
+    const char* sep = (const char*)memchr(ptr, '/', end - ptr);
+    if (!sep) break;
+    cur = child(cur, ptr, sep - ptr);
+    if (cur < 0) break;
+    ptr = sep + 1;
+  }
+}
+
 #ifdef _WIN32
 static RES_INFO* res_fopen(std::string& file) {
   HANDLE hFile;
@@ -424,11 +740,13 @@ static RES_INFO* res_fopen(std::string& file) {
   if (hFile == INVALID_HANDLE_VALUE)
     return NULL;
 
-  RES_INFO* res_info = new RES_INFO;
+  RES_INFO* res_info = res_new();
   res_info->read = hFile;
   res_info->write = 0;
   res_info->process = 0;
   res_info->size = (unsigned long)-1;
+  res_info->cgi = false;
+  res_info->fcgi = NULL;
   return res_info;
 }
 
@@ -443,7 +761,6 @@ static bool res_isdir(std::string& file) {
 }
 
 static bool res_isexe(std::string& file, std::string& path_info, std::string& script_name) {
-  std::vector<std::string> split_path;
   std::string path;
   const char* env = getenv("PATHEXT");
   std::string pathext = env ? env : "";
@@ -451,22 +768,22 @@ static bool res_isexe(std::string& file, std::string& path_info, std::string& sc
   std::vector<std::string> pathexts;
   std::vector<std::string>::iterator itext;
 
-  split_string(file, "/", split_path);
+  StringTokenizer tokenizer(file, "/");
   std::transform(pathext.begin(), pathext.end(), pathext.begin(), ::tolower);
   split_string(pathext, ";", pathexts);
 
-  for (std::vector<std::string>::iterator it = split_path.begin(); it != split_path.end(); it++) {
-    if (it->empty()) continue;
+  for (StringSpan it; tokenizer.next(it); ) {
+    if (it.empty()) continue;
     if (!path.empty()) path += "/";
-    path += *it;
+    path.append(it.ptr, it.len);
       struct stat  st;
     if (stat((char *)path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
       for (itext = pathexts.begin(); itext != pathexts.end(); itext++) {
         if (path.substr(path.size() - itext->size()) == *itext) {
           path_info = file.c_str() + path.size();
           script_name.resize(script_name.size() - path_info.size());
+          if (path_info.empty()) script_name.append(it.ptr, it.len);
           file = path;
-          if (path_info.empty()) script_name += *it;
           return true;
         }
       }
@@ -476,8 +793,8 @@ static bool res_isexe(std::string& file, std::string& path_info, std::string& sc
       if (stat((char *)tmp.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
         path_info = file.c_str() + path.size();
         script_name.resize(script_name.size() - path_info.size());
+        if (path_info.empty()) script_name.append(it.ptr, it.len);
         file = tmp;
-        if (path_info.empty()) script_name += *it;
         return true;
       }
     }
@@ -486,29 +803,26 @@ static bool res_isexe(std::string& file, std::string& path_info, std::string& sc
 }
 
 static bool res_iscgi(std::string& file, std::string& path_info, std::string& script_name, server::MimeTypes& mime_types, std::string& type) {
-  std::vector<std::string> split_path;
-  std::string path;
+  ArenaString path;
 
-  split_string(file, "/", split_path);
-  for (std::vector<std::string>::iterator it = split_path.begin(); it != split_path.end(); it++) {
-    if (it->empty()) continue;
+  StringTokenizer tokenizer(file, "/");
+  for (StringSpan it; tokenizer.next(it); ) {
+    if (it.empty()) continue;
     if (!path.empty()) path += "/";
-    path += *it;
+    path.append(it.ptr, it.len);
       struct stat  st;
     if (stat((char *)path.c_str(), &st))
       continue;
     server::MimeTypes::iterator it_mime;
     for(it_mime = mime_types.begin(); it_mime != mime_types.end(); it_mime++) {
       if (it_mime->second[0] != '@') continue;
-      std::string match = ".";
-      match += it_mime->first;
-      if (!strcmp(path.c_str()+path.size()-match.size(), match.c_str())) {
+      if (res_hasext(path, it_mime->first)) {
         type = it_mime->second;
         path_info = file.c_str() + path.size();
         script_name.resize(script_name.size() - path_info.size());
-        file = path;
         if (script_name == "/")
-          script_name += *it;
+          script_name.append(it.ptr, it.len);
+        file.assign(path.data(), path.size());
         return true;
       }
     }
@@ -516,9 +830,9 @@ static bool res_iscgi(std::string& file, std::string& path_info, std::string& sc
   return false;
 }
 
-static std::vector<server::ListInfo> res_flist(std::string& path) {
+static server::FileList res_flist(std::string& path) {
   WIN32_FIND_DATAA fData;
-  std::vector<server::ListInfo> ret;
+  server::FileList ret;
   if (path.size() && path[path.size()-1] != '/')
     path += "/";
   std::string pattern = path + "*";
@@ -545,7 +859,7 @@ static unsigned long res_fsize(RES_INFO* res_info) {
   return GetFileSize(res_info->read, NULL);
 }
 
-static std::string res_ftime(std::string& file, int diff = 0) {
+static ArenaString res_ftime(std::string& file, int diff = 0) {
   HANDLE hFile;
   hFile = CreateFileA(
     file.c_str(),
@@ -596,24 +910,46 @@ static std::string res_ftime(std::string& file, int diff = 0) {
   return buf;
 }
 
-static std::string res_fgets(RES_INFO* res_info) {
-  char c;
-  std::stringstream ss;
-  while (1) {
-    DWORD dwRead;
-    if (ReadFile(res_info->read, &c, 1, &dwRead, NULL) == FALSE) break;
-    if (c == '\n') break;
-    if (c != '\r') ss << c;
-  }
-  return ss.str();
+static long long res_fill(RES_INFO* res_info, char* data, unsigned long size) {
+  DWORD dwRead = 0;
+  if (ReadFile(res_info->read, data, size, &dwRead, NULL) == FALSE)
+    return 0;
+  return dwRead;
 }
 
-static unsigned long res_write(RES_INFO* res_info, char* data, unsigned long size) {
+static long res_write(RES_INFO* res_info, char* data, unsigned long size) {
   DWORD dwWrite = 0;
-  WriteFile(res_info->write, data, size, &dwWrite, NULL);
+  if (WriteFile(res_info->write, data, size, &dwWrite, NULL) == FALSE)
+    return -1;
   return dwWrite;
 }
 
+// anonymous pipes can not be waited on together with a socket, so this
+// looks at both and sleeps a little when neither is ready.
+static int res_poll(RES_INFO* res_info, int want, int sock, int timeout) {
+  int events = 0;
+  DWORD dwAvail = 0;
+  if (want & RES_EV_INPUT)
+    events |= RES_EV_INPUT;
+  if (sock >= 0) {
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET((unsigned int) sock, &fdset);
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    if (select(FD_SETSIZE, &fdset, NULL, NULL, &tv) > 0)
+      events |= RES_EV_CLIENT;
+  }
+  if ((want & RES_EV_OUTPUT) && (!res_info->process
+      || PeekNamedPipe(res_info->read, NULL, 0, NULL, &dwAvail, NULL) == FALSE
+      || dwAvail > 0))
+    events |= RES_EV_OUTPUT;
+  if (!events && timeout != 0)
+    Sleep(1);
+  return events;
+}
+
 static long long res_read(RES_INFO* res_info, char* data, unsigned long size) {
   DWORD dwRead = 0;
   OVERLAPPED ovRead;
@@ -733,11 +1069,13 @@ static RES_INFO* res_popen(std::vector<std::string>& args, std::vector<std::stri
   CloseHandle(hClientIn_rd);
   CloseHandle(hClientOut_wr);
 
-  RES_INFO* res_info = new RES_INFO;
+  RES_INFO* res_info = res_new();
   res_info->read = hClientOut_rd;
   res_info->write = hClientIn_wr;
   res_info->process = pi.hProcess;
   res_info->size = (unsigned long)-1;
+  res_info->cgi = true;
+  res_info->fcgi = NULL;
   return res_info;
 }
 
@@ -753,20 +1091,23 @@ static void res_close(RES_INFO* res_info) {
     if (res_info->read) CloseHandle(res_info->read);
     if (res_info->write) CloseHandle(res_info->write);
     if (res_info->process) CloseHandle(res_info->process);
-    delete res_info;
+    res_delete(res_info);
   }
 }
 #else
 static RES_INFO* res_fopen(std::string& file) {
-  int fd = open(file.c_str(), O_RDONLY);
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
   if (fd < 0)
     return NULL;
 
-  RES_INFO* res_info = new RES_INFO;
+  RES_INFO* res_info = res_new();
   res_info->read = fd;
   res_info->write = 0;
   res_info->process = 0;
   res_info->size = (unsigned long)-1;
+  res_info->cgi = false;
+  res_info->fcgi = NULL;
+  res_info->pidfd = -1;
   return res_info;
 }
 
@@ -783,22 +1124,21 @@ static bool res_isdir(std::string& file) {
 }
 
 static bool res_isexe(std::string& file, std::string& path_info, std::string& script_name) {
-  std::vector<std::string> split_path;
-  std::string path;
+  ArenaString path;
 
-  split_string(file, "/", split_path);
-  for (std::vector<std::string>::iterator it = split_path.begin(); it != split_path.end(); it++) {
-    if (it->empty()) continue;
+  StringTokenizer tokenizer(file, "/");
+  for (StringSpan it; tokenizer.next(it); ) {
+    if (it.empty()) continue;
     path += "/";
-    path += *it;
+    path.append(it.ptr, it.len);
       struct stat  st;
     if (stat((char *)path.c_str(), &st))
       continue;
       if (S_ISREG(st.st_mode) && access(path.c_str(), X_OK) == 0) {
       path_info = file.c_str() + path.size();
       script_name.resize(script_name.size() - path_info.size());
-      file = path;
-      if (path_info.empty()) script_name += *it;
+      if (path_info.empty()) script_name.append(it.ptr, it.len);
+      file.assign(path.data(), path.size());
       return true;
     }
   }
@@ -806,29 +1146,26 @@ static bool res_isexe(std::string& file, std::string& path_info, std::string& sc
 }
 
 static bool res_iscgi(std::string& file, std::string& path_info, std::string& script_name, server::MimeTypes& mime_types, std::string& type) {
-  std::vector<std::string> split_path;
-  std::string path;
+  ArenaString path;
 
-  split_string(file, "/", split_path);
-  for (std::vector<std::string>::iterator it = split_path.begin(); it != split_path.end(); it++) {
-    if (it->empty()) continue;
+  StringTokenizer tokenizer(file, "/");
+  for (StringSpan it; tokenizer.next(it); ) {
+    if (it.empty()) continue;
     path += "/";
-    path += *it;
+    path.append(it.ptr, it.len);
       struct stat  st;
     if (stat((char *)path.c_str(), &st))
       continue;
     server::MimeTypes::iterator it_mime;
     for(it_mime = mime_types.begin(); it_mime != mime_types.end(); it_mime++) {
       if (it_mime->second[0] != '@') continue;
-      std::string match = ".";
-      match += it_mime->first;
-      if (!strcmp(path.c_str()+path.size()-match.size(), match.c_str())) {
+      if (res_hasext(path, it_mime->first)) {
         type = it_mime->second;
         path_info = file.c_str() + path.size();
         script_name.resize(script_name.size() - path_info.size());
-        file = path;
         if (script_name == "/")
-          script_name += *it;
+          script_name.append(it.ptr, it.len);
+        file.assign(path.data(), path.size());
         return true;
       }
     }
@@ -836,23 +1173,26 @@ static bool res_iscgi(std::string& file, std::string& path_info, std::string& sc
   return false;
 }
 
-static std::vector<server::ListInfo> res_flist(std::string& path) {
-  std::vector<server::ListInfo> ret;
+static server::FileList res_flist(std::string& path) {
+  server::FileList ret;
   DIR* dir;
   struct dirent* dirp;
   if (!path.empty() && path[path.size()-1] != '/')
     path += "/";
+  // each entry is stat'ed by its name put after `path' for the while.
+  size_t dir_len = path.size();
   dir = opendir(path.c_str());
   while((dirp = readdir(dir))) {
     if (strcmp(dirp->d_name, ".")) {
       server::ListInfo listInfo;
       listInfo.name = dirp->d_name;
-      std::string file = path + listInfo.name;
+      path += dirp->d_name;
       struct stat statbuf = {0};
-      stat(file.c_str(), &statbuf);
+      stat(path.c_str(), &statbuf);
+      path.resize(dir_len);
       listInfo.size = statbuf.st_size;
       memcpy(&listInfo.date, gmtime(&statbuf.st_mtime), sizeof(struct tm));
-      listInfo.isdir = res_isdir(file);
+      listInfo.isdir = S_ISDIR(statbuf.st_mode);
       ret.push_back(listInfo);
     }
   }
@@ -867,7 +1207,7 @@ static unsigned long res_fsize(RES_INFO* res_info) {
   return statbuf.st_size;
 }
 
-static std::string res_ftime(std::string& file, int diff = 0) {
+static ArenaString res_ftime(std::string& file, int diff = 0) {
   struct stat statbuf = {0};
   stat(file.c_str(), &statbuf);
   time_t tt = statbuf.st_mtime + diff;
@@ -897,142 +1237,423 @@ static std::string res_ftime(std::string& file, int diff = 0) {
   return buf;
 }
 
-static std::string res_fgets(RES_INFO* res_info) {
-  std::stringstream ss;
-  char c;
-  while (1) {
-    if (read(res_info->read, &c, 1) != 1) break;
-    if (c == '\n') break;
-    if (c != '\r') ss << c;
+// blocking read of CGI output. returns 0 at the end of the output.
+static long long res_fill(RES_INFO* res_info, char* data, unsigned long size) {
+  if (res_info->fcgi) {
+    long long r = res_info->fcgi->read(data, size, true);
+    return r < 0 ? 0 : r;
   }
-  return ss.str();
+  ssize_t r;
+  while ((r = read(res_info->read, data, size)) < 0) {
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) break;
+    // upstream sockets are non-blocking.
+    struct pollfd pfd;
+    pfd.fd = res_info->read;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, -1);
+  }
+  return r < 0 ? 0 : r;
 }
 
-static unsigned long res_write(RES_INFO* res_info, char* data, unsigned long size) {
-  return write(res_info->write, data, size);
+// writes what fits into the stdin of the CGI. returns 0 when the pipe is
+// full and -1 once the CGI has gone away.
+static long res_write(RES_INFO* res_info, char* data, unsigned long size) {
+  if (res_info->fcgi)
+    return res_info->fcgi->write(data, size);
+  ssize_t r = write(res_info->write, data, size);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+  return r;
 }
 
+// call after res_poll() reported RES_EV_OUTPUT. returns -1 at the end.
 static long long res_read(RES_INFO* res_info, char* data, unsigned long size) {
-  if (res_info->process) {
-    int s = 0;
-    if (waitpid(res_info->process, &s, WNOHANG) == -1) {
+  if (res_info->fcgi)
+    return res_info->fcgi->read(data, size, false);
+  ssize_t r = read(res_info->read, data, size);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+  return r <= 0 ? -1 : r;
+}
+
+// waits for the events in `want' (output of the CGI, room in its stdin),
+// data from the client socket when `sock' is given, or the exit of the
+// CGI. `timeout' is in milliseconds, -1 to wait as long as it takes.
+static int res_poll(RES_INFO* res_info, int want, int sock, int timeout) {
+  struct pollfd pfd[4];
+  int n = 0, out = -1, in = -1, client = -1, exited = -1;
+  if ((want & RES_EV_OUTPUT) && res_info->fcgi && res_info->fcgi->finished())
+    return RES_EV_OUTPUT;
+  if (want & RES_EV_OUTPUT) {
+    pfd[n].fd = res_info->read;
+    pfd[n].events = POLLIN;
+    out = n++;
+  }
+  if ((want & RES_EV_INPUT) && res_info->write) {
+    pfd[n].fd = res_info->write;
+    pfd[n].events = POLLOUT;
+    in = n++;
+  }
+  if (sock >= 0) {
+    pfd[n].fd = sock;
+    pfd[n].events = POLLIN;
+    client = n++;
+  }
+  if (res_info->pidfd >= 0) {
+    pfd[n].fd = res_info->pidfd;
+    pfd[n].events = POLLIN;
+    exited = n++;
+  }
+  for (int i = 0; i < n; i++)
+    pfd[i].revents = 0;
+  int r = poll(pfd, n, timeout);
+  if (r < 0)
+    return errno == EINTR ? 0 : -1;
+  int events = 0;
+  if (out >= 0 && pfd[out].revents)
+    events |= RES_EV_OUTPUT;
+  if (in >= 0 && pfd[in].revents)
+    events |= RES_EV_INPUT;
+  if (client >= 0 && pfd[client].revents)
+    events |= RES_EV_CLIENT;
+  if (exited >= 0 && pfd[exited].revents) {
+    // reported once. what the CGI left in the pipe is still read.
+    close(res_info->pidfd);
+    res_info->pidfd = -1;
+    events |= RES_EV_EXIT;
+  }
+  return events;
+}
+
+#ifdef HAVE_SPLICE
+// the request body goes from the socket into the stdin pipe of the CGI
+// without passing through our memory. returns like res_write(), with -1
+// also when the client went away.
+static long res_splice_in(RES_INFO* res_info, int sock, unsigned long size) {
+  ssize_t r = splice(sock, NULL, res_info->write, NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (r < 0 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+  return r <= 0 ? -1 : r;
+}
+
+// the other way, CGI output from its pipe to the socket, at most `size'
+// bytes. a chunk is sized to what the pipe holds, which nobody else
+// reads. returns like res_read().
+static long long res_splice_out(RES_INFO* res_info, int sock, unsigned long size, bool chunked) {
+  int avail = 0;
+  if (ioctl(res_info->read, FIONREAD, &avail) < 0 || avail <= 0)
+    return -1;
+  if ((unsigned long) avail < size)
+    size = avail;
+  if (chunked) {
+    char head[32];
+    int head_len = sprintf(head, "%lx\r\n", size);
+    if (send(sock, head, head_len, MSG_MORE) < 0)
       return -1;
-    }
   }
-  fd_set fdset;
-  FD_ZERO(&fdset);
-  FD_SET(res_info->read, &fdset);
-  struct timeval tv;
-  tv.tv_sec = 0;
-  tv.tv_usec = 0;
-  int r = select(FD_SETSIZE, &fdset, NULL, NULL, &tv);
-  if (r == -1) return -1;
-  if (FD_ISSET(res_info->read, &fdset)) {
-    return (long long) read(res_info->read, data, size);
+  unsigned long left = size;
+  while (left) {
+    ssize_t r = splice(res_info->read, NULL, sock, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return -1;
+    left -= r;
   }
+  if (chunked && send(sock, "\r\n", 2, 0) < 0)
+    return -1;
+  return size;
+}
+#endif
+
+static int res_pipe(int fds[2]) {
+#ifdef HAVE_PIPE2
+  return pipe2(fds, O_CLOEXEC);
+#else
+  if (pipe(fds) < 0)
+    return -1;
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
   return 0;
+#endif
 }
 
-static void res_popen_sigchild(int signo) {
-    wait(0);
+// CGI processes, reaped by res_reap_children() as soon as they exit;
+// the end of a CGI response is the end of its output, not its exit.
+// FastCGI workers are not in here but left to their FastCGI, which
+// respawns them. a slot is claimed (-1) before the spawn and given the
+// pid after it, so the handler only reads the table and swaps pids out.
+#define RES_CHILDREN_MAX 4096
+
+static volatile pid_t res_children[RES_CHILDREN_MAX];
+
+static int res_claim_child() {
+  for (int n = 0; n < RES_CHILDREN_MAX; n++)
+    if (__sync_bool_compare_and_swap(&res_children[n], 0, -1))
+      return n;
+  return -1;
 }
 
+static void res_reap_child(int slot);
+
 static RES_INFO* res_popen(std::vector<std::string>& args, std::vector<std::string>& envs) {
-    int filedesr[2], filedesw[2];
-    pid_t child;
-    long flags;
-    sigset_t newmask;
-  char** args_ptr;
-  char** envs_ptr;
-  int n;
+  int filedesr[2], filedesw[2];
+  pid_t child;
+  long flags;
+  std::vector<char*> args_ptr;
+  std::vector<char*> envs_ptr;
   std::vector<std::string>::iterator it;
 
-  args_ptr = new char*[args.size() + 1];
-  envs_ptr = new char*[envs.size() + 1];
-
-  for(n = 0, it = args.begin(); it != args.end(); n++, it++)
-    args_ptr[n] = (char*)it->c_str();
-  args_ptr[args.size()] = 0;
-
-  for(n = 0, it = envs.begin(); it != envs.end(); n++, it++)
-    envs_ptr[n] = (char*)it->c_str();
-  envs_ptr[envs.size()] = 0;
-
-  int tmp;
-    tmp = pipe(filedesr);
-    tmp = pipe(filedesw);
-    child = fork();
-    if (!child) {
-    dup2(filedesw[0], 0);
-    dup2(filedesr[1], 1);
-    dup2(filedesr[1], 2);
-    close(filedesw[1]);
+  for(it = args.begin(); it != args.end(); it++)
+    args_ptr.push_back((char*)it->c_str());
+  args_ptr.push_back(NULL);
+
+  for(it = envs.begin(); it != envs.end(); it++)
+    envs_ptr.push_back((char*)it->c_str());
+  envs_ptr.push_back(NULL);
+
+  std::string path = args.size() > 1 && args[1].at(0) == '/' ?
+    args[1] : args[0];
+  size_t end_pos = path.find_last_of('/');
+  if (end_pos == std::string::npos)
+    path = ".";
+  else if (end_pos == 0)
+    path = "/";
+  else
+    path.erase(end_pos);
+
+  int slot = res_claim_child();
+  if (slot < 0)
+    return NULL;
+  if (res_pipe(filedesr) < 0) {
+    res_children[slot] = 0;
+    return NULL;
+  }
+  if (res_pipe(filedesw) < 0) {
     close(filedesr[0]);
-    setsid();
-    setpgid(0, 0);
-    sigemptyset(&newmask);
-    sigaddset(&newmask, SIGTERM);
-    sigaddset(&newmask, SIGKILL);
-    pthread_sigmask(SIG_UNBLOCK, &newmask, 0L);
-    usleep(500);
-    std::string path = args.size() > 1 && args[1].at(0) == '/' ?
-      args[1] : args[0];
-    size_t end_pos = path.find_last_of('/');
-    if (end_pos)
-      path.erase(end_pos);
-    tmp = chdir(path.c_str());
-    if (execve(args_ptr[0], args_ptr, envs_ptr) < 0) {
-      my_perror("execv");
-    }
-    delete[] envs_ptr;
-    delete[] args_ptr;
-    } else {
-    signal(SIGCHLD, res_popen_sigchild);
-    sigemptyset(&newmask);
-    sigaddset(&newmask, SIGCHLD);
-    sigaddset(&newmask, SIGTERM);
-    sigaddset(&newmask, SIGKILL);
-    pthread_sigmask(SIG_UNBLOCK, &newmask, 0L);
-    close(filedesw[0]);
     close(filedesr[1]);
+    res_children[slot] = 0;
+    return NULL;
+  }
+#ifdef F_SETPIPE_SZ
+  // bigger pipes mean fewer wakeups per megabyte moved. kept modest as
+  // pipe memory is accounted per user.
+  fcntl(filedesr[0], F_SETPIPE_SZ, 256 * 1024);
+  fcntl(filedesw[0], F_SETPIPE_SZ, 256 * 1024);
+#endif
+
+  child = spawn_process(&args_ptr[0], &envs_ptr[0], path.c_str(),
+      filedesw[0], filedesr[1], filedesr[1]);
+  close(filedesw[0]);
+  close(filedesr[1]);
+  if (child < 0) {
+    my_perror(args[0]);
+    close(filedesr[0]);
+    close(filedesw[1]);
+    res_children[slot] = 0;
+    return NULL;
+  }
+  // one that exited already went by the handler unnoticed.
+  res_children[slot] = child;
+  res_reap_child(slot);
 
-    flags = fcntl(filedesw[1], F_GETFL, 0);
-    flags |= O_NONBLOCK;
+  flags = fcntl(filedesw[1], F_GETFL, 0);
+  flags |= O_NONBLOCK;
 #ifndef BSD
-    flags |= O_NDELAY;
+  flags |= O_NDELAY;
 #endif
-    fcntl(filedesw[1], F_SETFL, flags);
+  fcntl(filedesw[1], F_SETFL, flags);
 
-    RES_INFO* res_info = new RES_INFO;
-    res_info->read = filedesr[0];
-    res_info->write = filedesw[1];
-    res_info->process = child;
-    res_info->size = (unsigned long)-1;
-    return res_info;
-    }
-  return NULL;
+  RES_INFO* res_info = res_new();
+  res_info->read = filedesr[0];
+  res_info->write = filedesw[1];
+  res_info->process = child;
+  res_info->size = (unsigned long)-1;
+  res_info->cgi = true;
+  res_info->fcgi = NULL;
+#ifdef SYS_pidfd_open
+  res_info->pidfd = (int) syscall(SYS_pidfd_open, child, 0);
+  if (res_info->pidfd >= 0)
+    fcntl(res_info->pidfd, F_SETFD, FD_CLOEXEC);
+#else
+  res_info->pidfd = -1;
+#endif
+  return res_info;
+}
+
+static void res_reap_child(int slot) {
+  pid_t pid = res_children[slot];
+  // -1 from waitpid: the other side of a race reaped it first.
+  if (pid > 0 && waitpid(pid, NULL, WNOHANG) != 0)
+    __sync_bool_compare_and_swap(&res_children[slot], pid, 0);
+}
+
+// SIGCHLD.
+static void res_reap_children(int signo) {
+  int saved_errno = errno;
+  for (int n = 0; n < RES_CHILDREN_MAX; n++)
+    res_reap_child(n);
+  errno = saved_errno;
+}
+
+static void reopen_access_log(int signo) {
+  AccessLog::reopen();
+}
+
+static RES_INFO* res_fcgi_open(FastCGI* app, std::vector<std::string>& envs) {
+  FastCGIRequest* fcgi = new FastCGIRequest(app);
+  if (!fcgi->begin(envs)) {
+    delete fcgi;
+    return NULL;
+  }
+
+  RES_INFO* res_info = res_new();
+  res_info->read = fcgi->fd;
+  res_info->write = fcgi->fd;
+  res_info->process = 0;
+  res_info->size = (unsigned long)-1;
+  res_info->cgi = true;
+  res_info->fcgi = fcgi;
+  res_info->pidfd = -1;
+  return res_info;
+}
+
+// SCGI and uwsgi: one socket, written like a CGI stdin and read like
+// its stdout.
+static RES_INFO* res_upstream_open(int protocol, const std::string& address, std::vector<std::string>& envs) {
+  int fd = upstream_open(protocol, address, envs);
+  if (fd < 0)
+    return NULL;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+  RES_INFO* res_info = res_new();
+  res_info->read = fd;
+  res_info->write = fd;
+  res_info->process = 0;
+  res_info->size = (unsigned long)-1;
+  res_info->cgi = true;
+  res_info->fcgi = NULL;
+  res_info->pidfd = -1;
+  return res_info;
 }
 
 static void res_closewriter(RES_INFO* res_info) {
   if (res_info && res_info->write) {
-    close(res_info->write);
+    if (res_info->fcgi)
+      res_info->fcgi->close_stdin();
+    else
+    if (res_info->write == res_info->read)
+      shutdown(res_info->write, SHUT_WR);
+    else
+      close(res_info->write);
     res_info->write = NULL;
   }
 }
 
 static void res_close(RES_INFO* res_info) {
   if (res_info) {
-    if (res_info->read) close(res_info->read);
-    if (res_info->write) close(res_info->write);
-    delete res_info;
+    if (res_info->fcgi) {
+      // the connection goes back to its pool.
+      delete res_info->fcgi;
+    } else {
+      if (res_info->read) close(res_info->read);
+      if (res_info->write && res_info->write != res_info->read)
+        close(res_info->write);
+    }
+    if (res_info->pidfd >= 0) close(res_info->pidfd);
+    res_delete(res_info);
+  }
+}
+
+#endif
+
+// waits until the stdin of the CGI has room again. output the CGI writes
+// meanwhile is appended to `out', up to CGI_BUFFER_MAX, so that it never
+// waits on us while we wait on it. false when it will take no more.
+static bool res_wait_input(RES_INFO* res_info, std::vector<char>& out, size_t& out_len, bool& output) {
+  int want = RES_EV_INPUT;
+  if (output) {
+    if (out_len >= CGI_BUFFER_MAX)
+      return false;
+    want |= RES_EV_OUTPUT;
+  }
+  int ev = res_poll(res_info, want, -1, -1);
+  if (ev < 0 || (ev & RES_EV_EXIT))
+    return false;
+  if (ev & RES_EV_OUTPUT) {
+    if (out.size() < out_len + BUFSIZ)
+      out.resize(out_len + BUFSIZ);
+    long long r = res_read(res_info, &out[out_len], BUFSIZ);
+    if (r < 0)
+      output = false;
+    else
+      out_len += (size_t) r;
+  }
+  return true;
+}
+
+// send() until all of `data' is out; false once the client is gone.
+static bool send_all(int fd, const char* data, unsigned long size) {
+  while (size > 0) {
+    long r = send(fd, data, size, 0);
+#ifndef _WIN32
+    if (r < 0 && errno == EINTR) continue;
+#endif
+    if (r <= 0) return false;
+    data += r;
+    size -= r;
   }
+  return true;
 }
 
+// one chunk of a Transfer-Encoding: chunked body: size line, data and
+// trailing CRLF in a single gather write.
+static long send_chunk(int fd, const char* data, unsigned long size) {
+  char head[32];
+  int head_len = sprintf(head, "%lx\r\n", size);
+#ifdef _WIN32
+  WSABUF bufs[3];
+  DWORD sent = 0;
+  bufs[0].buf = head;
+  bufs[0].len = head_len;
+  bufs[1].buf = (char*) data;
+  bufs[1].len = size;
+  bufs[2].buf = (char*) "\r\n";
+  bufs[2].len = 2;
+  if (WSASend(fd, bufs, 3, &sent, 0, NULL, NULL) != 0)
+    return -1;
+  return sent;
+#else
+  struct iovec iov[3];
+  iov[0].iov_base = head;
+  iov[0].iov_len = head_len;
+  iov[1].iov_base = (void*) data;
+  iov[1].iov_len = size;
+  iov[2].iov_base = (void*) "\r\n";
+  iov[2].iov_len = 2;
+  long w;
+  do
+    w = writev(fd, iov, 3);
+  while (w < 0 && errno == EINTR);
+  if (w < 0) return -1;
+  // after a short write the rest goes out piece by piece.
+  for (int i = 0; i < 3; i++) {
+    if ((size_t) w >= iov[i].iov_len) {
+      w -= iov[i].iov_len;
+      continue;
+    }
+    if (!send_all(fd, (char*) iov[i].iov_base + w, iov[i].iov_len - w))
+      return -1;
+    w = 0;
+  }
+  return head_len + size + 2;
 #endif
+}
 
 static bool get_line(int fd, std::string& s) {
   char c = 0;
-  std::stringstream ss;
+  // `s' keeps its room from the last line.
+  s.clear();
   while (1) {
     if (recv(fd, &c, 1, 0) <= 0)
       return false;
@@ -1040,70 +1661,714 @@ static bool get_line(int fd, std::string& s) {
       continue;
     if (c == '\n')
       break;
-    ss << c;
+    s += c;
   }
-  s = ss.str();
   return true;
 }
 
-void* response_thread(void* param) {
-  server::HttpdInfo *pHttpdInfo = (server::HttpdInfo*)param;
-  server *httpd = pHttpdInfo->httpd;
-  int msgsock = (int)pHttpdInfo->msgsock;
-  std::string address = pHttpdInfo->address;
-  std::string port = pHttpdInfo->port;
-  int servno = pHttpdInfo->servno;
-  std::string str, req, ret;
-  std::vector<std::string> vparam;
-  std::vector<std::string> vauth;
-  std::string res_code;
-  std::string res_proto;
-  std::string res_msg;
-  std::string res_type;
-  std::string res_body;
-  std::string res_head;
-  server::HttpHeader http_headers;
-  unsigned long content_length;
-  RES_INFO* res_info;
-  char buf[BUFSIZ];
-  char length[256];
-  bool keep_alive;
-
-request_top:
-  keep_alive = false;
-  res_code.clear();
-  res_proto.clear();
-  res_msg.clear();
-  res_type.clear();
-  res_head.clear();
-  res_body.clear();
-  res_info = NULL;
-  http_headers.clear();
-  content_length = 0;
-  vauth.clear();
+// the body of a request, read when it is wanted: `left' bytes of it, or of
+// the current chunk when it comes chunked. a client waiting on Expect:
+// 100-continue is told to go on at the first read, so one answered before
+// that never sends its body at all.
+typedef struct {
+  bool chunked;
+  bool expect;
+  bool crlf;
+  bool done;
+  bool too_large;
+  unsigned long long left;
+  unsigned long long total;
+  unsigned long long limit;
+} REQ_BODY;
+
+// sets up `body' from the request headers, which lose the ones about the
+// body's framing. false with `res_code' and `res_msg' set when the request
+// can not be taken.
+static bool req_begin(REQ_BODY* body, server::HttpHeader& http_headers, bool http11, unsigned long long limit, std::string& res_code, std::string& res_msg) {
+  body->chunked = body->expect = body->crlf = body->too_large = false;
+  body->done = true;
+  body->left = body->total = 0;
+  body->limit = limit;
+
+  server::HttpHeader::iterator it = http_headers.find("TRANSFER_ENCODING");
+  if (it != http_headers.end()) {
+    // only chunked; any other coding would reach the CGI still encoded.
+    if (stricmp(it->second.c_str(), "chunked")) {
+      res_code = "501";
+      res_msg = "Not Implemented";
+      return false;
+    }
+    body->chunked = true;
+    body->done = false;
+    http_headers.erase(it);
+    http_headers.erase("CONTENT_LENGTH");
+  } else {
+    it = http_headers.find("CONTENT_LENGTH");
+    if (it != http_headers.end()) {
+      const char* ptr = it->second.c_str();
+      char* end = NULL;
+      errno = 0;
+      body->left = strtoull(ptr, &end, 10);
+      if (!isdigit((unsigned char) *ptr) || *end || errno) {
+        res_code = "400";
+        res_msg = "Bad Request";
+        return false;
+      }
+      body->done = body->left == 0;
+    }
+  }
+  it = http_headers.find("EXPECT");
+  if (it != http_headers.end()) {
+    if (stricmp(it->second.c_str(), "100-continue")) {
+      res_code = "417";
+      res_msg = "Expectation Failed";
+      return false;
+    }
+    // HTTP/1.0 clients do not know 100 Continue.
+    body->expect = http11 && !body->done;
+    http_headers.erase(it);
+  }
 
-  if (!get_line(msgsock, req) || req.empty())
-    goto request_end;
-  if (VERBOSE(1)) printf("* %s\n", req.c_str());
+  if (limit && !body->chunked && body->left > limit) {
+    body->too_large = true;
+    res_code = "413";
+    res_msg = "Request Entity Too Large";
+    return false;
+  }
+  return true;
+}
 
-  do {
-    if (!get_line(msgsock, str))
-      goto request_end;
-    if (str.empty())
-      break;
-    const char *ptr = str.c_str();
+// sends the 100 Continue a client may be waiting for.
+static bool req_continue(REQ_BODY* body, int sock) {
+  if (!body->expect)
+    return true;
+  body->expect = false;
+  const char* res = "HTTP/1.1 100 Continue\r\n\r\n";
+  return send(sock, res, (int)strlen(res), 0) > 0;
+}
 
-    if (!strnicmp(ptr, "SERVER_", 7) || !strnicmp(ptr, "REMOTE_", 7))
-      continue;
-    char* stp = (char*)strchr(ptr, ':');
-    if (stp) {
-      *stp = 0;
-      std::string key = ptr;
-      std::transform(key.begin(), key.end(), key.begin(), toupper);
-      std::string val = trim_string(stp + 1);
-      replace_string(key, "-", "_");
-      std::transform(key.begin(), key.end(), key.begin(), toupper);
-      http_headers[key] = val;
+// reads up to `size' bytes of the body, unframed. returns 0 at its end and
+// -1 when the client went away, sent a broken chunk or went over the limit.
+static long req_read(REQ_BODY* body, int sock, char* buf, unsigned long size) {
+  if (body->done)
+    return 0;
+  if (!req_continue(body, sock))
+    return -1;
+  if (body->chunked && !body->left) {
+    std::string line;
+    if (body->crlf && (!get_line(sock, line) || !line.empty()))
+      return -1;
+    body->crlf = false;
+    if (!get_line(sock, line) || !isxdigit((unsigned char) line[0]))
+      return -1;
+    char* end = NULL;
+    errno = 0;
+    body->left = strtoull(line.c_str(), &end, 16);
+    // chunk extensions are ignored.
+    if (errno || (*end && *end != ';' && *end != ' ' && *end != '\t'))
+      return -1;
+    if (!body->left) {
+      // so are trailers.
+      do {
+        if (!get_line(sock, line))
+          return -1;
+      } while (!line.empty());
+      body->done = true;
+      return 0;
+    }
+    if (body->limit && body->total + body->left > body->limit) {
+      body->too_large = true;
+      return -1;
+    }
+    body->crlf = true;
+  }
+  long r = recv(sock, buf, body->left < size ? (unsigned long) body->left : size, 0);
+  if (r <= 0)
+    return -1;
+  body->left -= r;
+  body->total += r;
+  if (!body->chunked && !body->left)
+    body->done = true;
+  return r;
+}
+
+// closing a socket with data unread makes a reset, which can destroy the
+// response before the client has read it. the client gets to see the end
+// of the response first, and what it still sends is dropped for a while.
+static void req_linger(int sock) {
+  char buf[BUFSIZ];
+  time_t end = time(NULL) + REQ_LINGER;
+#ifdef _WIN32
+  DWORD tv = 1000;
+#else
+  struct timeval tv;
+  tv.tv_sec = 1;
+  tv.tv_usec = 0;
+#endif
+  shutdown(sock, SD_SEND);
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*) &tv, sizeof(tv));
+  while (time(NULL) < end && recv(sock, buf, sizeof(buf), 0) > 0)
+    ;
+}
+
+#ifndef _WIN32
+enum { PROXY_OK, PROXY_READ_FAILED, PROXY_WRITE_FAILED };
+
+// the response of a proxied backend, read through a buffer.
+typedef struct {
+  int fd;
+  std::vector<char> buf;
+  size_t pos, len;
+} PROXY_READER;
+
+static bool proxy_send(int fd, const char* data, size_t size, int flags) {
+  while (size > 0) {
+    ssize_t r = send(fd, data, size, flags);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    data += r;
+    size -= r;
+  }
+  return true;
+}
+
+static long proxy_fill(PROXY_READER* r) {
+  if (r->pos) {
+    memmove(&r->buf[0], &r->buf[r->pos], r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+  }
+  if (r->buf.size() < r->len + BUFSIZ)
+    r->buf.resize(r->len + BUFSIZ);
+  ssize_t n;
+  do
+    n = recv(r->fd, &r->buf[r->len], r->buf.size() - r->len, 0);
+  while (n < 0 && errno == EINTR);
+  if (n > 0)
+    r->len += n;
+  return n;
+}
+
+// one line without its CRLF. fails at EOF or on a line over CGI_HEADER_MAX.
+static bool proxy_getline(PROXY_READER* r, std::string& line) {
+  size_t off = 0;
+  while (true) {
+    const char* start = &r->buf[r->pos];
+    const char* eol = (const char*) memchr(start + off, '\n', r->len - r->pos - off);
+    if (eol) {
+      size_t size = eol - start;
+      if (size && start[size - 1] == '\r')
+        size--;
+      line.assign(start, size);
+      r->pos += eol - start + 1;
+      return true;
+    }
+    off = r->len - r->pos;
+    if (off > CGI_HEADER_MAX || proxy_fill(r) <= 0)
+      return false;
+  }
+}
+
+// moves `size' bytes from one socket to another, through a pipe with
+// splice() where there is one, so that the data never enters user space.
+static int proxy_move(int from, int to, unsigned long long size, int pipefd[2], char* buf, size_t buf_size) {
+#ifdef HAVE_SPLICE
+  if (size > buf_size && pipefd[0] < 0 && res_pipe(pipefd) == 0) {
+#ifdef F_SETPIPE_SZ
+    fcntl(pipefd[0], F_SETPIPE_SZ, 256 * 1024);
+#endif
+  }
+  if (size > buf_size && pipefd[0] >= 0) {
+    while (size > 0) {
+      ssize_t r = splice(from, NULL, pipefd[1], NULL, size < 1024 * 1024 ? size : 1024 * 1024, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) return PROXY_READ_FAILED;
+      size -= r;
+      while (r > 0) {
+        ssize_t w = splice(pipefd[0], NULL, to, NULL, r, SPLICE_F_MOVE | (size ? SPLICE_F_MORE : 0));
+        if (w < 0 && errno == EINTR) continue;
+        // what is left in the pipe is garbage now; the caller drops it.
+        if (w <= 0) return PROXY_WRITE_FAILED;
+        r -= w;
+      }
+    }
+    return PROXY_OK;
+  }
+#endif
+  while (size > 0) {
+    ssize_t r = recv(from, buf, size < buf_size ? size : buf_size, 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return PROXY_READ_FAILED;
+    if (!proxy_send(to, buf, r, 0)) return PROXY_WRITE_FAILED;
+    size -= r;
+  }
+  return PROXY_OK;
+}
+
+// `size' bytes of body from the backend to the client, what is buffered
+// first.
+static int proxy_copy(PROXY_READER* r, int sock, unsigned long long size, int pipefd[2]) {
+  size_t avail = r->len - r->pos;
+  if (avail > size)
+    avail = size;
+  if (avail) {
+    if (!proxy_send(sock, &r->buf[r->pos], avail, size > avail ? MSG_MORE : 0))
+      return PROXY_WRITE_FAILED;
+    r->pos += avail;
+    size -= avail;
+  }
+  if (r->pos == r->len)
+    r->pos = r->len = 0;
+  return proxy_move(r->fd, sock, size, pipefd, &r->buf[0], r->buf.size());
+}
+
+// "CONTENT_TYPE" back to "Content-Type". the spelling a client used is lost
+// when its headers are parsed, so the usual capitalization is assumed.
+static std::string proxy_header_name(StringSpan key) {
+  std::string name(key.ptr, key.len);
+  bool upper = true;
+  for (std::string::iterator it = name.begin(); it != name.end(); it++) {
+    if (*it == '_') {
+      *it = '-';
+      upper = true;
+    } else {
+      *it = upper ? toupper(*it) : tolower(*it);
+      upper = false;
+    }
+  }
+  return name;
+}
+
+// forwards a request to a backend of `proxy' and relays the response. the
+// body is taken from the client as it goes, a chunked one passed on in
+// chunks again. returns false when no response could be had, with
+// nothing sent to the client; otherwise `keep_alive' tells whether the
+// client connection can go on, `res_code' and `sent' what was relayed.
+static bool proxy_request(HttpProxy* proxy, int msgsock, const std::string& address, const std::string& method, const std::string& uri, const std::string& proto, server::HttpHeader& http_headers, REQ_BODY* req_body, bool& keep_alive, std::string& res_code, unsigned long long& sent) {
+  std::string head = method + " " + uri + " HTTP/1.1\r\n";
+  std::string forwarded_for;
+  bool has_host = false;
+  for (server::HttpHeader::iterator it = http_headers.begin(); it != http_headers.end(); it++) {
+    const ArenaString& key = it->first;
+    // hop-by-hop headers are between the client and us only.
+    if (key == "CONNECTION" || key == "KEEP_ALIVE" || key == "PROXY_CONNECTION" ||
+        key == "TE" || key == "TRAILER" || key == "TRANSFER_ENCODING" || key == "UPGRADE")
+      continue;
+    if (key == "X_FORWARDED_FOR") {
+      forwarded_for = it->second.c_str();
+      forwarded_for += ", ";
+      continue;
+    }
+    if (key == "HOST")
+      has_host = true;
+    head += proxy_header_name(key) + ": " + it->second.c_str() + "\r\n";
+  }
+  head += "X-Forwarded-For: " + forwarded_for + address + "\r\n";
+  if (req_body->chunked)
+    head += "Transfer-Encoding: chunked\r\n";
+  head += "Connection: keep-alive\r\n";
+
+  PROXY_READER r;
+  r.buf.resize(BUFSIZ);
+  int pipefd[2] = { -1, -1 };
+  int backend = -1;
+  bool reused = false;
+  bool body_sent = false;
+  bool done = false;
+  std::string line;
+  while (!body_sent) {
+    r.fd = proxy->acquire(backend, reused);
+    if (r.fd < 0)
+      break;
+    if (!reused) {
+      struct timeval tv;
+      tv.tv_sec = PROXY_TIMEOUT;
+      tv.tv_usec = 0;
+      setsockopt(r.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    r.pos = r.len = 0;
+    std::string req = head;
+    if (!has_host)
+      req += "Host: " + proxy->address(backend) + "\r\n";
+    req += "\r\n";
+    if (!proxy_send(r.fd, req.c_str(), req.size(), req_body->done ? 0 : MSG_MORE)) {
+      // an idle connection the backend closed meanwhile: try another.
+      if (reused) {
+        proxy->discard(backend, r.fd);
+        continue;
+      }
+      proxy->failed(backend, r.fd);
+      break;
+    }
+    if (!req_body->done) {
+      body_sent = true;
+      int ret = PROXY_OK;
+      if (!req_continue(req_body, msgsock))
+        ret = PROXY_READ_FAILED;
+      else if (!req_body->chunked) {
+        ret = proxy_move(msgsock, r.fd, req_body->left, pipefd, &r.buf[0], r.buf.size());
+        if (ret == PROXY_OK) {
+          req_body->left = 0;
+          req_body->done = true;
+        }
+      } else {
+        while (ret == PROXY_OK) {
+          long n = req_read(req_body, msgsock, &r.buf[0], r.buf.size());
+          if (n < 0)
+            ret = PROXY_READ_FAILED;
+          else if (n == 0)
+            ret = proxy_send(r.fd, "0\r\n\r\n", 5, 0) ? PROXY_OK : PROXY_WRITE_FAILED;
+          else if (send_chunk(r.fd, &r.buf[0], n) < 0)
+            ret = PROXY_WRITE_FAILED;
+          if (n == 0)
+            break;
+        }
+      }
+      if (ret != PROXY_OK) {
+        // the body was taken partly: neither retry nor keep the client.
+        keep_alive = false;
+        if (ret == PROXY_READ_FAILED)
+          proxy->discard(backend, r.fd);
+        else
+          proxy->failed(backend, r.fd);
+        break;
+      }
+    }
+    if (proxy_getline(&r, line)) {
+      done = true;
+      break;
+    }
+    if (reused && !body_sent) {
+      proxy->discard(backend, r.fd);
+      continue;
+    }
+    proxy->failed(backend, r.fd);
+    break;
+  }
+  if (!done) {
+    if (pipefd[0] >= 0) {
+      close(pipefd[0]);
+      close(pipefd[1]);
+    }
+    return false;
+  }
+
+  int status = 0;
+  bool upstream_11 = false;
+  bool upstream_keep = false;
+  bool upstream_close = false;
+  bool upstream_chunked = false;
+  bool has_length = false;
+  unsigned long long length = 0;
+  std::string status_line, headers;
+  bool failed = false;
+  while (true) {
+    if (line.size() < 12 || strncmp(line.c_str(), "HTTP/1.", 7)) {
+      failed = true;
+      break;
+    }
+    upstream_11 = line[7] != '0';
+    status = atoi(line.c_str() + 9);
+    status_line = line.substr(9);
+    headers.clear();
+    upstream_keep = upstream_close = upstream_chunked = has_length = false;
+    while ((failed = !proxy_getline(&r, line)) == false && !line.empty()) {
+      size_t colon = line.find(':');
+      if (colon == std::string::npos) continue;
+      std::string key = line.substr(0, colon);
+      std::string val = trim_string(line.substr(colon + 1));
+      if (!stricmp(key.c_str(), "Connection")) {
+        if (!stricmp(val.c_str(), "close"))
+          upstream_close = true;
+        else if (!stricmp(val.c_str(), "keep-alive"))
+          upstream_keep = true;
+        continue;
+      }
+      if (!stricmp(key.c_str(), "Transfer-Encoding")) {
+        if (strstr(val.c_str(), "chunked"))
+          upstream_chunked = true;
+        continue;
+      }
+      if (!stricmp(key.c_str(), "Content-Length")) {
+        has_length = true;
+        length = strtoull(val.c_str(), NULL, 10);
+        continue;
+      }
+      if (!stricmp(key.c_str(), "Keep-Alive") || !stricmp(key.c_str(), "Proxy-Connection"))
+        continue;
+      headers += line + "\r\n";
+    }
+    // interim responses are not passed on; the final one follows.
+    if (failed || status >= 200 || status < 100 || status == 101)
+      break;
+    if (!proxy_getline(&r, line)) {
+      failed = true;
+      break;
+    }
+  }
+  if (failed || status == 101) {
+    proxy->failed(backend, r.fd);
+    if (pipefd[0] >= 0) {
+      close(pipefd[0]);
+      close(pipefd[1]);
+    }
+    return false;
+  }
+
+  // how the backend frames the body, and how it goes to the client.
+  enum { BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_CLOSE } body;
+  if (method == "HEAD" || status == 204 || status == 304)
+    body = BODY_NONE;
+  else if (upstream_chunked)
+    body = BODY_CHUNKED;
+  else if (has_length)
+    body = BODY_LENGTH;
+  else
+    body = BODY_CLOSE;
+  bool reusable = !upstream_close && (upstream_11 || upstream_keep) && body != BODY_CLOSE;
+
+  bool chunked = false;
+  if (has_length && !upstream_chunked) {
+    char num[32];
+    sprintf(num, "%llu", length);
+    headers += "Content-Length: ";
+    headers += num;
+    headers += "\r\n";
+  } else if (body != BODY_NONE) {
+    if (proto == "HTTP/1.1") {
+      headers += "Transfer-Encoding: chunked\r\n";
+      chunked = true;
+    } else
+      keep_alive = false;
+  }
+  std::string res_head = proto + " " + status_line + "\r\n" + headers;
+  res_code = status_line.substr(0, 3);
+  res_head += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+  int ret = proxy_send(msgsock, res_head.c_str(), res_head.size(), body != BODY_NONE ? MSG_MORE : 0) ? PROXY_OK : PROXY_WRITE_FAILED;
+  if (ret == PROXY_OK && body == BODY_LENGTH) {
+    ret = proxy_copy(&r, msgsock, length, pipefd);
+    if (ret == PROXY_OK)
+      sent += length;
+  }
+  else if (ret == PROXY_OK && body == BODY_CHUNKED) {
+    while (ret == PROXY_OK) {
+      if (!proxy_getline(&r, line) || line.empty() || !isxdigit((unsigned char) line[0])) {
+        ret = PROXY_READ_FAILED;
+        break;
+      }
+      unsigned long long size = strtoull(line.c_str(), NULL, 16);
+      if (size == 0)
+        break;
+      if (chunked) {
+        char num[32];
+        int num_len = sprintf(num, "%llx\r\n", size);
+        if (!proxy_send(msgsock, num, num_len, MSG_MORE)) {
+          ret = PROXY_WRITE_FAILED;
+          break;
+        }
+      }
+      ret = proxy_copy(&r, msgsock, size, pipefd);
+      if (ret == PROXY_OK)
+        sent += size;
+      if (ret == PROXY_OK && chunked && !proxy_send(msgsock, "\r\n", 2, MSG_MORE))
+        ret = PROXY_WRITE_FAILED;
+      if (ret == PROXY_OK && (!proxy_getline(&r, line) || !line.empty()))
+        ret = PROXY_READ_FAILED;
+    }
+    // trailers are dropped.
+    while (ret == PROXY_OK && !line.empty()) {
+      if (!proxy_getline(&r, line))
+        ret = PROXY_READ_FAILED;
+    }
+  } else if (ret == PROXY_OK && body == BODY_CLOSE) {
+    // the backend closing ends the body, so the end is not an error.
+    while (true) {
+      size_t avail = r.len - r.pos;
+      if (avail && !(chunked ? send_chunk(msgsock, &r.buf[r.pos], avail) > 0 : proxy_send(msgsock, &r.buf[r.pos], avail, 0))) {
+        ret = PROXY_WRITE_FAILED;
+        break;
+      }
+      sent += avail;
+      r.pos = r.len = 0;
+      if (proxy_fill(&r) <= 0)
+        break;
+    }
+  }
+  if (ret == PROXY_OK && chunked && !proxy_send(msgsock, "0\r\n\r\n", 5, 0))
+    ret = PROXY_WRITE_FAILED;
+
+  if (ret == PROXY_OK)
+    proxy->release(backend, r.fd, reusable);
+  else if (ret == PROXY_READ_FAILED)
+    proxy->failed(backend, r.fd);
+  else
+    proxy->discard(backend, r.fd);
+  // a body cut short can not be told from a whole one but by closing.
+  if (ret != PROXY_OK)
+    keep_alive = false;
+  if (pipefd[0] >= 0) {
+    close(pipefd[0]);
+    close(pipefd[1]);
+  }
+  return true;
+}
+#endif
+
+#ifndef _WIN32
+// hands a finished request to the access log.
+static void log_request(AccessLog* log, AccessLog::Ring* ring, const std::string& address, const std::vector<std::string>& vauth, const std::string& req, const server::HttpHeader& http_headers, int status, unsigned long long bytes, time_t started, unsigned long long start) {
+  server::HttpHeader::const_iterator referer = http_headers.find("REFERER");
+  server::HttpHeader::const_iterator agent = http_headers.find("USER_AGENT");
+  AccessLog::Entry entry;
+  entry.time = started;
+  entry.usec = ServerStatus::now() - start;
+  entry.bytes = bytes;
+  entry.status = status;
+  entry.address = address;
+  if (!vauth.empty())
+    entry.user = vauth[0];
+  entry.request = req;
+  if (referer != http_headers.end())
+    entry.referer = referer->second;
+  if (agent != http_headers.end())
+    entry.agent = agent->second;
+  log->log(ring, entry);
+}
+#endif
+
+void* response_thread(void* param) {
+  server::HttpdInfo *pHttpdInfo = (server::HttpdInfo*)param;
+  server *httpd = pHttpdInfo->httpd;
+  int msgsock = (int)pHttpdInfo->msgsock;
+  std::string address = pHttpdInfo->address;
+  std::string port = pHttpdInfo->port;
+  int servno = pHttpdInfo->servno;
+  bool tls = pHttpdInfo->tls;
+  // per-request data comes from here, and goes all at once at the top
+  // of the next request.
+  Arena arena;
+  Arena::use(&arena);
+  std::string str, req, ret;
+  std::vector<std::string> vparam;
+  std::vector<std::string> vauth;
+  std::string root, path, before;  // kept, so that their room is reused
+  std::string res_code;
+  std::string res_proto;
+  std::string res_msg;
+  std::string res_type;
+  std::string res_body;
+  std::string res_head;
+  server::HttpHeader http_headers;
+  REQ_BODY req_body;
+  RES_INFO* res_info;
+  char buf[BUFSIZ];
+  char length[256];
+  bool keep_alive;
+  bool head_only;
+  bool chunked;
+  bool linger;
+  std::vector<char> cgi_buf;
+  size_t cgi_len, cgi_body;
+  int redirects;
+  unsigned long long marked, sent_bytes, started_usec;
+  time_t started;
+  ServerStatus::Counters* stats;
+#ifndef _WIN32
+  AccessLog::Ring* log_ring;
+#endif
+  bool timed;
+#ifdef TTHTTPD_DEBUG
+  unsigned long long allocations;
+#endif
+
+  linger = false;
+  marked = started_usec = 0;
+  started = 0;
+  stats = httpd->status ? httpd->status->attach() : NULL;
+  timed = stats != NULL;
+#ifndef _WIN32
+  log_ring = httpd->access_logger ? httpd->access_logger->attach() : NULL;
+  timed = timed || log_ring;
+#endif
+  // streams of an HTTP/2 connection are requests, not connections.
+  if (stats && !pHttpdInfo->stream)
+    stats->connection_opened();
+#ifdef HAVE_OPENSSL
+  if (tls && !pHttpdInfo->stream) {
+    bool h2 = false;
+    msgsock = httpd->tls->accept(msgsock, h2);
+    if (msgsock < 0)
+      goto request_end;
+    if (h2) {
+      Http2Session session(*pHttpdInfo, msgsock, response_thread);
+      session.serve(0);
+      goto request_end;
+    }
+  }
+#endif
+
+request_top:
+  keep_alive = false;
+  chunked = false;
+  cgi_len = cgi_body = 0;
+  redirects = 0;
+  sent_bytes = 0;
+  res_code.clear();
+  res_proto.clear();
+  res_msg.clear();
+  res_type.clear();
+  res_head.clear();
+  res_body.clear();
+  res_info = NULL;
+  http_headers.clear();
+  vauth.clear();
+  arena.reset();
+#ifdef TTHTTPD_DEBUG
+  allocations = Arena::allocations();
+#endif
+
+  if (timed) {
+    // the head is timed from its first byte, not from the wait for it.
+    if (recv(msgsock, buf, 1, MSG_PEEK) <= 0)
+      goto request_end;
+    marked = started_usec = ServerStatus::now();
+    started = time(NULL);
+  }
+  if (!get_line(msgsock, req) || req.empty())
+    goto request_end;
+  if (VERBOSE(1)) printf("* %s\n", req.c_str());
+  // errors answered before the request line is split need this too.
+  head_only = !req.compare(0, 5, "HEAD ");
+
+#ifndef _WIN32
+  if (req == "PRI * HTTP/2.0" && httpd->http2 && !pHttpdInfo->stream) {
+    // HTTP/2 with prior knowledge; the rest of the preface follows.
+    Http2Session session(*pHttpdInfo, msgsock, response_thread);
+    session.serve(16);
+    goto request_end;
+  }
+#endif
+
+  do {
+    if (!get_line(msgsock, str))
+      goto request_end;
+    if (str.empty())
+      break;
+    const char *ptr = str.c_str();
+
+    if (!strnicmp(ptr, "SERVER_", 7) || !strnicmp(ptr, "REMOTE_", 7))
+      continue;
+    const char* stp = strchr(ptr, ':');
+    if (stp) {
+      ArenaString key(ptr, stp - ptr);
+      for (ArenaString::iterator it = key.begin(); it != key.end(); it++)
+        *it = *it == '-' ? '_' : toupper(*it);
+      const char* val = stp + 1;
+      const char* end = val + strlen(val);
+      while (val < end && *val == ' ') val++;
+      while (end > val && end[-1] == ' ') end--;
+      http_headers[key].assign(val, end - val);
     }
   } while (true);
 
@@ -1113,27 +2378,60 @@ request_top:
       printf("  %s=%s\n", it->first.c_str(), it->second.c_str());
   }
 
-  if (http_headers.count("CONNECTION")
-      && !stricmp(http_headers["CONNECTION"].c_str(), "keep-alive"))
+  if (http_headers.count("CONNECTION")) {
+    if (!stricmp(http_headers["CONNECTION"].c_str(), "keep-alive"))
+      keep_alive = true;
+  } else
+  if (req.size() > 9 && !strcmp(req.c_str() + req.size() - 9, " HTTP/1.1")) {
+    // persistent unless told otherwise.
     keep_alive = true;
+  }
 
-  if (http_headers.count("CONTENT_LENGTH"))
-    content_length = atol(http_headers["CONTENT_LENGTH"].c_str());
+  if (!req_begin(&req_body, http_headers, req.size() > 9 && !strcmp(req.c_str() + req.size() - 9, " HTTP/1.1"),
+        httpd->max_body_size, res_code, res_msg)) {
+    // the body can not be found, or is not wanted: the connection goes.
+    StringTokens<3> words(req, " ");
+    res_proto = words.size() > 2 ? words[2].str() : "HTTP/1.0";
+    res_type = "text/plain";
+    res_body = res_msg + "\n";
+    keep_alive = false;
+    linger = true;
+    goto request_done;
+  }
+  if (stats)
+    marked = stats->phase(ServerStatus::PHASE_HEADER, marked);
+
+#ifndef _WIN32
+  // h2c upgrade. the request becomes stream 1; one with a body is served
+  // over HTTP/1.1 instead, which the client has to accept.
+  if (httpd->http2 && !tls && !pHttpdInfo->stream && http_headers.count("HTTP2_SETTINGS") &&
+      !stricmp(http_headers["UPGRADE"].c_str(), "h2c") &&
+      req_body.done) {
+    std::string head = req + "\r\n";
+    server::HttpHeader::const_iterator it;
+    for (it = http_headers.begin(); it != http_headers.end(); it++) {
+      if (it->first == "UPGRADE" || it->first == "HTTP2_SETTINGS" || it->first == "CONNECTION")
+        continue;
+      head += proxy_header_name(it->first) + ": " + it->second.c_str() + "\r\n";
+    }
+    head += "Connection: close\r\n\r\n";
+    Http2Session session(*pHttpdInfo, msgsock, response_thread);
+    if (session.upgrade(http_headers["HTTP2_SETTINGS"].c_str(), head)) {
+      ret = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+      send(msgsock, ret.c_str(), (int)ret.size(), 0);
+      session.serve(0);
+      goto request_end;
+    }
+  }
+#endif
 
   if (httpd->loggerfunc) {
     httpd->loggerfunc(pHttpdInfo, req);
   }
 
+request_local:
   split_string(req, " ", vparam);
   try {
-    if (httpd->accept_ips.size() > 0 &&
-        std::find(httpd->accept_ips.begin(), httpd->accept_ips.end(), address)
-          == httpd->accept_ips.end()) {
-      res_code = "403";
-      res_msg = "Forbidden";
-      res_body = "Forbidden";
-      goto request_done;
-    } else
     if (vparam.size() < 2 || vparam[1][0] != '/') {
       res_code = "500";
       res_msg = "Bad Request";
@@ -1144,14 +2442,15 @@ request_top:
         res_proto = "HTTP/1.0";
       else
         res_proto = vparam[2];
-      std::string auth = http_headers["AUTHORIZATION"];
+      std::string auth = http_headers["AUTHORIZATION"].c_str();
       if (!auth.empty()) {
         if (!strnicmp(auth.c_str(), "basic ", 6))
           auth = base64_decode(auth.c_str()+6);
         split_string(auth, ":", vauth);
       }
-      if (vparam[0] == "GET" || vparam[0] == "POST" || vparam[0] == "HEAD") {
-        std::string root = server::get_realpath(httpd->root + "/");
+      // other methods are only passed on to [proxy] backends.
+      bool method_ok = vparam[0] == "GET" || vparam[0] == "POST" || vparam[0] == "HEAD";
+      if (method_ok || !httpd->proxies.empty()) {
         std::string request_uri = vparam[1];
         std::string script_name = vparam[1];
         std::string query_string;
@@ -1164,32 +2463,58 @@ request_top:
           path_info = script_name;
         }
 
-        server::RequestAliases::iterator it_alias;
-        for(it_alias = httpd->request_aliases.begin();
-                it_alias != httpd->request_aliases.end(); it_alias++) {
-          if (path_info == it_alias->first) {
-            vparam[1] = it_alias->second;
-            break;
+        server::Router::Route route;
+        httpd->router.match(script_name, vparam[0], route);
+        if (route.alias) {
+          server::Router::Route aliased;
+          vparam[1] = *route.alias;
+          httpd->router.match(vparam[1], vparam[0], aliased);
+          route.auth = aliased.auth;
+        }
+        if (!method_ok && !route.proxy) {
+          res_type = "text/plain";
+          res_code = "500";
+          res_msg = "Bad Request";
+          res_body = "Bad Request\n";
+          goto request_done;
+        }
+        if (route.mount) {
+          // everything below a mount point goes to the upstream.
+          path_info = script_name.substr(route.mount_len);
+          script_name.resize(route.mount_len);
+          if (!script_name.empty() && script_name[script_name.size()-1] == '/') {
+            script_name.resize(script_name.size() - 1);
+            path_info.insert(0, "/");
           }
         }
 
-        std::string before = root;
-        if (before[before.size()-1] == '/')
-          before.resize(before.size() - 1);
-        before += tthttpd::url_decode(script_name);
-        std::string path = server::get_realpath(before);
-        if (before != path && (path.size() < root.size() || path.substr(root.size()) == root)) {
-          if (path.size() > root.size())
-            path = path.c_str() + root.size();
-          else
-            path = "/";
-          res_code = "301";
-          res_msg = "Document Moved";
-          res_body = "Document Moved\n";
-          res_head = "Location: ";
-          res_head += path;
-          res_head += "\n";
-          goto request_done;
+        // the status page is answered from memory, whatever is on disk.
+        bool status_page = httpd->status && script_name == httpd->status_page;
+        if (!status_page) {
+          before = httpd->root;
+          before += "/";
+          server::get_realpath(before, root);
+          before = root;
+          if (before[before.size()-1] == '/')
+            before.resize(before.size() - 1);
+          size_t decoded = before.size();
+          before.resize(decoded + script_name.size());
+          if (script_name.size())
+            before.resize(decoded + tthttpd::url_decode(script_name.data(), script_name.size(), &before[decoded]));
+          server::get_realpath(before, path);
+          if (before != path && (path.size() < root.size() || !path.compare(root.size(), std::string::npos, root))) {
+            if (path.size() > root.size())
+              path = path.c_str() + root.size();
+            else
+              path = "/";
+            res_code = "301";
+            res_msg = "Document Moved";
+            res_body = "Document Moved\n";
+            res_head = "Location: ";
+            res_head += path;
+            res_head += "\n";
+            goto request_done;
+          }
         }
         /*
         if (strncmp(root.c_str(), path.c_str(), root.size())) {
@@ -1200,20 +2525,13 @@ request_top:
         }
         */
 
-        std::vector<server::BasicAuthInfo>::iterator it_basicauth;
-        std::vector<std::string> methods;
-        for (it_basicauth = httpd->basic_auths.begin(); it_basicauth != httpd->basic_auths.end(); it_basicauth++) {
-          split_string(it_basicauth->method, "/", methods);
-          if (!methods.empty() && std::find(methods.begin(), methods.end(), vparam[0]) == methods.end()) continue;
-          if (!it_basicauth->target.empty() && strncmp(vparam[1].c_str(), it_basicauth->target.c_str(), it_basicauth->target.size())) continue;
-          break;
-        }
-        if (it_basicauth != httpd->basic_auths.end()) {
+        const server::BasicAuthInfo* basicauth = route.auth;
+        if (basicauth) {
           bool authorized = false;
           if (!vauth.empty()) {
             if (VERBOSE(2)) printf("  authorizing %s\n", vparam[1].c_str());
-            std::vector<server::AuthInfo>::iterator it_auth;
-            for (it_auth = it_basicauth->auths.begin(); it_auth != it_basicauth->auths.end(); it_auth++) {
+            std::vector<server::AuthInfo>::const_iterator it_auth;
+            for (it_auth = basicauth->auths.begin(); it_auth != basicauth->auths.end(); it_auth++) {
               if (it_auth->user != vauth[0]) continue;
               /*
               std::vector<std::string> pwd = split_string(it_auth->pass, "$");
@@ -1234,9 +2552,9 @@ request_top:
             res_code = "401";
             res_msg = "Authorization Required";
             res_head = "WWW-Authenticate: Basic";
-            if (!it_basicauth->realm.empty()) {
+            if (!basicauth->realm.empty()) {
               res_head += " realm=\"";
-              res_head += it_basicauth->realm;
+              res_head += basicauth->realm;
               res_head += "\"";
             }
             res_head += "\r\n";
@@ -1245,30 +2563,110 @@ request_top:
           }
         }
         if (!vauth.empty()) {
-          server::AcceptAuths::iterator it_accept;
-          for(it_accept = httpd->accept_auths.begin(); it_accept != httpd->accept_auths.end(); it_accept++) {
-            if (!strncmp(it_accept->first.c_str(), script_name.c_str(), it_accept->first.size())) {
-              if (std::find(
-                    it_accept->second.accept_list.begin(),
-                    it_accept->second.accept_list.end(), vauth[0])
-                  == it_accept->second.accept_list.end()) {
-                res_code = "401";
-                res_msg = "Authorization Required";
-                res_head = "WWW-Authenticate: Basic";
-                if (!it_basicauth->realm.empty()) {
-                  res_head += " realm=\"";
-                  res_head += it_basicauth->realm;
-                  res_head += "\"";
-                }
-                res_head += "\r\n";
-                res_body = "Authorization Required";
-                goto request_done;
+          std::vector<const server::AcceptAuth*>::iterator it_accept;
+          for(it_accept = route.accepts.begin(); it_accept != route.accepts.end(); it_accept++) {
+            if (std::find(
+                  (*it_accept)->accept_list.begin(),
+                  (*it_accept)->accept_list.end(), vauth[0])
+                == (*it_accept)->accept_list.end()) {
+              res_code = "401";
+              res_msg = "Authorization Required";
+              res_head = "WWW-Authenticate: Basic";
+              if (basicauth && !basicauth->realm.empty()) {
+                res_head += " realm=\"";
+                res_head += basicauth->realm;
+                res_head += "\"";
               }
+              res_head += "\r\n";
+              res_body = "Authorization Required";
+              goto request_done;
             }
           }
         }
+        if (stats)
+          marked = stats->phase(ServerStatus::PHASE_RESOLVE, marked);
+
+        if (status_page) {
+          // "?auto" asks for the counters one per line, for scripts.
+          bool machine = query_string == "auto";
+          res_type = machine ? "text/plain" : "text/html";
+          res_code = "200";
+          res_msg = "OK";
+          res_head = "Cache-Control: no-cache\r\n";
+          res_body = httpd->status->report(machine);
+          goto request_done;
+        }
+
+#ifndef _WIN32
+        if (route.proxy) {
+          server::HttpProxies::iterator it_proxy = httpd->proxies.find(*route.proxy);
+          if (it_proxy != httpd->proxies.end() &&
+              proxy_request(it_proxy->second, msgsock, address, vparam[0], request_uri, res_proto, http_headers, &req_body, keep_alive, res_code, sent_bytes))
+            goto request_next;
+          res_type = "text/plain";
+          if (req_body.too_large) {
+            res_code = "413";
+            res_msg = "Request Entity Too Large";
+          } else {
+            res_code = "502";
+            res_msg = "Bad Gateway";
+          }
+          res_body = res_msg + "\n";
+          goto request_done;
+        }
+
+        if (route.mount && !strncmp(route.mount->c_str(), "@ws:", 4) && httpd->websocket_hub) {
+          std::string upgrade = http_headers["UPGRADE"].c_str();
+          std::transform(upgrade.begin(), upgrade.end(), upgrade.begin(), tolower);
+          if (vparam[0] != "GET" || upgrade.find("websocket") == std::string::npos ||
+              http_headers["SEC_WEBSOCKET_KEY"].empty() || http_headers["SEC_WEBSOCKET_VERSION"] != "13") {
+            res_type = "text/plain";
+            res_code = "426";
+            res_msg = "Upgrade Required";
+            res_head = "Upgrade: websocket\r\nSec-WebSocket-Version: 13\r\n";
+            res_body = "Upgrade Required\n";
+            goto request_done;
+          }
+          ret = "HTTP/1.1 101 Switching Protocols\r\n";
+          ret += "Upgrade: websocket\r\n";
+          ret += "Connection: Upgrade\r\n";
+          ret += "Sec-WebSocket-Accept: " + websocket_accept(http_headers["SEC_WEBSOCKET_KEY"].c_str()) + "\r\n\r\n";
+          if (send(msgsock, ret.c_str(), (int)ret.size(), 0) == (int)ret.size()) {
+            httpd->websocket_hub->attach(msgsock, route.mount->substr(4), request_uri);
+            msgsock = -1;
+            if (stats)
+              stats->request_done(101, 0);
+            if (log_ring)
+              log_request(httpd->access_logger, log_ring, address, vauth, req, http_headers, 101, 0, started, started_usec);
+          }
+          goto request_end;
+        }
 
-        if (res_isdir(path) && vparam[1].size() && vparam[1][vparam[1].size()-1] != '/') {
+        if (route.mount && !strncmp(route.mount->c_str(), "@sse:", 5) && httpd->eventstream_hub) {
+          if (vparam[0] != "GET") {
+            res_type = "text/plain";
+            res_code = "500";
+            res_msg = "Bad Request";
+            res_body = "Bad Request\n";
+            goto request_done;
+          }
+          ret = res_proto + " 200 OK\r\n";
+          ret += "Content-Type: text/event-stream\r\n";
+          ret += "Cache-Control: no-cache\r\n";
+          ret += "Connection: close\r\n\r\n";
+          if (send(msgsock, ret.c_str(), (int)ret.size(), 0) == (int)ret.size()) {
+            httpd->eventstream_hub->attach(msgsock, route.mount->substr(5), http_headers["LAST_EVENT_ID"].c_str());
+            msgsock = -1;
+            if (stats)
+              stats->request_done(200, 0);
+            if (log_ring)
+              log_request(httpd->access_logger, log_ring, address, vauth, req, http_headers, 200, 0, started, started_usec);
+          }
+          goto request_end;
+        }
+#endif
+
+        if (!route.mount && res_isdir(path) && vparam[1].size() && vparam[1][vparam[1].size()-1] != '/') {
           res_type = "text/plain";
           res_code = "301";
           res_msg = "Document Moved";
@@ -1280,32 +2678,38 @@ request_top:
         }
 
         server::DefaultPages::iterator it_page;
-        std::string try_path = path;
-        if (try_path[try_path.size()-1] != '/')
-          try_path += "/";
-        for(it_page = httpd->default_pages.begin(); it_page != httpd->default_pages.end(); it_page++) {
-          std::string check_path = try_path + *it_page;
-          if (res_isfile(check_path)) {
-            path = check_path;
-            break;
+        if (!route.mount && !httpd->default_pages.empty()) {
+          // each page is tried in `path' itself, put back when none is there.
+          size_t len = path.size();
+          if (path[len-1] != '/')
+            path += "/";
+          size_t dir = path.size();
+          for(it_page = httpd->default_pages.begin(); it_page != httpd->default_pages.end(); it_page++) {
+            path.resize(dir);
+            path += *it_page;
+            if (res_isfile(path))
+              break;
           }
+          if (it_page == httpd->default_pages.end())
+            path.resize(len);
         }
 
         server::MimeTypes::iterator it_mime;
         std::string type;
-        if (!res_isfile(path) && !httpd->default_cgi.empty()) {
+        if (!route.mount && !res_isfile(path) && !httpd->default_cgi.empty()) {
           path = httpd->default_cgi;
           if (VERBOSE(2)) printf("* running default_cgi: %s\n", path.c_str());
         }
 
+        if (route.mount) {
+          type = *route.mount;
+        } else
         if (httpd->spawn_executable && res_isexe(path, path_info, script_name)) {
           type = "@";
         } else {
           if (!res_iscgi(path, path_info, script_name, httpd->mime_types, type)) {
             for(it_mime = httpd->mime_types.begin(); it_mime != httpd->mime_types.end(); it_mime++) {
-              std::string match = ".";
-              match += it_mime->first;
-              if (!strcmp(path.c_str()+path.size()-match.size(), match.c_str())) {
+              if (res_hasext(path, it_mime->first)) {
                 type = it_mime->second;
                 res_type = type;
               }
@@ -1314,7 +2718,7 @@ request_top:
           }
         }
 
-        if (res_isdir(path)) {
+        if (!route.mount && res_isdir(path)) {
           if (VERBOSE(2)) printf("  listing %s\n", path.c_str());
           res_type = "text/html";
           res_code = "200";
@@ -1329,18 +2733,22 @@ request_top:
           res_body += script_name;
           res_body += "</h1><hr /><pre>";
           res_body += "<table border=0>";
-          std::vector<server::ListInfo> flist = res_flist(path);
-          std::vector<server::ListInfo>::iterator it;
+          server::FileList flist = res_flist(path);
+          server::FileList::iterator it;
 
           // TODO: sort and reverse, sort key
           //std::map<std::string, std::string> params = tthttpd::parse_querystring(query_string);
 
           for(it = flist.begin(); it != flist.end(); it++) {
-            std::string name = it->name;
+            const ArenaString& name = it->name;
             res_body += "<tr><td><a href=\"";
-            res_body += tthttpd::url_encode(name);
+            size_t at = res_body.size();
+            res_body.resize(at + name.size() * 3);
+            res_body.resize(at + tthttpd::url_encode(name.data(), name.size(), &res_body[at]));
             res_body += "\">";
-            res_body += tthttpd::html_encode(name);
+            at = res_body.size();
+            res_body.resize(at + tthttpd::html_encode_size(name.data(), name.size()));
+            tthttpd::html_encode(name.data(), name.size(), &res_body[at]);
             res_body += "</a></td>";
             res_body += "<td>";
             struct tm tm = it->date;
@@ -1370,8 +2778,8 @@ request_top:
           goto request_done;
         }
 
-        res_info = res_fopen(path);
-        if (!res_info) {
+        res_info = route.mount ? NULL : res_fopen(path);
+        if (!res_info && !route.mount) {
           res_type = "text/plain";
           res_code = "404";
           res_msg = "Not Found";
@@ -1382,7 +2790,9 @@ request_top:
         res_code = "200";
         res_msg = "OK";
         if (type[0] != '@') {
-          std::string file_time = res_ftime(path);
+          if (stats)
+            marked = stats->phase(ServerStatus::PHASE_OPEN, marked);
+          ArenaString file_time = res_ftime(path);
           res_info->size = res_fsize(res_info);
           sprintf(buf, "%d", (int)res_info->size);
           if (http_headers["IF_MODIFIED_SINCE"] == file_time) {
@@ -1403,13 +2813,16 @@ request_top:
           res_head += buf;
           res_head += "\r\n";
           res_head += "Last-Modified: ";
-          res_head += file_time;
+          res_head += file_time.c_str();
           res_head += "\r\n";
           res_head += "Date: ";
-          res_head += res_curtime();
+          res_head += res_curtime().c_str();
           res_head += "\r\n";
-          if (http_headers.count("CONNECTION"))
-            res_head += "Connection: " + http_headers["CONNECTION"] + "\r\n";
+          if (!http_headers["CONNECTION"].empty()) {
+            res_head += "Connection: ";
+            res_head += http_headers["CONNECTION"].c_str();
+            res_head += "\r\n";
+          }
         } else {
           res_close(res_info);
           res_info = NULL;
@@ -1459,14 +2872,19 @@ request_top:
           if (httpd->hostname.size()) {
             env += httpd->hostname;
           } else {
-            env += http_headers["HTTP_HOST"];
+            env += http_headers["HTTP_HOST"].c_str();
           }
           envs.push_back(env);
 
-          sprintf(buf, "SERVER_PORT=%s", httpd->port.c_str());
+          sprintf(buf, "SERVER_PORT=%s", tls ? httpd->ssl_port.c_str() : httpd->port.c_str());
           env = buf;
           envs.push_back(env);
 
+          if (tls) {
+            env = "HTTPS=on";
+            envs.push_back(env);
+          }
+
           env = "REMOTE_ADDR=";
           env += address;
           envs.push_back(env);
@@ -1484,9 +2902,9 @@ request_top:
           server::HttpHeader::const_iterator it_head;
           for (it_head = http_headers.begin(); it_head != http_headers.end(); it_head++) {
             env = "HTTP_";
-            env += it_head->first;
+            env.append(it_head->first.data(), it_head->first.size());
             env += "=";
-            env += it_head->second;
+            env.append(it_head->second.data(), it_head->second.size());
             envs.push_back(env);
           }
 
@@ -1510,7 +2928,7 @@ request_top:
           env += query_string;
           envs.push_back(env);
 
-          if (!path_info.empty()) {
+          if (!path_info.empty() || route.mount) {
             env = "PATH_INFO=";
             env += path_info;
             envs.push_back(env);
@@ -1559,13 +2977,16 @@ request_top:
 
           if (vparam[0] == "POST") {
             env = "CONTENT_TYPE=";
-            env += http_headers["CONTENT_TYPE"];
+            env += http_headers["CONTENT_TYPE"].c_str();
             envs.push_back(env);
 
-            sprintf(buf, "%d", (int)content_length);
-            env = "CONTENT_LENGTH=";
-            env += buf;
-            envs.push_back(env);
+            // a chunked body is of no known length; the CGI reads to EOF.
+            if (!req_body.chunked) {
+              sprintf(buf, "%llu", req_body.left);
+              env = "CONTENT_LENGTH=";
+              env += buf;
+              envs.push_back(env);
+            }
           }
 
           if (VERBOSE(4)) {
@@ -1579,24 +3000,109 @@ request_top:
             printf("  ------------\n");
           }
 
-          res_info = res_popen(args, envs);
-
-          if (res_info && content_length > 0) {
-            while (content_length) {
-              memset(buf, 0, sizeof(buf));
-              unsigned long read = recv(msgsock, buf, sizeof(buf), 0);
-              if (read <= 0) break;
-              int w = res_write(res_info, buf, read);
-              content_length -= w;
+#ifndef _WIN32
+          bool upstream = true;
+          if (req_body.chunked && (!strncmp(type.c_str(), "@scgi:", 6) || !strncmp(type.c_str(), "@uwsgi:", 7))) {
+            // both want the length before the body.
+            res_type = "text/plain";
+            res_code = "411";
+            res_msg = "Length Required";
+            res_body = "Length Required\n";
+            goto request_done;
+          }
+          if (!strncmp(type.c_str(), "@fcgi:", 6)) {
+            server::FastCGIApps::iterator it_app = httpd->fastcgi_apps.find(type.substr(6));
+            if (it_app != httpd->fastcgi_apps.end())
+              res_info = res_fcgi_open(it_app->second, envs);
+          } else
+          if (!strncmp(type.c_str(), "@scgi:", 6)) {
+            res_info = res_upstream_open(UPSTREAM_SCGI, type.substr(6), envs);
+          } else
+          if (!strncmp(type.c_str(), "@uwsgi:", 7)) {
+            res_info = res_upstream_open(UPSTREAM_UWSGI, type.substr(7), envs);
+          } else
+            upstream = false;
+          if (upstream && !res_info) {
+            res_type = "text/plain";
+            res_code = "502";
+            res_msg = "Bad Gateway";
+            res_body = "Bad Gateway\n";
+            goto request_done;
+          }
+          if (!upstream)
+#endif
+          {
+            res_info = res_popen(args, envs);
+            if (res_info && stats)
+              stats->cgi_spawned();
+          }
+          if (!res_info) {
+            res_type = "text/plain";
+            res_code = "500";
+            res_msg = "Internal Server Error";
+            res_body = "Internal Server Error\n";
+            goto request_done;
+          }
+          if (stats)
+            marked = stats->phase(ServerStatus::PHASE_OPEN, marked);
+
+          if (res_info && !req_body.done) {
+            // the CGI may start answering before it has read everything.
+            // that output is kept in cgi_buf meanwhile so neither side
+            // waits on the other. past CGI_BUFFER_MAX the body is cut.
+            bool output = true;
+            bool gone = false;
+            bool broken = !req_continue(&req_body, msgsock);
+#ifdef HAVE_SPLICE
+            while (!req_body.chunked && !req_body.done && !broken && !gone && res_info->process) {
+              long w = res_splice_in(res_info, msgsock, req_body.left < INT_MAX ? (unsigned long) req_body.left : INT_MAX);
+              if (w > 0) {
+                req_body.left -= w;
+                req_body.done = !req_body.left;
+                continue;
+              }
+              if (w < 0) {
+                gone = true;
+                break;
+              }
+              if (!res_wait_input(res_info, cgi_buf, cgi_len, output))
+                gone = true;
+            }
+#endif
+            while (!req_body.done && !broken && !gone) {
+              long read = req_read(&req_body, msgsock, buf, sizeof(buf));
+              if (read <= 0) {
+                broken = read < 0;
+                break;
+              }
+              long sent = 0;
+              while (sent < read) {
+                long w = res_write(res_info, buf + sent, read - sent);
+                if (w < 0) break;
+                sent += w;
+                if (sent == read) break;
+                if (!res_wait_input(res_info, cgi_buf, cgi_len, output)) break;
+              }
+              gone = sent < read;
             }
 
             if (stricmp(http_headers["CONNECTION"].c_str(), "upgrade"))
               res_closewriter(res_info);
-            if (content_length) {
+            // the rest of a body the CGI did not take is dropped later.
+            if (broken) {
+              res_close(res_info);
+              res_info = NULL;
               res_type = "text/plain";
-              res_code = "500";
-              res_msg = "Bad Request";
-              res_body = "Bad Request\n";
+              if (req_body.too_large) {
+                res_code = "413";
+                res_msg = "Request Entity Too Large";
+                res_body = "Request Entity Too Large\n";
+              } else {
+                res_code = "400";
+                res_msg = "Bad Request";
+                res_body = "Bad Request\n";
+              }
+              keep_alive = false;
               goto request_done;
             }
           } else {
@@ -1624,42 +3130,59 @@ request_top:
   }
 request_done:
 
-  if (content_length > 0) {
-    while(content_length > 0) {
-      int ret = recv(msgsock, buf, sizeof(buf), 0);
-      if (ret < 0) {
-        res_type = "text/plain";
-        res_code = "500";
-        res_msg = "Bad Request";
-        res_body = "Bad Request\n";
-      }
-      content_length -= ret;
+  // a body nobody read, as for a 401, is dropped here if it is small. a
+  // client still waiting on a 100 Continue never sends it at all.
+  if (!req_body.done) {
+    if (keep_alive && !req_body.expect && (req_body.chunked || req_body.left <= REQ_DRAIN_MAX)) {
+      unsigned long long drained = 0;
+      long r;
+      while (drained <= REQ_DRAIN_MAX && (r = req_read(&req_body, msgsock, buf, sizeof(buf))) > 0)
+        drained += r;
+    }
+    if (!req_body.done) {
+      keep_alive = false;
+      linger = true;
     }
   }
 
-  if (res_info && res_info->process) {
-    bool res_keep_alive = false;
+  if (res_info && res_info->cgi) {
+    bool res_keep_alive = keep_alive;
+    bool has_status = false;
+    bool framed = false;
+    std::string location;
+    size_t line = 0;
+    bool done = false;
     res_head.clear();
 
-    do {
-      memset(buf, 0, sizeof(buf));
-      str = res_fgets(res_info);
-      if (str.empty()) break;
-      const char *key, *ptr = str.c_str();
-      size_t len;
-      if (str[0] == '<') {
+    // the CGI output is read into cgi_buf and the headers are parsed in
+    // place as lines complete. whatever follows the blank line is the
+    // start of the body and is sent from the same buffer. some of the
+    // output may be there already, read while the request body was sent.
+    while (!done) {
+      if (line == 0 && cgi_len > 0 && cgi_buf[0] == '<') {
         // workaround for broken non-header response.
-        send(msgsock, ptr, strlen(ptr), 0);
-        res_code.clear();
+        res_head = "Content-Type: text/html\r\n";
         break;
       }
-      if (VERBOSE(2)) printf("  %s\n", ptr);
-      if (res_head.empty()) {
-        if (!strnicmp(ptr, "HTTP/1.", 7)) {
+
+      while (!done) {
+        char* ptr = &cgi_buf[line];
+        char* eol = (char*) memchr(ptr, '\n', cgi_len - line);
+        if (!eol) break;
+        line = eol - &cgi_buf[0] + 1;
+        if (eol > ptr && eol[-1] == '\r') eol--;
+        if (eol == ptr) {
+          done = true;
+          break;
+        }
+        *eol = 0;
+        if (VERBOSE(2)) printf("  %s\n", ptr);
+
+        if (!has_status && res_head.empty() && !strnicmp(ptr, "HTTP/1.", 7)) {
           char* tmp1;
           char* tmp2;
 
-          tmp1 = (char*) strchr(ptr, ' ');
+          tmp1 = strchr(ptr, ' ');
           if (tmp1) {
             *tmp1 = 0;
             res_proto = ptr;
@@ -1671,46 +3194,145 @@ request_done:
             } else {
               res_code = tmp1 + 1;
             }
+            has_status = true;
           }
           continue;
         }
+
+        char* val = strchr(ptr, ':');
+        if (val) {
+          size_t key_len = val - ptr;
+          val++;
+          while (*val == ' ' || *val == '\t') val++;
+          // one compare per line: the length picks the candidate key.
+          switch (key_len) {
+          case 6:
+            if (strnicmp(ptr, "Status", 6)) break;
+            {
+              char* msg = strchr(val, ' ');
+              if (msg) {
+                res_code.assign(val, msg - val);
+                res_msg = trim_string(msg + 1);
+              } else
+                res_code = val;
+              has_status = true;
+            }
+            continue;
+          case 8:
+            if (strnicmp(ptr, "Location", 8)) break;
+            location = val;
+            break;
+          case 10:
+            if (strnicmp(ptr, "Connection", 10)) break;
+            if (!stricmp(val, "close"))
+              res_keep_alive = false;
+            continue;
+          case 14:
+            if (strnicmp(ptr, "Content-Length", 14)) break;
+            res_info->size = strtoul(val, NULL, 10);
+            break;
+          case 16:
+            if (strnicmp(ptr, "WWW-Authenticate", 16)) break;
+            if (!has_status && !strnicmp(val, "Basic ", 6)) {
+              res_code = "401";
+              res_msg = "Unauthorized";
+            }
+            break;
+          case 17:
+            // the body comes framed already; pass it on as it is.
+            if (!strnicmp(ptr, "Transfer-Encoding", 17))
+              framed = true;
+            break;
+          }
+        }
+        res_head.append(ptr, eol - ptr);
+        res_head += "\r\n";
       }
-      key = "connection:";
-      len = strlen(key);
-      if (!strnicmp(ptr, key, len)) {
-        if (!stricmp(trim_string(ptr + len).c_str(), "keep-alive"))
-          res_keep_alive = true;
-      }
-      key = "WWW-Authenticate: Basic ";
-      len = strlen(key);
-      if (!strnicmp(ptr, key, len)) {
-        res_code = "401";
-        res_msg = "Unauthorized";
-      }
-      key = "Status:";
-      len = strlen(key);
-      if (!strnicmp(ptr, key, len)) {
-        std::vector<std::string> codes;
-        split_string(trim_string(str.substr(len)), " ", codes);
-        if (codes.size())
-          res_code = codes[0];
-        else
-          res_code = "";
+
+      if (done)
+        break;
+      if (cgi_len > CGI_HEADER_MAX) {
+        res_close(res_info);
+        res_info = NULL;
+        res_type = "text/plain";
+        res_code = "502";
+        res_msg = "Bad Gateway";
+        res_head.clear();
+        res_body = "Bad Gateway\n";
+        goto request_done;
       }
-      key = "Content-Length:";
-      len = strlen(key);
-      if (!strnicmp(ptr, key, len)) {
-        res_info->size = (unsigned long)atol(str.substr(len).c_str());
+
+      if (cgi_buf.size() < cgi_len + BUFSIZ)
+        cgi_buf.resize(cgi_len + BUFSIZ);
+      long long r = res_fill(res_info, &cgi_buf[cgi_len], cgi_buf.size() - cgi_len);
+      if (r <= 0) {
+        // output ended before a blank line. take the last line as is.
+        if (line < cgi_len) {
+          cgi_buf[cgi_len] = '\n';
+          cgi_len++;
+        } else
+          done = true;
+      } else
+        cgi_len += (size_t) r;
+    }
+    cgi_body = line;
+
+    if (!location.empty() && !has_status) {
+      if (location[0] == '/') {
+        // local redirect: serve the new location as a GET in place of the
+        // CGI output.
+        res_close(res_info);
+        res_info = NULL;
+        cgi_len = cgi_body = 0;
+        res_code.clear();
+        res_msg.clear();
+        res_type.clear();
+        res_head.clear();
+        res_body.clear();
+        if (++redirects > CGI_REDIRECT_MAX) {
+          res_type = "text/plain";
+          res_code = "500";
+          res_msg = "Internal Server Error";
+          res_body = "Internal Server Error\n";
+          goto request_done;
+        }
+        if (VERBOSE(1)) printf("* redirect to %s\n", location.c_str());
+        if (stats)
+          marked = ServerStatus::now();
+        req = "GET " + location + " " + res_proto;
+        http_headers.erase("CONTENT_LENGTH");
+        http_headers.erase("CONTENT_TYPE");
+        if (!req_body.done) {
+          // what the CGI left of the body is not for the new location.
+          req_body.done = true;
+          keep_alive = false;
+          linger = true;
+        }
+        goto request_local;
       }
-      res_head += ptr;
-      res_head += "\r\n";
-    } while (true);
-    if (!res_keep_alive) {
+      res_code = "302";
+      res_msg = "Found";
+    }
+
+    // without a length, HTTP/1.1 clients get the body chunked. for
+    // anyone else it ends when the connection does.
+    if (res_info->size == (unsigned long) -1) {
+      if (!framed && vparam.size() > 2 && vparam[2] == "HTTP/1.1") {
+        chunked = true;
+        res_head += "Transfer-Encoding: chunked\r\n";
+      } else
+        res_keep_alive = false;
+    }
+    if (res_keep_alive) {
+      res_head += "Connection: keep-alive\r\n";
+    } else {
       keep_alive = false;
       res_head += "Connection: close\r\n";
     }
   }
 
+  if (stats)
+    marked = ServerStatus::now();
   if (!res_code.empty()) {
     send(msgsock, res_proto.c_str(), (int)res_proto.size(), 0);
     send(msgsock, " ", 1, 0);
@@ -1728,7 +3350,32 @@ request_done:
     send(msgsock, "\r\n", 2, 0);
     unsigned long total = res_info->size;
     int sent = 0;
-    if (total != (unsigned long) -1) {
+    if (head_only) {
+      total = 0;
+      chunked = false;
+    }
+    if (cgi_body < cgi_len && total != 0) {
+      // what came in behind the headers, but no more than was declared.
+      size_t size = cgi_len - cgi_body;
+      if (total != (unsigned long) -1 && size > total)
+        size = total;
+      bool ok;
+      if (chunked)
+        ok = send_chunk(msgsock, &cgi_buf[cgi_body], size) >= 0;
+      else
+        ok = send_all(msgsock, &cgi_buf[cgi_body], size);
+      if (ok) {
+        sent_bytes += size;
+        if (total != (unsigned long) -1)
+          total -= size;
+      } else {
+        // the client is gone: skip the rest of the body.
+        total = 0;
+        chunked = false;
+        keep_alive = false;
+      }
+    }
+    if (total != (unsigned long) -1 && total != 0 && !res_info->cgi) {
 #if defined LINUX_SENDFILE_API
       sent = sendfile(msgsock, res_info->read, NULL, total);
 #elif defined FREEBSD_SENDFILE_API
@@ -1743,51 +3390,86 @@ request_done:
         NULL,
         TF_WRITE_BEHIND)) sent = total;
 #endif
+      if (sent > 0)
+        sent_bytes += sent;
+      if (stats)
+        stats->file_sent(sent > 0);
     }
     if (sent <= 0) {
       if (VERBOSE(1)) printf("* transfer file using default function\n");
-      unsigned int fd = (unsigned int) msgsock;
-      fd_set fdset;
-      FD_ZERO(&fdset);
-      struct timeval tv;
-      tv.tv_sec = 0;
-      tv.tv_usec = 0;
-      while(total != 0) {
+      // data from the client goes to the CGI (when its stdin is still
+      // open) one buffer at a time: the socket is not read again until
+      // the CGI has taken it all, and the CGI output is not read again
+      // until the client has taken it.
+      char input[BUFSIZ];
+      long input_len = 0, input_off = 0;
+      bool exited = false;
+      while (total != 0) {
+        int want = RES_EV_OUTPUT;
+        int sock = -1;
         if (res_info->write) {
-          FD_SET(fd, &fdset);
-          int r = select(FD_SETSIZE, &fdset, NULL, NULL, &tv);
-          if (r < 0) break;
-          if (r > 0 && FD_ISSET(msgsock, &fdset)) {
-            memset(buf, 0, sizeof(buf));
-            int read = recv(msgsock, buf, sizeof(buf), 0);
-            if (read > 0) {
-              res_write(res_info, buf, read);
-            }
+          if (input_off < input_len)
+            want |= RES_EV_INPUT;
+          else
+            sock = msgsock;
+        }
+        // once the CGI has exited, take what is left and stop.
+        int ev = res_poll(res_info, want, sock, exited ? 0 : -1);
+        if (ev < 0 || (ev == 0 && exited)) break;
+        if (ev & RES_EV_EXIT)
+          exited = true;
+        if (ev & RES_EV_CLIENT) {
+          input_len = recv(msgsock, input, sizeof(input), 0);
+          input_off = 0;
+          if (input_len <= 0) {
+            input_len = 0;
+            res_closewriter(res_info);
           }
         }
-        memset(buf, 0, sizeof(buf));
-        long long res = res_read(res_info, buf, sizeof(buf));
-        if (res < 0) break;
-        if (res > 0) {
-          if (VERBOSE(3))
-#ifdef _WIN32
-            printf("  reading part %I64d bytes\n", res);
-#else
-            printf("  reading part %lld bytes\n", res);
-#endif
-          send(msgsock, buf, res, 0);
-          if (total > 0) {
-            total -= res;
+        if (ev & RES_EV_INPUT) {
+          long w = res_write(res_info, input + input_off, input_len - input_off);
+          if (w < 0) {
+            input_len = input_off = 0;
+            res_closewriter(res_info);
+          } else
+            input_off += w;
+        }
+        if (ev & RES_EV_OUTPUT) {
+#ifdef HAVE_SPLICE
+          if (res_info->process) {
+            long long res = res_splice_out(res_info, msgsock, total, chunked);
+            if (res < 0) break;
+            sent_bytes += res;
+            if (total != (unsigned long) -1)
+              total -= res;
+            continue;
           }
-        } else {
+#endif
+          long long res = res_read(res_info, buf, sizeof(buf));
+          if (res < 0) break;
+          if (res > 0) {
+            if (VERBOSE(3))
 #ifdef _WIN32
-          Sleep(1);
+              printf("  reading part %I64d bytes\n", res);
 #else
-          usleep(10);
+              printf("  reading part %lld bytes\n", res);
 #endif
+            long w;
+            if (chunked)
+              w = send_chunk(msgsock, buf, res);
+            else
+              w = send(msgsock, buf, res, 0);
+            if (w < 0) break;
+            sent_bytes += res;
+            if (total > 0) {
+              total -= res;
+            }
+          }
         }
       }
     }
+    if (chunked)
+      send(msgsock, "0\r\n\r\n", 5, 0);
     res_close(res_info);
     res_info = NULL;
   } else
@@ -1799,11 +3481,11 @@ request_done:
     send(msgsock, ret.c_str(), (int)ret.size(), 0);
 
     ret = "Content-Type: ";
-    ret += res_type + "\r\n";
+    ret += res_type;
+    ret += "\r\n";
     send(msgsock, ret.c_str(), (int)ret.size(), 0);
 
-    ret = res_body;
-    sprintf(length, "%u", ret.size());
+    sprintf(length, "%u", (unsigned int) res_body.size());
     ret = "Content-Length: ";
     ret += length;
     ret += "\r\n";
@@ -1811,20 +3493,47 @@ request_done:
 
     send(msgsock, "\r\n", 2, 0);
 
-    if (vparam.size() > 0 && vparam[0] != "HEAD") {
-      ret = res_body;
-      send(msgsock, ret.c_str(), (int)ret.size(), 0);
+    if (!head_only) {
+      send(msgsock, res_body.c_str(), (int)res_body.size(), 0);
+      sent_bytes += res_body.size();
     }
   }
   else
     send(msgsock, "\r\n", (int)2, 0);
+  if (stats)
+    stats->phase(ServerStatus::PHASE_TRANSFER, marked);
 
+request_next:
+#ifdef TTHTTPD_DEBUG
+  if (VERBOSE(1))
+    printf("  %llu allocations, %lu bytes from the arena\n", Arena::allocations() - allocations, (unsigned long) arena.size());
+#endif
+  if (stats)
+    stats->request_done(atoi(res_code.c_str()), sent_bytes);
+#ifndef _WIN32
+  if (log_ring)
+    log_request(httpd->access_logger, log_ring, address, vauth, req, http_headers, atoi(res_code.c_str()), sent_bytes, started, started_usec);
+#endif
   if (keep_alive)
     goto request_top;
 
 request_end:
-  shutdown(msgsock, SD_BOTH);
-  closesocket(msgsock);
+  // a WebSocket client handed to the hub is not ours to close.
+  if (msgsock >= 0) {
+    if (linger)
+      req_linger(msgsock);
+    shutdown(msgsock, SD_BOTH);
+    closesocket(msgsock);
+  }
+  if (stats) {
+    if (!pHttpdInfo->stream)
+      stats->connection_closed();
+    httpd->status->detach(stats);
+  }
+#ifndef _WIN32
+  if (log_ring)
+    httpd->access_logger->detach(log_ring);
+#endif
   delete pHttpdInfo;
 #if defined(_WIN32) && !defined(USE_PTHREAD)
   _endthread();
@@ -1835,22 +3544,9 @@ request_end:
   return NULL;
 }
 
-void* watch_thread(void* param)
-{
-  server *httpd = (server*)param;
-  int msgsock;
-
-  int numeric_host = 0;
-
-  // privsep?
-  if (!httpd->chroot.empty()) {
-    numeric_host = NI_NUMERICHOST;
-  }
-
-#ifdef SIGPIPE
-  signal(SIGPIPE, SIG_IGN);
-#endif
-
+// bind and listen on every address `service' resolves to, the ssl_port
+// ones marked in hosttls.
+static bool listen_port(server* httpd, const std::string& service, bool tls, int numeric_host) {
   struct sockaddr *sa;
   struct addrinfo hints;
   struct addrinfo *res, *res0;
@@ -1861,7 +3557,6 @@ void* watch_thread(void* param)
 #else
   int on;
 #endif
-  struct timeval timeout;
 
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = httpd->family;
@@ -1876,10 +3571,10 @@ void* watch_thread(void* param)
   if (hostname == NULL && hints.ai_family == AF_UNSPEC)
     hints.ai_family = AF_INET;
 
-  error = getaddrinfo(hostname, httpd->port.c_str(), &hints, &res);
+  error = getaddrinfo(hostname, service.c_str(), &hints, &res);
   if (error) {
     my_perror(gai_strerror(error));
-    return NULL;
+    return false;
   }
 
   res0 = res;
@@ -1904,6 +3599,9 @@ void* watch_thread(void* param)
       fprintf(stderr, "socket: %.100s\n", strerror(errno));
       continue;
     }
+#ifdef FD_CLOEXEC
+    fcntl(listen_sock, F_SETFD, FD_CLOEXEC);
+#endif
 
     on = 1;
     if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR,
@@ -1928,6 +3626,7 @@ void* watch_thread(void* param)
     }
 
     httpd->socks.push_back(listen_sock);
+    httpd->hosttls.push_back(tls);
 
     if (!(numeric_host == 0)) {
       char address[NI_MAXHOST], port[NI_MAXSERV];
@@ -1938,12 +3637,15 @@ void* watch_thread(void* param)
       }
     }
     if (VERBOSE(1)) {
-      printf("server started. host: %s port: %s\n", ntop, strport);
+      printf("server started. host: %s port: %s%s\n", ntop, strport, tls ? " (https)" : "");
     }
 
     httpd->hostaddr.push_back(ntop);
     // XXX: overwrite
-    httpd->port = strport;
+    if (tls)
+      httpd->ssl_port = strport;
+    else
+      httpd->port = strport;
 #ifdef _WIN32
     if (!lpfnTransmitFile) {
       GUID  guidTransmitFile = WSAID_TRANSMITFILE;
@@ -1957,6 +3659,48 @@ void* watch_thread(void* param)
   }
 
   freeaddrinfo(res0);
+  return true;
+}
+
+void* watch_thread(void* param)
+{
+  server *httpd = (server*)param;
+  int msgsock;
+
+  int numeric_host = 0;
+
+  // privsep?
+  if (!httpd->chroot.empty()) {
+    numeric_host = NI_NUMERICHOST;
+  }
+
+#ifdef SIGPIPE
+  signal(SIGPIPE, SIG_IGN);
+#endif
+#ifndef _WIN32
+  // let the main thread take SIGCHLD and SIGUSR1, so select() here and
+  // the response threads we start are not interrupted whenever a CGI
+  // exits or the access log is reopened.
+  sigset_t newmask;
+  sigemptyset(&newmask);
+  sigaddset(&newmask, SIGCHLD);
+  sigaddset(&newmask, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &newmask, NULL);
+#endif
+
+#ifdef _WIN32
+  char on;
+#else
+  int on;
+#endif
+  struct timeval timeout;
+
+  if (!listen_port(httpd, httpd->port, false, numeric_host))
+    return NULL;
+#ifdef HAVE_OPENSSL
+  if (httpd->tls && !listen_port(httpd, httpd->ssl_port, true, numeric_host))
+    return NULL;
+#endif
 
   int nserver = (int)httpd->socks.size();
   unsigned int maxfd = 0;
@@ -1991,11 +3735,18 @@ void* watch_thread(void* param)
     for(fds = 0; fds < nserver; fds++) {
       int sock = httpd->socks[fds];
 
-      if (!FD_ISSET(sock, &fdset[fds]))
+      if (!FD_ISSET(sock, fdset))
         continue;
 
       memset(&client, 0, sizeof(client));
+#ifdef HAVE_ACCEPT4
+      msgsock = accept4(sock, (struct sockaddr *)&client, (socklen_t *)&client_len, SOCK_CLOEXEC);
+#else
       msgsock = accept(sock, (struct sockaddr *)&client, (socklen_t *)&client_len);
+#ifdef FD_CLOEXEC
+      if (msgsock != -1) fcntl(msgsock, F_SETFD, FD_CLOEXEC);
+#endif
+#endif
       if (VERBOSE(3)) printf("* accepted socket %d\n", msgsock);
       if (msgsock == -1) {
         if (errno != EINTR && errno != EWOULDBLOCK)
@@ -2003,6 +3754,12 @@ void* watch_thread(void* param)
         closesocket(msgsock);
         break;
       } else {
+        if (!httpd->accept_ips.empty() &&
+            !httpd->accept_ips.accept((struct sockaddr*)&client)) {
+          if (VERBOSE(2)) printf("* rejected socket %d\n", msgsock);
+          closesocket(msgsock);
+          continue;
+        }
         if (httpd->family == AF_INET) {
           strcpy(address, inet_ntoa(((struct sockaddr_in *)(void*)&client)->sin_addr));
         } else {
@@ -2017,6 +3774,8 @@ void* watch_thread(void* param)
         pHttpdInfo->address = address;
         pHttpdInfo->port = port;
         pHttpdInfo->servno = fds;
+        pHttpdInfo->tls = httpd->hosttls[fds];
+        pHttpdInfo->stream = false;
 
         on = 1;
         if (setsockopt(msgsock, IPPROTO_TCP, TCP_NODELAY,
@@ -2045,7 +3804,7 @@ void* watch_thread(void* param)
     }
   }
 
-  delete[] fdset;
+  free(fdset);
 
 #if defined(_WIN32) && !defined(USE_PTHREAD)
   _endthread();
@@ -2057,11 +3816,90 @@ void* watch_thread(void* param)
 }
 
 bool server::start() {
+  if (thread)
+    return false;
+#ifdef HAVE_OPENSSL
+  // the key is read before chroot and dropping privileges.
+  if (ssl_port.size() && !tls) {
+    tls = new TlsContext;
+    if (!tls->load(ssl_certificate, ssl_certificate_key, ssl_session_timeout, http2)) {
+      fprintf(stderr, "could not load certificate %s\n", ssl_certificate.c_str());
+      delete tls;
+      tls = NULL;
+    }
+  }
+#else
+  if (ssl_port.size())
+    fprintf(stderr, "ssl_port is set but tthttpd was built without OpenSSL\n");
+#endif
+  // the metrics port is bound before chroot, while its name still resolves.
+  if ((status_page.size() || metrics_port.size()) && !status) {
+    status = new ServerStatus;
+    status->start(hostname.empty() ? NULL : hostname.c_str(), metrics_port, family);
+  }
 #ifndef _WIN32
+  // the access log too; on SIGUSR1 it is opened again, as `user'.
+  if (access_log.size() && !access_logger) {
+    access_logger = new AccessLog(access_log, access_log_format);
+    if (!access_logger->start()) {
+      delete access_logger;
+      access_logger = NULL;
+    }
+  }
   set_priv(user.c_str(), chroot.c_str(), "tthttpd");
 #endif
-  if (thread)
-    return false;
+  router.compile(request_aliases, request_proxies, basic_auths, accept_auths);
+#ifndef _WIN32
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = res_reap_children;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, NULL);
+  if (access_logger) {
+    sa.sa_handler = reopen_access_log;
+    sigaction(SIGUSR1, &sa, NULL);
+  }
+
+  std::vector<std::string> specs;
+  for (MimeTypes::iterator it = mime_types.begin(); it != mime_types.end(); it++)
+    specs.push_back(it->second);
+  for (RequestAliases::iterator it = request_aliases.begin(); it != request_aliases.end(); it++)
+    specs.push_back(it->second);
+  for (std::vector<std::string>::iterator it = specs.begin(); it != specs.end(); it++) {
+    if (strncmp(it->c_str(), "@fcgi:", 6)) continue;
+    std::string spec = it->substr(6);
+    if (fastcgi_apps.count(spec)) continue;
+    FastCGI* app = new FastCGI(spec, fastcgi_procs);
+    if (!app->start()) {
+      delete app;
+      continue;
+    }
+    fastcgi_apps[spec] = app;
+  }
+
+  for (RequestProxies::iterator it = request_proxies.begin(); it != request_proxies.end(); it++) {
+    if (proxies.count(it->second)) continue;
+    proxies[it->second] = new HttpProxy(it->second, proxy_balance, proxy_max_fails, proxy_fail_timeout);
+  }
+
+  for (RequestAliases::iterator it = request_aliases.begin(); it != request_aliases.end(); it++) {
+    if (!websocket_hub && !strncmp(it->second.c_str(), "@ws:", 4)) {
+      websocket_hub = new WebSocketHub;
+      if (!websocket_hub->start()) {
+        delete websocket_hub;
+        websocket_hub = NULL;
+      }
+    }
+    if (!eventstream_hub && !strncmp(it->second.c_str(), "@sse:", 5)) {
+      eventstream_hub = new EventStreamHub;
+      if (!eventstream_hub->start()) {
+        delete eventstream_hub;
+        eventstream_hub = NULL;
+      }
+    }
+  }
+#endif
 #if defined(_WIN32) && !defined(USE_PTHREAD)
   thread = (HANDLE)_beginthread((void (*)(void*))watch_thread, 0, (void*)this);
 #else
@@ -2085,6 +3923,26 @@ bool server::stop() {
   pthread_kill(thread, SIGINT);
 #endif
   wait();
+#ifndef _WIN32
+  for (FastCGIApps::iterator it = fastcgi_apps.begin(); it != fastcgi_apps.end(); it++)
+    delete it->second;
+  fastcgi_apps.clear();
+  for (HttpProxies::iterator it = proxies.begin(); it != proxies.end(); it++)
+    delete it->second;
+  proxies.clear();
+  delete websocket_hub;
+  websocket_hub = NULL;
+  delete eventstream_hub;
+  eventstream_hub = NULL;
+  delete access_logger;
+  access_logger = NULL;
+#endif
+  delete status;
+  status = NULL;
+#ifdef HAVE_OPENSSL
+  delete tls;
+  tls = NULL;
+#endif
   return true;
 }
 
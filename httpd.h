@@ -55,23 +55,35 @@
 #endif
 
 #include "utils.h"
+#include "arena.h"
 
 namespace tthttpd {
 
+class FastCGI;
+class HttpProxy;
+class WebSocketHub;
+class EventStreamHub;
+class TlsContext;
+class ServerStatus;
+class AccessLog;
+
 class server {
 public:
   typedef struct {
-    std::string name;
+    ArenaString name;
     unsigned long size;
     bool isdir;
     struct tm date;
   } ListInfo;
+  typedef std::vector<ListInfo, ArenaAllocator<ListInfo> > FileList;
   typedef struct {
     int msgsock;
     server *httpd;
     std::string address;
     std::string port;
     int servno;
+    bool tls;
+    bool stream;  // an HTTP/2 stream, handed over by its connection
   } HttpdInfo;
   typedef struct {
     std::string user;
@@ -88,14 +100,112 @@ public:
     std::vector<std::string> accept_list;
   } AcceptAuth;
   typedef std::map<std::string, AcceptAuth> AcceptAuths;
-  typedef std::vector<std::string> AcceptIPs;
+
+  // allow/deny rules keyed by CIDR prefix. addresses are stored bit by bit
+  // in a binary trie, one for IPv4 and one for IPv6, and the longest
+  // matching prefix decides. when no rule matches, the peer is accepted
+  // unless at least one allow rule exists.
+  class AcceptIPs {
+  public:
+    AcceptIPs() : allows(0), rules(0) {
+      clear();
+    }
+    bool add(const std::string& cidr, bool allow);
+    bool accept(const struct sockaddr* sa) const;
+    bool empty() const {
+      // a /0 rule sits on a root and adds no nodes, so they are counted.
+      return rules == 0;
+    }
+    void clear() {
+      Node root = {{0, 0}, RULE_NONE};
+      nodes4.assign(1, root);
+      nodes6.assign(1, root);
+      allows = 0;
+      rules = 0;
+    }
+  private:
+    enum { RULE_NONE, RULE_ALLOW, RULE_DENY };
+    typedef struct {
+      int child[2];
+      int rule;
+    } Node;
+    std::vector<Node> nodes4;
+    std::vector<Node> nodes6;
+    int allows;
+    int rules;
+    static void insert(std::vector<Node>& nodes, const unsigned char* addr, int bits, int rule);
+    static int lookup(const std::vector<Node>& nodes, const unsigned char* addr, int bits);
+  };
 
   typedef void (*LoggerFunc)(const HttpdInfo* httpd_info, const std::string& request);
-  typedef std::map<std::string, std::string> HttpHeader;
+  // the headers of one request, kept in the arena of its connection.
+  typedef std::map<ArenaString, ArenaString, std::less<ArenaString>, ArenaAllocator<std::pair<const ArenaString, ArenaString> > > HttpHeader;
   typedef std::map<std::string, std::string> MimeTypes;
   typedef std::vector<std::string> DefaultPages;
   typedef std::map<std::string, std::string> RequestAliases;
   typedef std::map<std::string, std::string> RequestEnvironments;
+  typedef std::map<std::string, FastCGI*> FastCGIApps;
+  typedef std::map<std::string, std::string> RequestProxies;
+  typedef std::map<std::string, HttpProxy*> HttpProxies;
+
+  // request_aliases, basic_auths and accept_auths compiled into one trie of
+  // path segments, so that a single walk of the request path finds every
+  // rule that applies. a rule ending in the middle of a segment is kept on
+  // the parent node, which keeps the old character-wise prefix matching.
+  // an alias to an upstream ("@scgi:...") mounts it on everything below
+  // the path; `mount_len' is the length of the matched prefix. "@ws:" mounts
+  // take WebSocket clients and relay their messages, "@sse:" mounts serve
+  // a file tailed as an event stream. [proxy]
+  // prefixes mount the same way, with `proxy' naming the backends.
+  class Router {
+  public:
+    typedef struct {
+      const std::string* alias;
+      const std::string* mount;
+      size_t mount_len;
+      const std::string* proxy;
+      const BasicAuthInfo* auth;
+      std::vector<const AcceptAuth*> accepts;
+    } Route;
+    Router() {
+      clear();
+    }
+    void clear();
+    void compile(const RequestAliases& aliases, const RequestProxies& proxies, const BasicAuths& auths, const AcceptAuths& accepts);
+    void match(const std::string& path, const std::string& method, Route& route) const;
+  private:
+    enum { RULE_ALIAS, RULE_MOUNT, RULE_PROXY, RULE_AUTH, RULE_ACCEPT };
+    enum {
+      METHOD_GET = 1,
+      METHOD_HEAD = 2,
+      METHOD_POST = 4,
+      METHOD_PUT = 8,
+      METHOD_DELETE = 16,
+      METHOD_OPTIONS = 32,
+      METHOD_PATCH = 64,
+      METHOD_TRACE = 128,
+      METHOD_CONNECT = 256,
+      METHOD_OTHER = 512,  // by name, from `others'
+      METHOD_ANY = 1023
+    };
+    typedef struct {
+      std::string rest;
+      int type;
+      int order;
+      unsigned int methods;
+      std::vector<std::string> others;
+      const void* data;
+    } Rule;
+    typedef std::vector<std::pair<std::string, int> > Children;
+    typedef struct {
+      Children children;
+      std::vector<Rule> rules;
+    } Node;
+    std::vector<Node> nodes;
+    void add(const std::string& path, const Rule& rule);
+    int child(int node, const char* seg, size_t len) const;
+    static unsigned int method_mask(const std::string& method);
+  };
 
 private:
 #ifdef _WIN32
@@ -109,11 +219,25 @@ public:
   int family;
   std::string hostname;
   std::vector<std::string> hostaddr;
+  std::vector<bool> hosttls;
   std::string root;
   std::string fs_charset;
   std::string chroot;
   std::string user;
   std::string port;
+  std::string ssl_port;
+  std::string ssl_certificate;
+  std::string ssl_certificate_key;
+  int ssl_session_timeout;
+  TlsContext* tls;
+  bool http2;
+  unsigned long long max_body_size;  // 0 for no limit
+  std::string status_page;
+  std::string metrics_port;
+  ServerStatus* status;
+  std::string access_log;
+  int access_log_format;
+  AccessLog* access_logger;
   std::string default_cgi;
   BasicAuths basic_auths;
   AcceptAuths accept_auths;
@@ -122,6 +246,16 @@ public:
   DefaultPages default_pages;
   RequestAliases request_aliases;
   RequestEnvironments request_environments;
+  RequestProxies request_proxies;
+  Router router;
+  FastCGIApps fastcgi_apps;
+  int fastcgi_procs;
+  HttpProxies proxies;
+  int proxy_balance;
+  int proxy_max_fails;
+  int proxy_fail_timeout;
+  WebSocketHub* websocket_hub;
+  EventStreamHub* eventstream_hub;
   LoggerFunc loggerfunc;
   bool spawn_executable;
   int verbose_mode;
@@ -145,6 +279,19 @@ public:
     default_pages.push_back("index.rb");
     default_pages.push_back("index.cgi");
     spawn_executable = false;
+    fastcgi_procs = 4;
+    proxy_balance = 0;  // HttpProxy::ROUND_ROBIN
+    proxy_max_fails = 1;
+    proxy_fail_timeout = 10;
+    websocket_hub = NULL;
+    eventstream_hub = NULL;
+    ssl_session_timeout = 3600;
+    tls = NULL;
+    http2 = true;
+    max_body_size = 0;
+    status = NULL;
+    access_log_format = 1;  // AccessLog::FORMAT_COMBINED
+    access_logger = NULL;
     verbose_mode = 0;
   };
 
@@ -174,44 +321,56 @@ public:
   void bindRoot(std::string _root) {
     root = get_realpath(_root + "/");
   }
-  static std::string get_realpath(std::string abspath) {
-    std::string path = abspath;
+  static std::string get_realpath(const std::string& abspath) {
+    std::string path;
+    get_realpath(abspath, path);
+    return path;
+  }
+  // `path' is written over in place, so a caller keeping it between
+  // requests does not allocate for it again.
+  static void get_realpath(const std::string& abspath, std::string& path) {
 #ifdef _WIN32
     char fullpath[_MAX_PATH] = {0};
     char* filepart = NULL;
-    if (GetFullPathNameA(path.c_str(), _MAX_PATH, fullpath, &filepart))
+    if (GetFullPathNameA(abspath.c_str(), _MAX_PATH, fullpath, &filepart))
       path = fullpath;
+    else
+      path = abspath;
 #else
     char fullpath[PATH_MAX] = {0};
-    if (realpath((char*)path.c_str(), fullpath)) {
+    if (realpath(abspath.c_str(), fullpath))
       path = fullpath;
-    }
+    else
+      path = abspath;
 #endif
     std::replace(path.begin(), path.end(), '\\', '/');
     size_t end_pos = path.find_last_of('?');
     if (end_pos != std::string::npos) path.resize(end_pos);
 
-    std::vector<std::string> path_sep;
-    split_string(path, "/", path_sep);
-    std::vector<std::string>::iterator it;
-    while(true) {
-      it = std::find(path_sep.begin(), path_sep.end(), "..");
-      if (it == path_sep.end()) break;
-      if (it == path_sep.begin()) {
-        continue;
+    // one pass over the segments, writing the kept ones back over the
+    // front of the string: ".." takes itself and the segment before it
+    // away. a last empty segment, from a trailing slash, is dropped.
+    size_t len = path.size(), pos = 0, out = 0, depth = 0;
+    char* buf = len ? &path[0] : NULL;
+    while (pos < len) {
+      const char* slash = (const char*) memchr(buf + pos, '/', len - pos);
+      size_t end = slash ? slash - buf : len;
+      if (end - pos == 2 && buf[pos] == '.' && buf[pos+1] == '.') {
+        if (depth) {
+          depth--;
+          while (out > 0 && buf[out-1] != '/') out--;
+          if (out > 0) out--;
+        }
+      } else {
+        if (depth++) buf[out++] = '/';
+        memmove(buf + out, buf + pos, end - pos);
+        out += end - pos;
       }
-      path_sep.erase(it-1);
-      path_sep.erase(it-1);
-    }
-    std::string path_real;
-    for(it = path_sep.begin(); it != path_sep.end(); it++) {
-      path_real += *it;
-      if (it+1 != path_sep.end())
-        path_real += "/";
+      pos = end + 1;
     }
-    if (abspath[abspath.size()-1] == '/')
-      path_real += "/";
-    return path_real;
+    path.resize(out);
+    if (!abspath.empty() && abspath[abspath.size()-1] == '/')
+      path += "/";
   }
 };
 
@@ -0,0 +1,302 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+// tthttpd-logcat: reads access logs written with access_log_format=binary
+// and prints them as text, or sums them up.
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "accesslog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+typedef struct {
+  std::string text;
+  int path;     // index into the path totals, -1 until known
+} String;
+
+typedef struct {
+  std::string path;
+  unsigned long long count;
+  unsigned long long bytes;
+  unsigned long long usec;
+} PathTotal;
+
+static std::vector<String> strings;
+static std::vector<PathTotal> paths;
+static std::map<std::string, int> path_index;
+static std::vector<unsigned int> latencies;
+static unsigned long long classes[6];
+
+static unsigned long long get_le(const unsigned char* p, int bytes) {
+  unsigned long long v = 0;
+  for (int n = bytes - 1; n >= 0; n--)
+    v = (v << 8) | p[n];
+  return v;
+}
+
+static const std::string& lookup(unsigned int id) {
+  static const std::string none;
+  return id < strings.size() ? strings[id].text : none;
+}
+
+// the path of a request line, without its query string.
+static int path_of(unsigned int id) {
+  if (id >= strings.size())
+    return -1;
+  String& s = strings[id];
+  if (s.path < 0) {
+    std::string path = s.text;
+    size_t pos = path.find(' ');
+    if (pos != std::string::npos) path.erase(0, pos + 1);
+    pos = path.find_first_of(" ?");
+    if (pos != std::string::npos) path.resize(pos);
+    std::map<std::string, int>::iterator it = path_index.find(path);
+    if (it == path_index.end()) {
+      PathTotal total = { path, 0, 0, 0 };
+      paths.push_back(total);
+      it = path_index.insert(std::make_pair(path, (int) paths.size() - 1)).first;
+    }
+    s.path = it->second;
+  }
+  return s.path;
+}
+
+static void print_field(const std::string& s, bool quoted) {
+  if (s.empty()) {
+    putchar('-');
+    return;
+  }
+  for (size_t n = 0; n < s.size(); n++) {
+    unsigned char c = (unsigned char) s[n];
+    if (c < 0x20 || c >= 0x7f || c == '\\' || (quoted && c == '"')) {
+      if (c == '"' || c == '\\')
+        printf("\\%c", c);
+      else
+        printf("\\x%02x", c);
+    } else
+      putchar(c);
+  }
+}
+
+static void print_record(const unsigned char* p, bool combined) {
+  char address[INET6_ADDRSTRLEN];
+  int family = p[1];
+  if (family == 4)
+    inet_ntop(AF_INET, p + 24, address, sizeof(address));
+  else if (family == 6)
+    inet_ntop(AF_INET6, p + 24, address, sizeof(address));
+  else
+    snprintf(address, sizeof(address), "%s", lookup((unsigned int) get_le(p + 24, 4)).c_str());
+  time_t t = (time_t) get_le(p + 8, 8);
+  static time_t last = 0;
+  static char date[64];
+  if (t != last) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(date, sizeof(date), "[%d/%b/%Y:%H:%M:%S %z]", &tm);
+    last = t;
+  }
+  print_field(address, false);
+  printf(" - ");
+  print_field(lookup((unsigned int) get_le(p + 44, 4)), false);
+  printf(" %s \"", date);
+  print_field(lookup((unsigned int) get_le(p + 40, 4)), true);
+  unsigned long long bytes = get_le(p + 16, 8);
+  if (bytes)
+    printf("\" %d %llu", (int) get_le(p + 2, 2), bytes);
+  else
+    printf("\" %d -", (int) get_le(p + 2, 2));
+  if (combined) {
+    printf(" \"");
+    print_field(lookup((unsigned int) get_le(p + 48, 4)), true);
+    printf("\" \"");
+    print_field(lookup((unsigned int) get_le(p + 52, 4)), true);
+    putchar('"');
+  }
+  printf(" %llu\n", get_le(p + 4, 4));
+}
+
+static void count_record(const unsigned char* p, bool by_path) {
+  unsigned int usec = (unsigned int) get_le(p + 4, 4);
+  int status = (int) get_le(p + 2, 2);
+  latencies.push_back(usec);
+  classes[status >= 100 && status < 600 ? status / 100 : 0]++;
+  if (by_path) {
+    int path = path_of((unsigned int) get_le(p + 40, 4));
+    if (path >= 0) {
+      paths[path].count++;
+      paths[path].bytes += get_le(p + 16, 8);
+      paths[path].usec += usec;
+    }
+  }
+}
+
+static bool read_log(const char* filename, int mode, bool combined) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < 8) {
+    fprintf(stderr, "%s: not a binary access log\n", filename);
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t) st.st_size;
+  void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    return false;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise(map, size, MADV_SEQUENTIAL);
+#endif
+  const unsigned char* data = (const unsigned char*) map;
+  if (memcmp(data, ACCESSLOG_MAGIC, 8)) {
+    fprintf(stderr, "%s: not a binary access log\n", filename);
+    munmap(map, size);
+    return false;
+  }
+  // ids start over in every file.
+  strings.assign(1, String());
+  strings[0].path = -1;
+  size_t pos = 8;
+  // a record cut short by a crash ends the log.
+  while (pos + 8 <= size) {
+    const unsigned char* p = data + pos;
+    if (p[0] == 'S') {
+      size_t len = (size_t) get_le(p + 2, 2);
+      unsigned int id = (unsigned int) get_le(p + 4, 4);
+      size_t total = 8 + ((len + 7) & ~7);
+      if (pos + total > size)
+        break;
+      if (id >= strings.size())
+        strings.resize(id + 1);
+      strings[id].text.assign((const char*) p + 8, len);
+      strings[id].path = -1;
+      pos += total;
+    } else if (p[0] == 'A') {
+      if (pos + ACCESSLOG_ACCESS_SIZE > size)
+        break;
+      if (mode == 0)
+        print_record(p, combined);
+      else
+        count_record(p, mode == 't');
+      pos += ACCESSLOG_ACCESS_SIZE;
+    } else {
+      fprintf(stderr, "%s: broken record at %lu\n", filename, (unsigned long) pos);
+      break;
+    }
+  }
+  munmap(map, size);
+  return true;
+}
+
+static bool by_count(const PathTotal& a, const PathTotal& b) {
+  return a.count > b.count;
+}
+
+static unsigned int percentile(double share) {
+  size_t n = (size_t) (latencies.size() * share);
+  if (n >= latencies.size()) n = latencies.size() - 1;
+  std::nth_element(latencies.begin(), latencies.begin() + n, latencies.end());
+  return latencies[n];
+}
+
+int main(int argc, char* argv[]) {
+  int c;
+  int mode = 0;
+  int top = 0;
+  bool combined = true;
+  while ((c = getopt(argc, argv, "f:t:lh")) != -1) {
+    switch (c) {
+    case 'f':
+      if (!strcmp(optarg, "common")) combined = false;
+      else if (!strcmp(optarg, "combined")) combined = true;
+      else argc = 0;
+      break;
+    case 't': mode = 't'; top = atoi(optarg); break;
+    case 'l': mode = 'l'; break;
+    default: argc = 0; break;
+    }
+    if (argc == 0) break;
+  }
+  if (argc == 0 || optind >= argc) {
+    const char* lines[] = {
+      "  usage: tthttpd-logcat [-f common|combined] [-t count] [-l] [-h] log-file...",
+      "  -f : print the records in this format (combined by default)",
+      "  -t : show the paths asked for most, with bytes and mean latency",
+      "  -l : show latency percentiles and responses by class",
+      "  -h : show this usage",
+      NULL
+    };
+    for (const char** ptr = lines; *ptr; ptr++)
+      fprintf(stderr, "%s\n", *ptr);
+    return -1;
+  }
+
+  int ret = 0;
+  for (int n = optind; n < argc; n++) {
+    if (!read_log(argv[n], mode, combined))
+      ret = 1;
+  }
+
+  if (mode == 't') {
+    size_t shown = top > 0 && (size_t) top < paths.size() ? (size_t) top : paths.size();
+    std::partial_sort(paths.begin(), paths.begin() + shown, paths.end(), by_count);
+    printf("%10s %14s %10s  %s\n", "requests", "bytes", "mean us", "path");
+    for (size_t n = 0; n < shown; n++) {
+      const PathTotal& total = paths[n];
+      printf("%10llu %14llu %10llu  %s\n", total.count, total.bytes, total.usec / total.count, total.path.c_str());
+    }
+  } else if (mode == 'l') {
+    printf("requests: %lu\n", (unsigned long) latencies.size());
+    printf("responses: %llu 1xx, %llu 2xx, %llu 3xx, %llu 4xx, %llu 5xx\n",
+      classes[1], classes[2], classes[3], classes[4], classes[5]);
+    if (!latencies.empty()) {
+      unsigned long long sum = 0;
+      for (size_t n = 0; n < latencies.size(); n++)
+        sum += latencies[n];
+      printf("mean: %lluus\n", sum / latencies.size());
+      printf("p50: %uus\n", percentile(0.5));
+      printf("p90: %uus\n", percentile(0.9));
+      printf("p99: %uus\n", percentile(0.99));
+      printf("p99.9: %uus\n", percentile(0.999));
+      printf("max: %uus\n", *std::max_element(latencies.begin(), latencies.end()));
+    }
+  }
+  return ret;
+}
+
+// vim:set et:
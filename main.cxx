@@ -2,6 +2,8 @@
 #include "config.h"
 #endif
 #include "httpd.h"
+#include "upstream.h"
+#include "accesslog.h"
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
@@ -212,6 +214,30 @@ int main(int argc, char* argv[]) {
     if (val.size()) httpd.hostname = val;
     val = configs["global"]["port"];
     if (val.size()) httpd.port = val;
+    val = configs["global"]["ssl_port"];
+    if (val.size()) httpd.ssl_port = val;
+    val = configs["global"]["ssl_certificate"];
+    if (val.size()) httpd.ssl_certificate = val;
+    val = configs["global"]["ssl_certificate_key"];
+    if (val.size()) httpd.ssl_certificate_key = val;
+    val = configs["global"]["ssl_session_timeout"];
+    if (val.size()) httpd.ssl_session_timeout = atol(val.c_str());
+    val = configs["global"]["http2"];
+    if (val == "off") httpd.http2 = false;
+    val = configs["global"]["max_body_size"];
+    if (val.size()) {
+      char* end = NULL;
+      httpd.max_body_size = strtoull(val.c_str(), &end, 10);
+      switch (tolower(*end)) {
+      case 'g': httpd.max_body_size <<= 10;
+      case 'm': httpd.max_body_size <<= 10;
+      case 'k': httpd.max_body_size <<= 10;
+      }
+    }
+    val = configs["global"]["status_page"];
+    if (val.size()) httpd.status_page = val;
+    val = configs["global"]["metrics_port"];
+    if (val.size()) httpd.metrics_port = val;
     val = configs["global"]["indexpages"];
     if (val.size()) httpd.default_pages = tthttpd::split_string(val, ",");
     val = configs["global"]["charset"];
@@ -227,6 +253,29 @@ int main(int argc, char* argv[]) {
     else if (val.size()) httpd.verbose_mode = atol(val.c_str());
     val = configs["global"]["spawnexec"];
     if (val == "on") httpd.spawn_executable = true;
+    val = configs["global"]["fastcgi_procs"];
+    if (val.size()) httpd.fastcgi_procs = atol(val.c_str());
+#ifndef _WIN32
+    val = configs["global"]["proxy_balance"];
+    if (val == "least_conn") httpd.proxy_balance = tthttpd::HttpProxy::LEAST_CONN;
+    else if (val == "round_robin") httpd.proxy_balance = tthttpd::HttpProxy::ROUND_ROBIN;
+    else if (val.size()) fprintf(stderr, "invalid proxy_balance: %s\n", val.c_str());
+    val = configs["global"]["proxy_max_fails"];
+    if (val.size()) httpd.proxy_max_fails = atol(val.c_str());
+    val = configs["global"]["proxy_fail_timeout"];
+    if (val.size()) httpd.proxy_fail_timeout = atol(val.c_str());
+    val = configs["global"]["access_log"];
+    if (val.size()) httpd.access_log = val;
+    val = configs["global"]["access_log_format"];
+    if (val == "common") httpd.access_log_format = tthttpd::AccessLog::FORMAT_COMMON;
+    else if (val == "combined") httpd.access_log_format = tthttpd::AccessLog::FORMAT_COMBINED;
+    else if (val == "binary") httpd.access_log_format = tthttpd::AccessLog::FORMAT_BINARY;
+    else if (val.size()) fprintf(stderr, "invalid access_log_format: %s\n", val.c_str());
+
+    config = configs["proxy"];
+    for (it = config.begin(); it != config.end(); it++)
+      httpd.request_proxies[it->first] = it->second;
+#endif
 
     config = configs["request/aliases"];
     for (it = config.begin(); it != config.end(); it++)
@@ -240,6 +289,16 @@ int main(int argc, char* argv[]) {
     for (it = config.begin(); it != config.end(); it++)
       httpd.request_environments[it->first] = it->second;
 
+    config = configs["accept/ips"];
+    for (it = config.begin(); it != config.end(); it++) {
+      if (it->second != "allow" && it->second != "deny") {
+        fprintf(stderr, "invalid rule for %s: %s\n", it->first.c_str(), it->second.c_str());
+        continue;
+      }
+      if (!httpd.accept_ips.add(it->first, it->second == "allow"))
+        fprintf(stderr, "invalid address: %s\n", it->first.c_str());
+    }
+
     config = configs["authentication"];
     for (it = config.begin(); it != config.end(); it++) {
       tthttpd::server::BasicAuthInfo basic_auth_info;
@@ -0,0 +1,579 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "status.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace tthttpd {
+
+static const char* phase_names[] = { "header", "resolve", "open", "transfer" };
+static const char* phase_keys[] = { "Header", "Resolve", "Open", "Transfer" };
+
+// the coarse view of a histogram: row n counts what took under 16 << n
+// microseconds, the last row everything longer.
+#define STATUS_ROWS 22
+
+void ServerStatus::Counters::clear() {
+  connections_opened = connections_closed = 0;
+  requests = bytes_out = 0;
+  sendfiles = copies = cgi_spawns = 0;
+  memset(classes, 0, sizeof(classes));
+  memset(phase_sum, 0, sizeof(phase_sum));
+  memset(buckets, 0, sizeof(buckets));
+}
+
+void ServerStatus::Counters::add(const Counters& other) {
+  connections_opened += other.connections_opened;
+  connections_closed += other.connections_closed;
+  requests += other.requests;
+  bytes_out += other.bytes_out;
+  sendfiles += other.sendfiles;
+  copies += other.copies;
+  cgi_spawns += other.cgi_spawns;
+  for (int n = 0; n < 6; n++)
+    classes[n] += other.classes[n];
+  for (int p = 0; p < PHASES; p++) {
+    phase_sum[p] += other.phase_sum[p];
+    for (int n = 0; n < STATUS_BUCKETS; n++)
+      buckets[p][n] += other.buckets[p][n];
+  }
+}
+
+ServerStatus::ServerStatus() {
+  total.clear();
+  started = time(NULL);
+  memset(recent, 0, sizeof(recent));
+  memset(recent_time, 0, sizeof(recent_time));
+  recent_pos = 0;
+  recent_rate = 0;
+  running = false;
+#ifdef _WIN32
+  InitializeCriticalSection(&blocks_mutex);
+  InitializeCriticalSection(&total_mutex);
+#else
+  pthread_mutex_init(&blocks_mutex, NULL);
+  pthread_mutex_init(&total_mutex, NULL);
+  wake[0] = wake[1] = -1;
+#endif
+}
+
+ServerStatus::~ServerStatus() {
+  stop();
+  for (std::vector<Counters*>::iterator it = blocks.begin(); it != blocks.end(); it++)
+    delete *it;
+#ifdef _WIN32
+  DeleteCriticalSection(&blocks_mutex);
+  DeleteCriticalSection(&total_mutex);
+#else
+  pthread_mutex_destroy(&blocks_mutex);
+  pthread_mutex_destroy(&total_mutex);
+#endif
+}
+
+void ServerStatus::lock(Mutex& mutex) {
+#ifdef _WIN32
+  EnterCriticalSection(&mutex);
+#else
+  pthread_mutex_lock(&mutex);
+#endif
+}
+
+void ServerStatus::unlock(Mutex& mutex) {
+#ifdef _WIN32
+  LeaveCriticalSection(&mutex);
+#else
+  pthread_mutex_unlock(&mutex);
+#endif
+}
+
+unsigned long long ServerStatus::now() {
+#ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (unsigned long long) (count.QuadPart / freq.QuadPart) * 1000000 +
+    (unsigned long long) (count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+int ServerStatus::bucket(unsigned long long usec) {
+  const int sub = 1 << STATUS_SUB_BITS;
+  if (usec < (unsigned long long) sub)
+    return (int) usec;
+  int top = 0;
+  for (unsigned long long v = usec; v >>= 1; )
+    top++;
+  int n = (top - STATUS_SUB_BITS + 1) * sub + (int) ((usec >> (top - STATUS_SUB_BITS)) & (sub - 1));
+  return n < STATUS_BUCKETS ? n : STATUS_BUCKETS - 1;
+}
+
+unsigned long long ServerStatus::bucket_floor(int n) {
+  const int sub = 1 << STATUS_SUB_BITS;
+  if (n < sub)
+    return n;
+  return (unsigned long long) (sub + n % sub) << (n / sub - 1);
+}
+
+ServerStatus::Counters* ServerStatus::attach() {
+  Counters* counters = NULL;
+  lock(blocks_mutex);
+  // blocks are handed on, never freed: what they counted stays counted.
+  for (std::vector<Counters*>::iterator it = blocks.begin(); it != blocks.end(); it++) {
+    if (!(*it)->in_use) {
+      counters = *it;
+      break;
+    }
+  }
+  if (!counters) {
+    counters = new Counters;
+    counters->clear();
+    blocks.push_back(counters);
+  }
+  counters->in_use = true;
+  unlock(blocks_mutex);
+  return counters;
+}
+
+void ServerStatus::detach(Counters* counters) {
+  lock(blocks_mutex);
+  counters->in_use = false;
+  unlock(blocks_mutex);
+}
+
+void ServerStatus::aggregate() {
+  // the blocks are read while their threads write them. a count may be
+  // a request behind, which the next summing makes up for.
+  Counters* sum = new Counters;
+  sum->clear();
+  lock(blocks_mutex);
+  for (std::vector<Counters*>::iterator it = blocks.begin(); it != blocks.end(); it++)
+    sum->add(**it);
+  unlock(blocks_mutex);
+
+  time_t t = time(NULL);
+  lock(total_mutex);
+  total.clear();
+  total.add(*sum);
+  recent_pos = (recent_pos + 1) % 60;
+  recent[recent_pos] = total.requests;
+  recent_time[recent_pos] = t;
+  // the rate over the oldest summing still within the last minute.
+  int oldest = recent_pos;
+  for (int n = 1; n < 60; n++) {
+    int i = (recent_pos + 60 - n) % 60;
+    if (!recent_time[i] || recent_time[i] < t - 60)
+      break;
+    oldest = i;
+  }
+  if (recent_time[oldest] < t)
+    recent_rate = (double) (recent[recent_pos] - recent[oldest]) / (t - recent_time[oldest]);
+  unlock(total_mutex);
+  delete sum;
+}
+
+void ServerStatus::snapshot(Counters& counters, double& last_minute) {
+  // without the summing thread, the sum is made when it is asked for.
+  if (!running)
+    aggregate();
+  lock(total_mutex);
+  counters.clear();
+  counters.add(total);
+  last_minute = recent_rate;
+  unlock(total_mutex);
+}
+
+// "16us", "1.0ms", "2.1s" for a bucket bound.
+static std::string format_usec(unsigned long long usec) {
+  char buf[32];
+  if (usec < 1000)
+    sprintf(buf, "%lluus", usec);
+  else if (usec < 1000000)
+    sprintf(buf, "%.1fms", usec / 1000.0);
+  else
+    sprintf(buf, "%.1fs", usec / 1000000.0);
+  return buf;
+}
+
+// the top of the bucket the given share of the count falls in; the true
+// value is somewhere below it.
+static std::string percentile(const unsigned long long* buckets, unsigned long long count, double share) {
+  unsigned long long want = (unsigned long long) (count * share + 0.5), seen = 0;
+  if (want < 1) want = 1;
+  for (int n = 0; n < STATUS_BUCKETS - 1; n++) {
+    seen += buckets[n];
+    if (seen >= want)
+      return "&lt;" + format_usec(ServerStatus::bucket_floor(n + 1));
+  }
+  return "&gt;" + format_usec(ServerStatus::bucket_floor(STATUS_BUCKETS - 1));
+}
+
+// sums the buckets into STATUS_ROWS rows.
+static void coarse(const unsigned long long* buckets, unsigned long long* rows) {
+  memset(rows, 0, sizeof(unsigned long long) * STATUS_ROWS);
+  int row = 0;
+  for (int n = 0; n < STATUS_BUCKETS; n++) {
+    while (row < STATUS_ROWS - 1 && ServerStatus::bucket_floor(n) >= (16ULL << row))
+      row++;
+    rows[row] += buckets[n];
+  }
+}
+
+std::string ServerStatus::report(bool machine) {
+  // a copy is taken, so that formatting holds nobody up.
+  Counters* c = new Counters;
+  double last_minute;
+  snapshot(*c, last_minute);
+  unsigned long uptime = (unsigned long) (time(NULL) - started);
+  unsigned long long active = c->connections_opened - c->connections_closed;
+  unsigned long long rows[PHASES][STATUS_ROWS];
+  for (int p = 0; p < PHASES; p++)
+    coarse(c->buckets[p], rows[p]);
+
+  char buf[256];
+  std::string out;
+  if (machine) {
+    sprintf(buf, "Uptime: %lu\n", uptime);
+    out += buf;
+    sprintf(buf, "ConnectionsActive: %llu\nConnectionsTotal: %llu\n", active, c->connections_opened);
+    out += buf;
+    sprintf(buf, "RequestsTotal: %llu\nReqPerSec: %.3f\nReqPerSecLastMinute: %.3f\n",
+      c->requests, uptime ? (double) c->requests / uptime : 0.0, last_minute);
+    out += buf;
+    sprintf(buf, "BytesOut: %llu\nSendfile: %llu\nCopy: %llu\nCGISpawns: %llu\n",
+      c->bytes_out, c->sendfiles, c->copies, c->cgi_spawns);
+    out += buf;
+    for (int n = 1; n <= 5; n++) {
+      sprintf(buf, "Status%dxx: %llu\n", n, c->classes[n]);
+      out += buf;
+    }
+    for (int p = 0; p < PHASES; p++) {
+      unsigned long long count = 0;
+      for (int n = 0; n < STATUS_ROWS; n++)
+        count += rows[p][n];
+      sprintf(buf, "%sCount: %llu\n%sSumMicros: %llu\n%sHistogram:",
+        phase_keys[p], count, phase_keys[p], c->phase_sum[p], phase_keys[p]);
+      out += buf;
+      for (int n = 0; n < STATUS_ROWS; n++) {
+        if (n < STATUS_ROWS - 1)
+          sprintf(buf, " %llu:%llu", 16ULL << n, rows[p][n]);
+        else
+          sprintf(buf, " +Inf:%llu", rows[p][n]);
+        out += buf;
+      }
+      out += "\n";
+    }
+    delete c;
+    return out;
+  }
+
+  out = "<html><head><title>Server Status</title></head><body><h1>Server Status</h1><hr />";
+  out += "<table border=0>";
+  sprintf(buf, "<tr><td>uptime</td><td align=right>%lus</td></tr>", uptime);
+  out += buf;
+  sprintf(buf, "<tr><td>connections</td><td align=right>%llu active, %llu total</td></tr>", active, c->connections_opened);
+  out += buf;
+  sprintf(buf, "<tr><td>requests</td><td align=right>%llu</td></tr>", c->requests);
+  out += buf;
+  sprintf(buf, "<tr><td>requests/sec</td><td align=right>%.2f (last minute %.2f)</td></tr>",
+    uptime ? (double) c->requests / uptime : 0.0, last_minute);
+  out += buf;
+  sprintf(buf, "<tr><td>bytes out</td><td align=right>%llu</td></tr>", c->bytes_out);
+  out += buf;
+  sprintf(buf, "<tr><td>files sent</td><td align=right>%llu sendfile, %llu copied</td></tr>", c->sendfiles, c->copies);
+  out += buf;
+  sprintf(buf, "<tr><td>CGI spawns</td><td align=right>%llu</td></tr>", c->cgi_spawns);
+  out += buf;
+  sprintf(buf, "<tr><td>responses</td><td align=right>%llu 2xx, %llu 3xx, %llu 4xx, %llu 5xx</td></tr>",
+    c->classes[2], c->classes[3], c->classes[4], c->classes[5]);
+  out += buf;
+  out += "</table><hr />";
+
+  out += "<table border=0><tr><th align=left>phase</th><th>count</th><th>mean</th><th>p50</th><th>p90</th><th>p99</th></tr>";
+  for (int p = 0; p < PHASES; p++) {
+    unsigned long long count = 0;
+    for (int n = 0; n < STATUS_ROWS; n++)
+      count += rows[p][n];
+    sprintf(buf, "<tr><td>%s</td><td align=right>%llu</td><td align=right>", phase_names[p], count);
+    out += buf;
+    if (count) {
+      out += format_usec(c->phase_sum[p] / count) + "</td>";
+      out += "<td align=right>" + percentile(c->buckets[p], count, 0.5) + "</td>";
+      out += "<td align=right>" + percentile(c->buckets[p], count, 0.9) + "</td>";
+      out += "<td align=right>" + percentile(c->buckets[p], count, 0.99) + "</td></tr>";
+    } else
+      out += "-</td><td></td><td></td><td></td></tr>";
+  }
+  out += "</table><hr />";
+
+  // the histograms side by side, from the first row anything fell in to
+  // the last.
+  int first = STATUS_ROWS, last = -1;
+  for (int p = 0; p < PHASES; p++) {
+    for (int n = 0; n < STATUS_ROWS; n++) {
+      if (!rows[p][n]) continue;
+      if (n < first) first = n;
+      if (n > last) last = n;
+    }
+  }
+  out += "<table border=0><tr><th align=left>under</th>";
+  for (int p = 0; p < PHASES; p++) {
+    out += "<th>";
+    out += phase_names[p];
+    out += "</th>";
+  }
+  out += "</tr>";
+  for (int n = first; n <= last; n++) {
+    out += "<tr><td>";
+    out += n < STATUS_ROWS - 1 ? format_usec(16ULL << n) : std::string("longer");
+    out += "</td>";
+    for (int p = 0; p < PHASES; p++) {
+      sprintf(buf, "<td align=right>%llu</td>", rows[p][n]);
+      out += buf;
+    }
+    out += "</tr>";
+  }
+  out += "</table></body></html>";
+  delete c;
+  return out;
+}
+
+std::string ServerStatus::metrics() {
+  Counters* c = new Counters;
+  double last_minute;
+  snapshot(*c, last_minute);
+  char buf[256];
+  std::string out;
+
+  out += "# HELP tthttpd_connections_active Connections open now.\n";
+  out += "# TYPE tthttpd_connections_active gauge\n";
+  sprintf(buf, "tthttpd_connections_active %llu\n", c->connections_opened - c->connections_closed);
+  out += buf;
+  out += "# HELP tthttpd_connections_total Connections accepted.\n";
+  out += "# TYPE tthttpd_connections_total counter\n";
+  sprintf(buf, "tthttpd_connections_total %llu\n", c->connections_opened);
+  out += buf;
+  out += "# HELP tthttpd_requests_total Requests answered.\n";
+  out += "# TYPE tthttpd_requests_total counter\n";
+  sprintf(buf, "tthttpd_requests_total %llu\n", c->requests);
+  out += buf;
+  out += "# HELP tthttpd_responses_total Responses by class of status.\n";
+  out += "# TYPE tthttpd_responses_total counter\n";
+  for (int n = 1; n <= 5; n++) {
+    sprintf(buf, "tthttpd_responses_total{class=\"%dxx\"} %llu\n", n, c->classes[n]);
+    out += buf;
+  }
+  out += "# HELP tthttpd_sent_bytes_total Response body bytes sent.\n";
+  out += "# TYPE tthttpd_sent_bytes_total counter\n";
+  sprintf(buf, "tthttpd_sent_bytes_total %llu\n", c->bytes_out);
+  out += buf;
+  out += "# HELP tthttpd_files_sent_total Files sent, by sendfile or by copying.\n";
+  out += "# TYPE tthttpd_files_sent_total counter\n";
+  sprintf(buf, "tthttpd_files_sent_total{method=\"sendfile\"} %llu\n", c->sendfiles);
+  out += buf;
+  sprintf(buf, "tthttpd_files_sent_total{method=\"copy\"} %llu\n", c->copies);
+  out += buf;
+  out += "# HELP tthttpd_cgi_spawns_total CGI processes started.\n";
+  out += "# TYPE tthttpd_cgi_spawns_total counter\n";
+  sprintf(buf, "tthttpd_cgi_spawns_total %llu\n", c->cgi_spawns);
+  out += buf;
+
+  out += "# HELP tthttpd_request_phase_seconds Time spent in each phase of a request.\n";
+  out += "# TYPE tthttpd_request_phase_seconds histogram\n";
+  for (int p = 0; p < PHASES; p++) {
+    unsigned long long rows[STATUS_ROWS], count = 0;
+    coarse(c->buckets[p], rows);
+    for (int n = 0; n < STATUS_ROWS; n++) {
+      count += rows[n];
+      if (n < STATUS_ROWS - 1)
+        sprintf(buf, "tthttpd_request_phase_seconds_bucket{phase=\"%s\",le=\"%.6f\"} %llu\n",
+          phase_names[p], (16ULL << n) / 1000000.0, count);
+      else
+        sprintf(buf, "tthttpd_request_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", phase_names[p], count);
+      out += buf;
+    }
+    sprintf(buf, "tthttpd_request_phase_seconds_sum{phase=\"%s\"} %.6f\n", phase_names[p], c->phase_sum[p] / 1000000.0);
+    out += buf;
+    sprintf(buf, "tthttpd_request_phase_seconds_count{phase=\"%s\"} %llu\n", phase_names[p], count);
+    out += buf;
+  }
+  delete c;
+  return out;
+}
+
+#ifndef _WIN32
+bool ServerStatus::start(const char* hostname, const std::string& port, int family) {
+  if (running)
+    return false;
+  if (port.size()) {
+    struct addrinfo hints, *res, *res0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_socktype = SOCK_STREAM;
+    if (hostname == NULL && hints.ai_family == AF_UNSPEC)
+      hints.ai_family = AF_INET;
+    int error = getaddrinfo(hostname, port.c_str(), &hints, &res0);
+    if (error) {
+      fprintf(stderr, "metrics_port %s: %s\n", port.c_str(), gai_strerror(error));
+      return false;
+    }
+    for (res = res0; res; res = res->ai_next) {
+      int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+      if (fd < 0)
+        continue;
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      int on = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "metrics_port %s: %s\n", port.c_str(), strerror(errno));
+        close(fd);
+        continue;
+      }
+      listeners.push_back(fd);
+    }
+    freeaddrinfo(res0);
+  }
+  if (pipe(wake) < 0)
+    return false;
+  fcntl(wake[0], F_SETFD, FD_CLOEXEC);
+  fcntl(wake[1], F_SETFD, FD_CLOEXEC);
+  running = true;
+  if (pthread_create(&thread, NULL, loop_thread, this)) {
+    running = false;
+    stop();
+    return false;
+  }
+  return true;
+}
+
+void ServerStatus::stop() {
+  if (running) {
+    if (write(wake[1], "", 1) < 0) {}
+    pthread_join(thread, NULL);
+    running = false;
+  }
+  for (std::vector<int>::iterator it = listeners.begin(); it != listeners.end(); it++)
+    close(*it);
+  listeners.clear();
+  if (wake[0] >= 0) close(wake[0]);
+  if (wake[1] >= 0) close(wake[1]);
+  wake[0] = wake[1] = -1;
+}
+
+void* ServerStatus::loop_thread(void* param) {
+  ((ServerStatus*) param)->loop();
+  return NULL;
+}
+
+void ServerStatus::loop() {
+  std::vector<struct pollfd> pfds(listeners.size() + 1);
+  pfds[0].fd = wake[0];
+  for (size_t n = 0; n < listeners.size(); n++)
+    pfds[n + 1].fd = listeners[n];
+  unsigned long long next = now();
+  while (true) {
+    unsigned long long t = now();
+    if (t >= next) {
+      aggregate();
+      next = t + 1000000;
+    }
+    for (size_t n = 0; n < pfds.size(); n++) {
+      pfds[n].events = POLLIN;
+      pfds[n].revents = 0;
+    }
+    int r = poll(&pfds[0], pfds.size(), (int) ((next - t + 999) / 1000));
+    if (r < 0 && errno != EINTR)
+      break;
+    if (pfds[0].revents)
+      break;
+    for (size_t n = 1; n < pfds.size(); n++) {
+      if (!(pfds[n].revents & POLLIN))
+        continue;
+      int fd = accept(pfds[n].fd, NULL, NULL);
+      if (fd >= 0)
+        serve(fd);
+    }
+  }
+}
+
+// answers a scrape with the last snapshot, whatever was asked for. the
+// scraper gets a second to send its request.
+void ServerStatus::serve(int fd) {
+  struct timeval tv;
+  tv.tv_sec = 1;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  std::string head;
+  char buf[1024];
+  while (head.find("\r\n\r\n") == std::string::npos && head.find("\n\n") == std::string::npos && head.size() < 8192) {
+    ssize_t r = recv(fd, buf, sizeof(buf), 0);
+    if (r <= 0)
+      break;
+    head.append(buf, r);
+  }
+  std::string body = metrics();
+  sprintf(buf, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", (unsigned) body.size());
+  std::string res = buf;
+  if (strncmp(head.c_str(), "HEAD ", 5))
+    res += body;
+  size_t sent = 0;
+  while (sent < res.size()) {
+    ssize_t w = send(fd, res.c_str() + sent, res.size() - sent, MSG_NOSIGNAL);
+    if (w <= 0)
+      break;
+    sent += w;
+  }
+  shutdown(fd, SHUT_RDWR);
+  close(fd);
+}
+#else
+bool ServerStatus::start(const char* hostname, const std::string& port, int family) {
+  if (port.size())
+    fprintf(stderr, "metrics_port is not supported on this platform\n");
+  return true;
+}
+
+void ServerStatus::stop() {
+}
+#endif
+
+}
+
+// vim:set et:
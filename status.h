@@ -0,0 +1,153 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _STATUS_H_
+#define _STATUS_H_
+
+#include <string>
+#include <vector>
+#include <time.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <pthread.h>
+#endif
+
+namespace tthttpd {
+
+// latency histograms in microseconds, HDR style: every power of two is
+// split into 1 << STATUS_SUB_BITS buckets of equal width, so a value is
+// known to within an eighth, up to about an hour. merging two of them
+// is adding the buckets.
+#define STATUS_SUB_BITS 3
+#define STATUS_BUCKETS (30 << STATUS_SUB_BITS)
+
+// the counters are kept this far from anything another thread writes.
+#define STATUS_LINE 64
+
+// what the server did since it started, shown at the status page and
+// exported to Prometheus. every response thread counts into a block of
+// its own with plain stores, and a background thread sums the blocks
+// into a snapshot once a second, so counting takes no lock and no cache
+// line is written by two threads. requests are timed phase by phase:
+// reading the head, resolving the path and checking credentials, opening
+// the file or spawning the CGI, and sending the response from its first
+// byte to the last.
+class ServerStatus {
+public:
+  enum { PHASE_HEADER, PHASE_RESOLVE, PHASE_OPEN, PHASE_TRANSFER, PHASES };
+  class Counters {
+  public:
+    void connection_opened() { connections_opened++; }
+    void connection_closed() { connections_closed++; }
+    // `status' is the response code, `bytes' the body sent.
+    void request_done(int status, unsigned long long bytes) {
+      requests++;
+      bytes_out += bytes;
+      classes[status >= 100 && status < 600 ? status / 100 : 0]++;
+    }
+    // records the time since `since' for `phase' and returns the time now.
+    unsigned long long phase(int phase, unsigned long long since) {
+      unsigned long long t = now();
+      phase_sum[phase] += t - since;
+      buckets[phase][bucket(t - since)]++;
+      return t;
+    }
+    void file_sent(bool sendfile) {
+      if (sendfile)
+        sendfiles++;
+      else
+        copies++;
+    }
+    void cgi_spawned() { cgi_spawns++; }
+  private:
+    friend class ServerStatus;
+    char pad_head[STATUS_LINE];
+    unsigned long long connections_opened;
+    unsigned long long connections_closed;
+    unsigned long long requests;
+    unsigned long long bytes_out;
+    unsigned long long sendfiles;
+    unsigned long long copies;
+    unsigned long long cgi_spawns;
+    unsigned long long classes[6];  // by first digit of the status
+    unsigned long long phase_sum[PHASES];
+    unsigned long long buckets[PHASES][STATUS_BUCKETS];
+    char pad_tail[STATUS_LINE];
+    bool in_use;
+    void clear();
+    void add(const Counters& other);
+  };
+  ServerStatus();
+  ~ServerStatus();
+  // starts summing, and serves Prometheus metrics on `port' if given.
+  bool start(const char* hostname, const std::string& port, int family);
+  void stop();
+  // a block for the calling thread, until it gives it back.
+  Counters* attach();
+  void detach(Counters* counters);
+  // the status page, as HTML or as "Key: value" lines.
+  std::string report(bool machine);
+  // the same in the Prometheus text format.
+  std::string metrics();
+  // microseconds on a clock that only goes forward.
+  static unsigned long long now();
+  static int bucket(unsigned long long usec);
+  // the lowest value of a bucket; the highest is that of the next one.
+  static unsigned long long bucket_floor(int n);
+private:
+  std::vector<Counters*> blocks;
+  Counters total;
+  time_t started;
+  // requests counted at each of the last summings, for the recent rate.
+  unsigned long long recent[60];
+  time_t recent_time[60];
+  int recent_pos;
+  double recent_rate;
+  std::vector<int> listeners;
+#ifdef _WIN32
+  typedef CRITICAL_SECTION Mutex;
+#else
+  typedef pthread_mutex_t Mutex;
+#endif
+  Mutex blocks_mutex;
+  Mutex total_mutex;
+#ifndef _WIN32
+  pthread_t thread;
+  int wake[2];
+  static void* loop_thread(void* param);
+  void loop();
+  void serve(int fd);
+#endif
+  bool running;
+  void aggregate();
+  void snapshot(Counters& counters, double& last_minute);
+  static void lock(Mutex& mutex);
+  static void unlock(Mutex& mutex);
+};
+
+}
+
+#endif /* _STATUS_H_ */
+
+// vim:set et:
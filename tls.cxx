@@ -0,0 +1,365 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "tls.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_OPENSSL
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+#endif
+
+namespace tthttpd {
+
+#ifdef HAVE_OPENSSL
+
+// seconds a client gets for its handshake.
+#define TLS_HANDSHAKE_TIMEOUT 10
+
+typedef struct {
+  SSL* ssl;
+  int sock;
+  int fd;
+} TLS_RELAY;
+
+static void tls_init() {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS, NULL);
+#else
+  SSL_library_init();
+  SSL_load_error_strings();
+#endif
+}
+
+TlsContext::TlsContext() {
+  ctx = NULL;
+  lifetime = 3600;
+  http2 = false;
+  memset(keys, 0, sizeof(keys));
+  pthread_mutex_init(&mutex, NULL);
+}
+
+TlsContext::~TlsContext() {
+  if (ctx) SSL_CTX_free(ctx);
+  pthread_mutex_destroy(&mutex);
+}
+
+bool TlsContext::load(const std::string& cert, const std::string& key, int _lifetime, bool _http2) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, tls_init);
+
+  ctx = SSL_CTX_new(SSLv23_server_method());
+  if (!ctx)
+    return false;
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert.c_str()) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, (key.empty() ? cert : key).c_str(), SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    return false;
+  }
+  lifetime = _lifetime > 0 ? _lifetime : 3600;
+  http2 = _http2;
+
+  long options = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_NO_RENEGOTIATION
+  options |= SSL_OP_NO_RENEGOTIATION;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+  options |= SSL_OP_ENABLE_KTLS;
+#endif
+  SSL_CTX_set_options(ctx, options);
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, 20480);
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char*) "tthttpd", 7);
+  SSL_CTX_set_timeout(ctx, lifetime);
+
+  if (!new_key(keys[0]))
+    return false;
+  SSL_CTX_set_app_data(ctx, this);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_callback);
+#else
+  SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_callback);
+#endif
+  SSL_CTX_set_alpn_select_cb(ctx, alpn_callback, this);
+  return true;
+}
+
+// "h2" when offered and enabled, else "http/1.1"; a client offering
+// neither goes on without ALPN.
+int TlsContext::alpn_callback(SSL* ssl, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* arg) {
+  TlsContext* self = (TlsContext*) arg;
+  static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+  const unsigned char* offer = self->http2 ? protocols : protocols + 3;
+  unsigned int size = self->http2 ? sizeof(protocols) - 1 : sizeof(protocols) - 4;
+  if (SSL_select_next_proto((unsigned char**) out, outlen, offer, size, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+bool TlsContext::new_key(TicketKey& key) {
+  if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+      RAND_bytes(key.aes, sizeof(key.aes)) != 1 ||
+      RAND_bytes(key.hmac, sizeof(key.hmac)) != 1)
+    return false;
+  key.created = time(NULL);
+  return true;
+}
+
+// called with the mutex held. the current key turns into the previous one
+// after `lifetime' seconds, and is forgotten after as long again.
+const TlsContext::TicketKey* TlsContext::find_key(const unsigned char* name, bool& current) {
+  time_t now = time(NULL);
+  if (now - keys[0].created >= lifetime) {
+    TicketKey key;
+    if (new_key(key)) {
+      keys[1] = keys[0];
+      keys[0] = key;
+    }
+  }
+  current = true;
+  if (!name)
+    return &keys[0];
+  if (!memcmp(name, keys[0].name, sizeof(keys[0].name)))
+    return &keys[0];
+  current = false;
+  if (keys[1].created && now - keys[1].created < lifetime * 2 &&
+      !memcmp(name, keys[1].name, sizeof(keys[1].name)))
+    return &keys[1];
+  return NULL;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int TlsContext::ticket_callback(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, EVP_MAC_CTX* hctx, int enc) {
+#else
+int TlsContext::ticket_callback(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, HMAC_CTX* hctx, int enc) {
+#endif
+  TlsContext* self = (TlsContext*) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  TicketKey key;
+  bool current;
+  pthread_mutex_lock(&self->mutex);
+  const TicketKey* found = self->find_key(enc ? NULL : name, current);
+  if (found)
+    key = *found;
+  pthread_mutex_unlock(&self->mutex);
+  if (!found)
+    return 0;
+
+  if (enc) {
+    memcpy(name, key.name, sizeof(key.name));
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1 ||
+        EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1)
+      return -1;
+  } else if (EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1)
+    return -1;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  OSSL_PARAM params[3];
+  params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac));
+  params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*) "SHA256", 0);
+  params[2] = OSSL_PARAM_construct_end();
+  if (EVP_MAC_CTX_set_params(hctx, params) != 1)
+    return -1;
+#else
+  if (HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL) != 1)
+    return -1;
+#endif
+  // a ticket under the previous key is taken, and replaced by a new one.
+  return enc || current ? 1 : 2;
+}
+
+// moves data between the client, through SSL, and the plain end of the
+// socket pair the connection thread serves. each direction holds at most
+// one buffer, so neither side is read faster than the other takes it.
+static void* tls_relay(void* param) {
+  TLS_RELAY* relay = (TLS_RELAY*) param;
+  SSL* ssl = relay->ssl;
+  int sock = relay->sock;
+  int fd = relay->fd;
+  delete relay;
+
+  char in[16384], out[16384];
+  size_t in_pos = 0, in_len = 0, out_pos = 0, out_len = 0;
+  bool client_eof = false, server_eof = false, shut = false;
+  bool read_wants_write = false, write_wants_read = false;
+  while (true) {
+    if (!client_eof && in_pos == in_len) {
+      int r = SSL_read(ssl, in, sizeof(in));
+      read_wants_write = false;
+      if (r > 0) {
+        in_pos = 0;
+        in_len = r;
+      } else {
+        int e = SSL_get_error(ssl, r);
+        if (e == SSL_ERROR_WANT_WRITE)
+          read_wants_write = true;
+        else if (e != SSL_ERROR_WANT_READ)
+          client_eof = true;
+      }
+    }
+    if (in_pos < in_len) {
+      ssize_t w = send(fd, in + in_pos, in_len - in_pos, 0);
+      if (w > 0)
+        in_pos += w;
+      else if (errno != EAGAIN && errno != EINTR)
+        break;
+    }
+    if (client_eof && in_pos == in_len && !shut) {
+      // the connection thread sees the end of the requests.
+      shutdown(fd, SHUT_WR);
+      shut = true;
+    }
+
+    if (!server_eof && out_pos == out_len) {
+      ssize_t r = recv(fd, out, sizeof(out), 0);
+      if (r > 0) {
+        out_pos = 0;
+        out_len = r;
+      } else if (r == 0 || (errno != EAGAIN && errno != EINTR))
+        server_eof = true;
+    }
+    if (out_pos < out_len) {
+      int w = SSL_write(ssl, out + out_pos, (int)(out_len - out_pos));
+      write_wants_read = false;
+      if (w > 0)
+        out_pos += w;
+      else {
+        int e = SSL_get_error(ssl, w);
+        if (e == SSL_ERROR_WANT_READ)
+          write_wants_read = true;
+        else if (e != SSL_ERROR_WANT_WRITE)
+          break;
+      }
+    }
+    if (server_eof && out_pos == out_len) {
+      SSL_shutdown(ssl);
+      break;
+    }
+    if (!client_eof && in_pos == in_len && SSL_pending(ssl) > 0)
+      continue;
+
+    struct pollfd pfds[2];
+    pfds[0].fd = sock;
+    pfds[0].events = 0;
+    if ((!client_eof && in_pos == in_len && !read_wants_write) || write_wants_read)
+      pfds[0].events |= POLLIN;
+    if (read_wants_write || (out_pos < out_len && !write_wants_read))
+      pfds[0].events |= POLLOUT;
+    pfds[1].fd = fd;
+    pfds[1].events = 0;
+    if (in_pos < in_len)
+      pfds[1].events |= POLLOUT;
+    if (!server_eof && out_pos == out_len)
+      pfds[1].events |= POLLIN;
+    if (poll(pfds, 2, -1) < 0 && errno != EINTR)
+      break;
+  }
+  close(fd);
+  close(sock);
+  SSL_free(ssl);
+  return NULL;
+}
+
+int TlsContext::accept(int sock, bool& h2) {
+  SSL* ssl = SSL_new(ctx);
+  if (!ssl) {
+    close(sock);
+    return -1;
+  }
+  struct timeval tv;
+  tv.tv_sec = TLS_HANDSHAKE_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  SSL_set_fd(ssl, sock);
+  if (SSL_accept(ssl) != 1) {
+    SSL_free(ssl);
+    close(sock);
+    return -1;
+  }
+  tv.tv_sec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  const unsigned char* proto = NULL;
+  unsigned int proto_len = 0;
+  SSL_get0_alpn_selected(ssl, &proto, &proto_len);
+  h2 = proto_len == 2 && !memcmp(proto, "h2", 2);
+
+#if defined(BIO_get_ktls_send) && defined(BIO_get_ktls_recv)
+  if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+    // records are the kernel's business from here on. the SSL is not
+    // shut down, which would send close_notify.
+    SSL_free(ssl);
+    return sock;
+  }
+#endif
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    SSL_free(ssl);
+    close(sock);
+    return -1;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  // the same bound on a stalled client as the socket had.
+  socklen_t len = sizeof(tv);
+  if (getsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, &len) == 0)
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  TLS_RELAY* relay = new TLS_RELAY;
+  relay->ssl = ssl;
+  relay->sock = sock;
+  relay->fd = fds[1];
+  pthread_t pth;
+  if (pthread_create(&pth, NULL, tls_relay, relay) != 0) {
+    delete relay;
+    close(fds[0]);
+    close(fds[1]);
+    SSL_free(ssl);
+    close(sock);
+    return -1;
+  }
+  pthread_detach(pth);
+  return fds[0];
+}
+
+#endif
+
+}
+
+// vim:set et:
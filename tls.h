@@ -0,0 +1,84 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <string>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/hmac.h>
+#include <pthread.h>
+#include <time.h>
+#endif
+
+namespace tthttpd {
+
+#ifdef HAVE_OPENSSL
+
+// HTTPS on the ssl_port listeners. sessions are resumed from a cache
+// shared by all connections or from tickets, whose keys are made at
+// random in memory and replaced every `lifetime' seconds; tickets under
+// the previous key are still taken and renewed.
+class TlsContext {
+public:
+  TlsContext();
+  ~TlsContext();
+  // `http2' offers "h2" in ALPN.
+  bool load(const std::string& cert, const std::string& key, int lifetime, bool http2);
+  // does the handshake on an accepted socket and returns the descriptor
+  // to serve the connection on, or -1 after closing it. when OpenSSL could
+  // hand both directions to the kernel (kTLS) that is the socket itself,
+  // so sendfile() and splice() stay as they are; otherwise it is one end
+  // of a socket pair that a thread relays through SSL_read/SSL_write.
+  // `h2' tells whether the client chose HTTP/2.
+  int accept(int sock, bool& h2);
+private:
+  typedef struct {
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+    time_t created;
+  } TicketKey;
+  SSL_CTX* ctx;
+  TicketKey keys[2];
+  int lifetime;
+  bool http2;
+  pthread_mutex_t mutex;
+  bool new_key(TicketKey& key);
+  const TicketKey* find_key(const unsigned char* name, bool& current);
+  static int alpn_callback(SSL* ssl, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* arg);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  static int ticket_callback(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, EVP_MAC_CTX* hctx, int enc);
+#else
+  static int ticket_callback(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, HMAC_CTX* hctx, int enc);
+#endif
+};
+
+#endif
+
+}
+
+#endif /* _TLS_H_ */
+
+// vim:set et:
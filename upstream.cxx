@@ -0,0 +1,678 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "upstream.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#ifndef _WIN32
+extern char** environ;
+#endif
+
+namespace tthttpd {
+
+#ifndef _WIN32
+
+#define FCGI_VERSION_1         1
+#define FCGI_BEGIN_REQUEST     1
+#define FCGI_END_REQUEST       3
+#define FCGI_PARAMS            4
+#define FCGI_STDIN             5
+#define FCGI_STDOUT            6
+#define FCGI_STDERR            7
+#define FCGI_RESPONDER         1
+#define FCGI_KEEP_CONN         1
+#define FCGI_MAX_CONTENT       65535
+#define FCGI_REQUEST_ID        1
+
+static bool fill_sockaddr_un(const std::string& path, struct sockaddr_un* sun, socklen_t* len) {
+  memset(sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(sun->sun_path))
+    return false;
+  memcpy(sun->sun_path, path.c_str(), path.size());
+  *len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path.size() + 1);
+#ifdef __linux__
+  // "@name" is a socket in the abstract namespace.
+  if (path[0] == '@') {
+    sun->sun_path[0] = 0;
+    *len -= 1;
+  }
+#endif
+  return true;
+}
+
+int upstream_connect(const std::string& address) {
+  if (!strncmp(address.c_str(), "unix:", 5)) {
+    struct sockaddr_un sun;
+    socklen_t len;
+    if (!fill_sockaddr_un(address.substr(5), &sun, &len))
+      return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      return -1;
+    if (connect(fd, (struct sockaddr*)&sun, len) < 0) {
+      close(fd);
+      return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+  }
+
+  size_t end_pos = address.find_last_of(':');
+  if (end_pos == std::string::npos)
+    return -1;
+  std::string host = address.substr(0, end_pos);
+  std::string port = address.substr(end_pos + 1);
+  if (host.size() > 2 && host[0] == '[' && host[host.size()-1] == ']')
+    host = host.substr(1, host.size() - 2);
+
+  struct addrinfo hints, *res, *res0;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res0))
+    return -1;
+  int fd = -1;
+  for (res = res0; res; res = res->ai_next) {
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, res->ai_addr, res->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res0);
+  if (fd >= 0) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+}
+
+static bool send_full(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t w = send(fd, data, size, 0);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    data += w;
+    size -= w;
+  }
+  return true;
+}
+
+static void put_uwsgi_len(std::string& out, size_t len) {
+  out += (char)(len & 0xff);
+  out += (char)((len >> 8) & 0xff);
+}
+
+int upstream_open(int protocol, const std::string& address, const std::vector<std::string>& envs) {
+  std::string vars, content_length = "0";
+  std::vector<std::string>::const_iterator it;
+  for (it = envs.begin(); it != envs.end(); it++) {
+    size_t eq = it->find('=');
+    if (eq == std::string::npos) continue;
+    if (!it->compare(0, eq + 1, "CONTENT_LENGTH=")) {
+      content_length = it->substr(eq + 1);
+      continue;
+    }
+    if (protocol == UPSTREAM_SCGI) {
+      vars.append(*it, 0, eq);
+      vars += '\0';
+      vars.append(*it, eq + 1, std::string::npos);
+      vars += '\0';
+    } else {
+      size_t len = it->size() - eq - 1;
+      if (eq > 0xffff || len > 0xffff) return -1;
+      put_uwsgi_len(vars, eq);
+      vars.append(*it, 0, eq);
+      put_uwsgi_len(vars, len);
+      vars.append(*it, eq + 1, std::string::npos);
+    }
+  }
+
+  std::string head;
+  if (protocol == UPSTREAM_SCGI) {
+    // a netstring, CONTENT_LENGTH first as the spec wants.
+    std::string first = "CONTENT_LENGTH";
+    first += '\0';
+    first += content_length;
+    first += '\0';
+    first += "SCGI";
+    first += '\0';
+    first += "1";
+    first += '\0';
+    char len[32];
+    sprintf(len, "%lu:", (unsigned long)(first.size() + vars.size()));
+    head = len + first + vars + ",";
+  } else {
+    std::string first;
+    put_uwsgi_len(first, 14);
+    first += "CONTENT_LENGTH";
+    put_uwsgi_len(first, content_length.size());
+    first += content_length;
+    size_t size = first.size() + vars.size();
+    if (size > 0xffff) return -1;
+    // modifier1 0 (a WSGI request), datasize, modifier2 0.
+    head += (char)0;
+    put_uwsgi_len(head, size);
+    head += (char)0;
+    head += first + vars;
+  }
+
+  int fd = upstream_connect(address);
+  if (fd < 0)
+    return -1;
+  if (!send_full(fd, head.data(), head.size())) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+FastCGI::FastCGI(const std::string& spec, int _procs) {
+  // anything that is not an executable path is an address to connect to.
+  if (!strncmp(spec.c_str(), "unix:", 5) ||
+      (spec[0] != '/' && spec.find(':') != std::string::npos))
+    address = spec;
+  else
+    command = spec;
+  procs = _procs > 0 ? _procs : 1;
+  listen_fd = -1;
+  opened = 0;
+  checked = 0;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&released, NULL);
+}
+
+FastCGI::~FastCGI() {
+  stop();
+  pthread_cond_destroy(&released);
+  pthread_mutex_destroy(&mutex);
+}
+
+bool FastCGI::start() {
+  if (command.empty())
+    return true;
+
+  static int serial = 0;
+  char name[64];
+#ifdef __linux__
+  sprintf(name, "@tthttpd-fcgi.%d.%d", (int)getpid(), serial++);
+#else
+  sprintf(name, "/tmp/tthttpd-fcgi.%d.%d", (int)getpid(), serial++);
+  sock_path = name;
+  unlink(name);
+#endif
+  struct sockaddr_un sun;
+  socklen_t len;
+  fill_sockaddr_un(name, &sun, &len);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0 ||
+      bind(listen_fd, (struct sockaddr*)&sun, len) < 0 ||
+      listen(listen_fd, SOMAXCONN) < 0) {
+    fprintf(stderr, "fastcgi: can't listen for %s: %s\n", command.c_str(), strerror(errno));
+    if (listen_fd >= 0) close(listen_fd);
+    listen_fd = -1;
+    return false;
+  }
+  fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+  address = "unix:";
+  address += name;
+
+  for (int n = 0; n < procs; n++)
+    pids.push_back(spawn());
+  checked = time(NULL);
+  return true;
+}
+
+void FastCGI::stop() {
+  std::vector<pid_t>::iterator it;
+  for (it = pids.begin(); it != pids.end(); it++) {
+    if (*it <= 0) continue;
+    kill(*it, SIGTERM);
+    waitpid(*it, NULL, 0);
+  }
+  pids.clear();
+  std::vector<int>::iterator it_fd;
+  for (it_fd = idle.begin(); it_fd != idle.end(); it_fd++)
+    close(*it_fd);
+  opened -= (int)idle.size();
+  idle.clear();
+  if (listen_fd >= 0) close(listen_fd);
+  listen_fd = -1;
+  if (!sock_path.empty()) unlink(sock_path.c_str());
+}
+
+pid_t FastCGI::spawn() {
+  std::vector<std::string> args = split_string(command, " ");
+  std::vector<char*> argv;
+  std::vector<std::string>::iterator it;
+  for (it = args.begin(); it != args.end(); it++)
+    if (!it->empty()) argv.push_back((char*)it->c_str());
+  argv.push_back(NULL);
+
+  // FastCGI applications accept connections on their stdin.
+  pid_t child = spawn_process(&argv[0], environ, NULL, listen_fd, -1, -1);
+  if (child < 0)
+    perror(argv[0]);
+  return child;
+}
+
+void FastCGI::check_workers() {
+  std::vector<pid_t>::iterator it;
+  for (it = pids.begin(); it != pids.end(); it++) {
+    // a worker that exited is replaced. the SIGCHLD handler leaves
+    // workers alone, so this is the only wait for them.
+    if (*it > 0 && waitpid(*it, NULL, WNOHANG) == 0)
+      continue;
+    *it = spawn();
+  }
+}
+
+int FastCGI::acquire() {
+  pthread_mutex_lock(&mutex);
+  if (!command.empty() && checked != time(NULL)) {
+    checked = time(NULL);
+    check_workers();
+  }
+  while (true) {
+    while (!idle.empty()) {
+      int fd = idle.back();
+      idle.pop_back();
+      // an idle connection that became readable was closed by the application.
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, 0) == 0) {
+        pthread_mutex_unlock(&mutex);
+        return fd;
+      }
+      close(fd);
+      opened--;
+    }
+    // one more connection to our own workers would only wait in the
+    // backlog of the socket for a worker that never comes free.
+    if (command.empty() || opened < procs)
+      break;
+    pthread_cond_wait(&released, &mutex);
+  }
+  opened++;
+  pthread_mutex_unlock(&mutex);
+
+  int fd = upstream_connect(address);
+  if (fd < 0) {
+    pthread_mutex_lock(&mutex);
+    opened--;
+    pthread_cond_signal(&released);
+    pthread_mutex_unlock(&mutex);
+  }
+  return fd;
+}
+
+void FastCGI::release(int fd, bool reuse) {
+  pthread_mutex_lock(&mutex);
+  if (reuse) {
+    idle.push_back(fd);
+  } else {
+    close(fd);
+    opened--;
+  }
+  pthread_cond_signal(&released);
+  pthread_mutex_unlock(&mutex);
+}
+
+FastCGIRequest::FastCGIRequest(FastCGI* _app) {
+  app = _app;
+  fd = -1;
+  remaining = 0;
+  padding = 0;
+  ended = false;
+  broken = false;
+}
+
+FastCGIRequest::~FastCGIRequest() {
+  if (fd >= 0)
+    app->release(fd, ended && !broken);
+}
+
+bool FastCGIRequest::send_record(int type, const char* data, unsigned long size) {
+  do {
+    unsigned long len = size > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : size;
+    unsigned char head[8] = {
+      FCGI_VERSION_1, (unsigned char)type,
+      0, FCGI_REQUEST_ID,
+      (unsigned char)(len >> 8), (unsigned char)(len & 0xff),
+      0, 0 };
+    struct iovec iov[2];
+    iov[0].iov_base = head;
+    iov[0].iov_len = sizeof(head);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    size_t total = sizeof(head) + len;
+    int n = 0;
+    while (total > 0) {
+      ssize_t w = writev(fd, iov + n, 2 - n);
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) {
+        broken = true;
+        return false;
+      }
+      total -= w;
+      while (n < 2 && (size_t)w >= iov[n].iov_len) {
+        w -= iov[n].iov_len;
+        n++;
+      }
+      if (n < 2) {
+        iov[n].iov_base = (char*)iov[n].iov_base + w;
+        iov[n].iov_len -= w;
+      }
+    }
+    data += len;
+    size -= len;
+  } while (size > 0);
+  return true;
+}
+
+bool FastCGIRequest::recv_full(char* data, unsigned long size) {
+  while (size > 0) {
+    ssize_t r = recv(fd, data, size, 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) {
+      broken = true;
+      return false;
+    }
+    data += r;
+    size -= r;
+  }
+  return true;
+}
+
+void FastCGIRequest::discard(unsigned long size, FILE* out) {
+  char buf[BUFSIZ];
+  while (size > 0) {
+    unsigned long n = size < sizeof(buf) ? size : sizeof(buf);
+    if (!recv_full(buf, n)) break;
+    if (out) fwrite(buf, 1, n, out);
+    size -= n;
+  }
+}
+
+static void fcgi_put_length(std::string& buf, size_t len) {
+  if (len < 128) {
+    buf += (char)len;
+  } else {
+    buf += (char)(((len >> 24) & 0x7f) | 0x80);
+    buf += (char)((len >> 16) & 0xff);
+    buf += (char)((len >> 8) & 0xff);
+    buf += (char)(len & 0xff);
+  }
+}
+
+bool FastCGIRequest::begin(const std::vector<std::string>& envs) {
+  std::string params;
+  std::vector<std::string>::const_iterator it;
+  for (it = envs.begin(); it != envs.end(); it++) {
+    size_t end_pos = it->find('=');
+    if (end_pos == std::string::npos) continue;
+    fcgi_put_length(params, end_pos);
+    fcgi_put_length(params, it->size() - end_pos - 1);
+    params.append(*it, 0, end_pos);
+    params.append(*it, end_pos + 1, std::string::npos);
+  }
+
+  const char body[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0 };
+  // a pooled connection can still go away under us; retry once on a new one.
+  for (int retry = 0; retry < 2; retry++) {
+    fd = app->acquire();
+    if (fd < 0)
+      return false;
+    broken = false;
+    if (send_record(FCGI_BEGIN_REQUEST, body, sizeof(body)) &&
+        send_record(FCGI_PARAMS, params.data(), params.size()) &&
+        send_record(FCGI_PARAMS, NULL, 0))
+      return true;
+    app->release(fd, false);
+    fd = -1;
+  }
+  return false;
+}
+
+long FastCGIRequest::write(const char* data, unsigned long size) {
+  if (!send_record(FCGI_STDIN, data, size))
+    return -1;
+  return (long)size;
+}
+
+bool FastCGIRequest::close_stdin() {
+  return send_record(FCGI_STDIN, NULL, 0);
+}
+
+long long FastCGIRequest::read(char* data, unsigned long size, bool block) {
+  while (!ended && !broken) {
+    if (remaining) {
+      ssize_t r = recv(fd, data, size < remaining ? size : remaining, 0);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) {
+        broken = true;
+        break;
+      }
+      remaining -= r;
+      if (!remaining && padding) {
+        discard(padding, NULL);
+        padding = 0;
+      }
+      return r;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, block ? -1 : 0) == 0)
+      return 0;
+
+    unsigned char head[8];
+    if (!recv_full((char*)head, sizeof(head)))
+      break;
+    unsigned long len = (head[4] << 8) | head[5];
+    unsigned char pad = head[6];
+    switch (head[1]) {
+    case FCGI_STDOUT:
+      remaining = len;
+      padding = pad;
+      if (!len) {
+        discard(pad, NULL);
+        padding = 0;
+      }
+      break;
+    case FCGI_STDERR:
+      discard(len, stderr);
+      discard(pad, NULL);
+      break;
+    case FCGI_END_REQUEST:
+      ended = true;
+      // fall through
+    default:
+      discard(len + pad, NULL);
+      break;
+    }
+  }
+  return -1;
+}
+
+
+HttpProxy::HttpProxy(const std::string& spec, int _balance, int _max_fails, int _fail_timeout) {
+  std::vector<std::string> addresses = split_string(spec, ",");
+  for (std::vector<std::string>::iterator it = addresses.begin(); it != addresses.end(); it++) {
+    std::string address = trim_string(*it);
+    if (!strncmp(address.c_str(), "http://", 7))
+      address = address.substr(7);
+    if (address.empty()) continue;
+    if (address[address.size()-1] == '/')
+      address.resize(address.size() - 1);
+    Backend backend;
+    backend.address = address;
+    backend.active = 0;
+    backend.fails = 0;
+    backend.retry = 0;
+    backends.push_back(backend);
+  }
+  balance = _balance;
+  max_fails = _max_fails > 0 ? _max_fails : 1;
+  fail_timeout = _fail_timeout;
+  next = 0;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+HttpProxy::~HttpProxy() {
+  for (std::vector<Backend>::iterator it = backends.begin(); it != backends.end(); it++)
+    for (std::vector<int>::iterator it_fd = it->idle.begin(); it_fd != it->idle.end(); it_fd++)
+      close(*it_fd);
+  pthread_mutex_destroy(&mutex);
+}
+
+// called with the mutex held. ejected backends are skipped while others
+// remain; when all are out, the one due back first is tried anyway.
+int HttpProxy::pick(time_t now, const std::vector<bool>& tried) {
+  int found = -1, fallback = -1;
+  size_t n = backends.size();
+  for (size_t i = 0; i < n; i++) {
+    size_t cur = (next + i) % n;
+    if (tried[cur]) continue;
+    const Backend& backend = backends[cur];
+    if (backend.retry > now) {
+      if (fallback < 0 || backend.retry < backends[fallback].retry)
+        fallback = (int)cur;
+      continue;
+    }
+    if (found < 0 || (balance == LEAST_CONN && backend.active < backends[found].active))
+      found = (int)cur;
+    if (balance == ROUND_ROBIN)
+      break;
+  }
+  if (found < 0)
+    found = fallback;
+  if (found >= 0)
+    next = found + 1;
+  return found;
+}
+
+int HttpProxy::acquire(int& backend, bool& reused) {
+  std::vector<bool> tried(backends.size(), false);
+  while (true) {
+    pthread_mutex_lock(&mutex);
+    backend = pick(time(NULL), tried);
+    if (backend < 0) {
+      pthread_mutex_unlock(&mutex);
+      return -1;
+    }
+    tried[backend] = true;
+    Backend& b = backends[backend];
+    b.active++;
+    std::string address = b.address;
+    while (!b.idle.empty()) {
+      int fd = b.idle.back();
+      b.idle.pop_back();
+      // an idle connection that became readable was closed by the server.
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, 0) == 0) {
+        pthread_mutex_unlock(&mutex);
+        reused = true;
+        return fd;
+      }
+      close(fd);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    reused = false;
+    int fd = upstream_connect(address);
+    if (fd >= 0)
+      return fd;
+    failed(backend, -1);
+  }
+}
+
+void HttpProxy::release(int backend, int fd, bool reuse) {
+  pthread_mutex_lock(&mutex);
+  Backend& b = backends[backend];
+  b.active--;
+  b.fails = 0;
+  b.retry = 0;
+  if (reuse)
+    b.idle.push_back(fd);
+  pthread_mutex_unlock(&mutex);
+  if (!reuse)
+    close(fd);
+}
+
+void HttpProxy::discard(int backend, int fd) {
+  close(fd);
+  pthread_mutex_lock(&mutex);
+  backends[backend].active--;
+  pthread_mutex_unlock(&mutex);
+}
+
+void HttpProxy::failed(int backend, int fd) {
+  if (fd >= 0)
+    close(fd);
+  pthread_mutex_lock(&mutex);
+  Backend& b = backends[backend];
+  b.active--;
+  // the count is kept until a success, so a backend back from ejection
+  // is ejected again by its first failure.
+  if (++b.fails >= max_fails)
+    b.retry = time(NULL) + fail_timeout;
+  pthread_mutex_unlock(&mutex);
+}
+
+#endif
+
+}
+
+// vim:set et:
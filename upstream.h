@@ -0,0 +1,156 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _UPSTREAM_H_
+#define _UPSTREAM_H_
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <pthread.h>
+#endif
+
+namespace tthttpd {
+
+class FastCGI;
+class FastCGIRequest;
+
+#ifndef _WIN32
+
+// connect to "unix:/path/to/socket" or "host:port". returns -1 on failure.
+int upstream_connect(const std::string& address);
+
+enum { UPSTREAM_SCGI, UPSTREAM_UWSGI };
+
+// connect to an SCGI or uwsgi server and send the CGI variables in its
+// encoding. the request body is then written to the returned socket and
+// the response, a CGI response ended by the server closing, read from it.
+// both protocols close the connection after every response, so unlike
+// FastCGI there is nothing to keep open between requests.
+int upstream_open(int protocol, const std::string& address, const std::vector<std::string>& envs);
+
+// a FastCGI application. given a program, `procs' workers are spawned
+// sharing one listening unix socket, and dead workers are respawned.
+// given an address, the application is expected to be running already.
+// connections are kept open with FCGI_KEEP_CONN and reused. a connection
+// to a spawned worker holds that worker, so no more than `procs' are open
+// at once; acquire() waits for one to be released.
+class FastCGI {
+public:
+  FastCGI(const std::string& spec, int procs);
+  ~FastCGI();
+  bool start();
+  void stop();
+  int acquire();
+  void release(int fd, bool reuse);
+private:
+  std::string address;
+  std::string command;
+  std::string sock_path;
+  int procs;
+  int listen_fd;
+  std::vector<pid_t> pids;
+  std::vector<int> idle;
+  int opened;  // connections made and not yet closed, idle ones included
+  time_t checked;
+  pthread_mutex_t mutex;
+  pthread_cond_t released;
+  pid_t spawn();
+  void check_workers();
+};
+
+// one request on a connection taken from a FastCGI pool. the response is
+// read back as plain CGI output; stderr records go to our stderr.
+class FastCGIRequest {
+public:
+  FastCGIRequest(FastCGI* _app);
+  ~FastCGIRequest();
+  bool begin(const std::vector<std::string>& envs);
+  long write(const char* data, unsigned long size);
+  bool close_stdin();
+  long long read(char* data, unsigned long size, bool block);
+  bool finished() const {
+    return ended || broken;
+  }
+  int fd;
+private:
+  FastCGI* app;
+  unsigned long remaining;
+  unsigned char padding;
+  bool ended;
+  bool broken;
+  bool send_record(int type, const char* data, unsigned long size);
+  bool recv_full(char* data, unsigned long size);
+  void discard(unsigned long size, FILE* out);
+};
+
+// HTTP servers behind a [proxy] prefix, given as "host:port" or
+// "unix:/path" separated by commas. idle keep-alive connections are pooled
+// per backend. a backend failing `max_fails' times in a row is left out for
+// `fail_timeout' seconds; once that passes it gets traffic again, and the
+// first success brings it back for good.
+class HttpProxy {
+public:
+  enum { ROUND_ROBIN, LEAST_CONN };
+  HttpProxy(const std::string& spec, int balance, int max_fails, int fail_timeout);
+  ~HttpProxy();
+  // a connection to the chosen backend, or -1 when none could be reached.
+  // `reused' tells whether it was an idle one, which may turn out stale.
+  int acquire(int& backend, bool& reused);
+  // hand back a connection after a complete exchange.
+  void release(int backend, int fd, bool reuse);
+  // close a connection that failed, counting it against the backend.
+  void failed(int backend, int fd);
+  // close a connection without holding it against the backend, for a
+  // stale idle one or a client that went away.
+  void discard(int backend, int fd);
+  const std::string& address(int backend) const {
+    return backends[backend].address;
+  }
+private:
+  typedef struct {
+    std::string address;
+    std::vector<int> idle;
+    int active;
+    int fails;
+    time_t retry;
+  } Backend;
+  std::vector<Backend> backends;
+  int balance;
+  int max_fails;
+  int fail_timeout;
+  size_t next;
+  pthread_mutex_t mutex;
+  int pick(time_t now, const std::vector<bool>& tried);
+};
+
+#endif
+
+}
+
+#endif /* _UPSTREAM_H_ */
+
+// vim:set et:
@@ -37,24 +37,58 @@
 #include <time.h>
 #ifndef _WIN32
 #include <unistd.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
+#ifdef HAVE_SPAWN_H
+#include <spawn.h>
+#endif
 #endif
 
 #include "utils.h"
 #include <sstream>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2_KERNELS
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+// kernels for SSSE3 and AVX2 are built with target attributes and
+// picked at run time.
+#if defined(HAVE_SSE2_KERNELS) && defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define HAVE_AVX2_KERNELS
+#include <immintrin.h>
+#endif
+
 namespace tthttpd {
 
-const std::string base64_chars =
+static const char base64_chars[] =
   "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
   "abcdefghijklmnopqrstuvwxyz"
   "0123456789+/";
-#define is_base64(c) ( \
-    isalnum((unsigned char)c) || \
-    ((unsigned char)c == '+') || \
-    ((unsigned char)c == '/'))
+
+// the value of each byte in the alphabet, 255 for the others.
+static const unsigned char base64_values[256] = {
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  62, 255, 255, 255,  63,
+   52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 255, 255, 255, 255, 255, 255,
+  255,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+   15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 255, 255, 255, 255, 255,
+  255,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+   41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255
+};
 
 struct interval {
   unsigned short first;
@@ -745,43 +779,47 @@ std::string cut_string_r(std::string str, int cells, std::string padding) {
   return ret;
 }
 
-std::vector<std::string> split_string(std::string strSrc, std::string strKey) {
-  std::vector<std::string> vecLines;
-  std::string strTmp = strSrc;
-
-  size_t iIndex = 0;
-  while (iIndex < strTmp.length()) {
-    int iOldIndex = iIndex;
-    iIndex = strTmp.find(strKey, iIndex);
-    if(iIndex != std::string::npos) {
-      vecLines.push_back(strTmp.substr(iOldIndex, iIndex - iOldIndex));
-    } else {
-      vecLines.push_back(strTmp.substr(iOldIndex));
-      break;
+bool StringTokenizer::next(StringSpan& token) {
+  if (pos >= src.len)
+    return false;
+  const char* start = src.ptr + pos;
+  const char* end = src.ptr + src.len;
+  const char* found = NULL;
+  if (key.len) {
+    for (const char* p = start; (p = (const char*) memchr(p, key.ptr[0], end - p)); p++) {
+      if ((size_t) (end - p) < key.len) break;
+      if (!memcmp(p, key.ptr, key.len)) {
+        found = p;
+        break;
+      }
     }
-    iIndex += strKey.length();
   }
-  return vecLines;
+  if (!found) {
+    token = StringSpan(start, end - start);
+    pos = src.len;
+  } else {
+    token = StringSpan(start, found - start);
+    pos = found - src.ptr + key.len;
+  }
+  return true;
 }
 
-void split_string(std::string strSrc, std::string strKey, std::vector<std::string>& vecLines) {
-  std::string strTmp = strSrc;
+std::vector<std::string> split_string(const std::string& strSrc, const std::string& strKey) {
+  std::vector<std::string> vecLines;
+  split_string(strSrc, strKey, vecLines);
+  return vecLines;
+}
 
-  vecLines.clear();
-  size_t iIndex = 0;
-  while (iIndex < strTmp.length()) {
-    int iOldIndex = iIndex;
-    iIndex = strTmp.find(strKey, iIndex);
-    if(iIndex != std::string::npos) {
-      std::string item = strTmp.substr(iOldIndex, iIndex - iOldIndex);
-      vecLines.push_back(item);
-    } else {
-      std::string item = strTmp.substr(iOldIndex);
-      vecLines.push_back(item);
-      break;
-    }
-    iIndex += strKey.length();
+void split_string(const std::string& strSrc, const std::string& strKey, std::vector<std::string>& vecLines) {
+  StringTokenizer tokenizer(strSrc, strKey);
+  size_t count = 0;
+  for (StringSpan token; tokenizer.next(token); count++) {
+    if (count < vecLines.size())
+      vecLines[count].assign(token.ptr, token.len);
+    else
+      vecLines.push_back(token.str());
   }
+  vecLines.resize(count);
 }
 
 #ifdef _UNICODE
@@ -853,180 +891,484 @@ tstring& replace_string(tstring& strSrc, const tstring strFrom, const tstring st
 }
 #endif
 
-std::string base64_encode(unsigned char const* bytes_to_encode, unsigned int in_len) {
-  std::string ret;
-  int i = 0;
-  int j = 0;
-  unsigned char char_array_3[3] = {0};
-  unsigned char char_array_4[4] = {0};
-
-  while (in_len--) {
-    char_array_3[i++] = *(bytes_to_encode++);
-    if (i == 3) {
-      char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-      char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-      char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-      char_array_4[3] = char_array_3[2] & 0x3f;
-
-      for(i = 0; (i <4) ; i++)
-        ret += base64_chars[char_array_4[i]];
-      i = 0;
-    }
-  }
+// the kernels below go as far as the CPU does, or as far as
+// force_kernels() says.
+enum { KERNELS_SCALAR, KERNELS_SSE2, KERNELS_SSSE3, KERNELS_AVX2 };
+static int kernels_level = -1;
+
+static int cpu_kernels() {
+#if defined(HAVE_AVX2_KERNELS)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return KERNELS_AVX2;
+  if (__builtin_cpu_supports("ssse3"))
+    return KERNELS_SSSE3;
+  return KERNELS_SSE2;
+#elif defined(HAVE_SSE2_KERNELS)
+  return KERNELS_SSE2;
+#else
+  return KERNELS_SCALAR;
+#endif
+}
+
+static int kernels() {
+  // picked once; threads racing here all pick the same.
+  if (kernels_level < 0)
+    kernels_level = cpu_kernels();
+  return kernels_level;
+}
 
-  if (i) {
-    for(j = i; j < 3; j++)
-      char_array_3[j] = '\0';
+bool force_kernels(const char* name) {
+  static const char* names[] = { "scalar", "sse2", "ssse3", "avx2" };
+  if (!name) {
+    kernels_level = cpu_kernels();
+    return true;
+  }
+  for (int level = KERNELS_SCALAR; level <= KERNELS_AVX2; level++) {
+    if (strcmp(name, names[level]))
+      continue;
+    if (level > cpu_kernels())
+      return false;
+    kernels_level = level;
+    return true;
+  }
+  return false;
+}
 
-    char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-    char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-    char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-    char_array_4[3] = char_array_3[2] & 0x3f;
+// the base64 kernels take whole blocks only, and return how much of the
+// input they used; the table-driven loops below finish the rest. a block
+// holding anything outside the alphabet is left to them as well.
+typedef size_t (*Base64Func)(const unsigned char* in, size_t len, unsigned char* out);
+
+#ifdef HAVE_AVX2_KERNELS
+// 12 bytes of a 16-byte block spread to 16 six-bit values, and then
+// shifted into the alphabet.
+__attribute__((target("ssse3")))
+static inline __m128i base64_encode_block(__m128i in) {
+  in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  __m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+  __m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+  __m128i values = _mm_or_si128(hi, lo);
+  // 0-25 'A', 26-51 'a', 52-61 '0', 62 '+' and 63 '/'.
+  __m128i index = _mm_subs_epu8(values, _mm_set1_epi8(51));
+  index = _mm_or_si128(index, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), values), _mm_set1_epi8(13)));
+  const __m128i shifts = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  return _mm_add_epi8(values, _mm_shuffle_epi8(shifts, index));
+}
 
-    for (j = 0; (j < i + 1); j++)
-      ret += base64_chars[char_array_4[j]];
+__attribute__((target("ssse3")))
+static size_t base64_encode_ssse3(const unsigned char* in, size_t len, unsigned char* out) {
+  size_t n = 0;
+  for (; n + 16 <= len; n += 12, out += 16)
+    _mm_storeu_si128((__m128i*) out, base64_encode_block(_mm_loadu_si128((const __m128i*) (in + n))));
+  return n;
+}
 
-    while((i++ < 3))
-      ret += '=';
+__attribute__((target("avx2")))
+static size_t base64_encode_avx2(const unsigned char* in, size_t len, unsigned char* out) {
+  size_t n = 0;
+  for (; n + 28 <= len; n += 24, out += 32) {
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+      _mm_loadu_si128((const __m128i*) (in + n))), _mm_loadu_si128((const __m128i*) (in + n + 12)), 1);
+    v = _mm256_shuffle_epi8(v, _mm256_set_epi8(
+      10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+      10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m256i hi = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+    __m256i lo = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+    __m256i values = _mm256_or_si256(hi, lo);
+    __m256i index = _mm256_subs_epu8(values, _mm256_set1_epi8(51));
+    index = _mm256_or_si256(index, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), values), _mm256_set1_epi8(13)));
+    const __m256i shifts = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    _mm256_storeu_si256((__m256i*) out, _mm256_add_epi8(values, _mm256_shuffle_epi8(shifts, index)));
   }
+  return n;
+}
 
-  return ret;
+// 16 characters to the 16 six-bit values they stand for, with `bad' set
+// for any outside the alphabet. bytes from 0x80 are negative here, so
+// they fall outside every range.
+__attribute__((target("ssse3")))
+static inline __m128i base64_values_block(__m128i in, int& bad) {
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), in));
+  __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), in));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), in));
+  __m128i plus = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+  __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+  __m128i shift = _mm_or_si128(_mm_or_si128(
+    _mm_and_si128(upper, _mm_set1_epi8(-'A')), _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))), _mm_or_si128(
+    _mm_and_si128(digit, _mm_set1_epi8(52 - '0')), _mm_or_si128(
+    _mm_and_si128(plus, _mm_set1_epi8(62 - '+')), _mm_and_si128(slash, _mm_set1_epi8(63 - '/')))));
+  __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+  bad = _mm_movemask_epi8(valid) != 0xffff;
+  return _mm_add_epi8(in, shift);
 }
 
-std::string base64_decode(std::string const& encoded_string) {
-  int in_len = encoded_string.size();
-  int i = 0;
-  int j = 0;
-  int in_ = 0;
-  unsigned char char_array_4[4] = {0};
-  unsigned char char_array_3[3] = {0};
-  std::string ret;
-
-  while (in_len-- && ( encoded_string[in_] != '=') && is_base64(encoded_string[in_])) {
-    char_array_4[i++] = encoded_string[in_]; in_++;
-    if (i ==4) {
-      for (i = 0; i <4; i++)
-        char_array_4[i] = base64_chars.find(char_array_4[i]);
-
-      char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-      char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-      char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-      for (i = 0; (i < 3); i++)
-        ret += char_array_3[i];
-      i = 0;
-    }
+// four six-bit values in each 32-bit lane to three bytes, in order.
+__attribute__((target("ssse3")))
+static inline __m128i base64_pack_block(__m128i values) {
+  __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(words, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static size_t base64_decode_ssse3(const unsigned char* in, size_t len, unsigned char* out) {
+  size_t n = 0;
+  for (; n + 16 <= len; n += 16, out += 12) {
+    int bad;
+    __m128i values = base64_values_block(_mm_loadu_si128((const __m128i*) (in + n)), bad);
+    if (bad)
+      break;
+    __m128i bytes = base64_pack_block(values);
+    _mm_storel_epi64((__m128i*) out, bytes);
+    int last = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+    memcpy(out + 8, &last, 4);
   }
+  return n;
+}
 
-  if (i) {
-    for (j = i; j <4; j++)
-      char_array_4[j] = 0;
+__attribute__((target("avx2")))
+static size_t base64_decode_avx2(const unsigned char* in, size_t len, unsigned char* out) {
+  size_t n = 0;
+  for (; n + 32 <= len; n += 32, out += 24) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) (in + n));
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+    __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    __m256i plus = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+'));
+    __m256i slash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+    __m256i valid = _mm256_or_si256(_mm256_or_si256(upper, lower), _mm256_or_si256(digit, _mm256_or_si256(plus, slash)));
+    if ((unsigned int) _mm256_movemask_epi8(valid) != 0xffffffffu)
+      break;
+    __m256i shift = _mm256_or_si256(_mm256_or_si256(
+      _mm256_and_si256(upper, _mm256_set1_epi8(-'A')), _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))), _mm256_or_si256(
+      _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')), _mm256_or_si256(
+      _mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')), _mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')))));
+    v = _mm256_add_epi8(v, shift);
+    v = _mm256_madd_epi16(_mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+    v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    // 12 bytes in each half; close the gap and store exactly 24.
+    v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm_storeu_si128((__m128i*) out, _mm256_castsi256_si128(v));
+    _mm_storel_epi64((__m128i*) (out + 16), _mm256_extracti128_si256(v, 1));
+  }
+  return n;
+}
+#endif
 
-    for (j = 0; j <4; j++)
-      char_array_4[j] = base64_chars.find(char_array_4[j]);
+static size_t base64_none(const unsigned char*, size_t, unsigned char*) {
+  return 0;
+}
 
-    char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-    char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-    char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+static void base64_kernels(Base64Func& encode, Base64Func& decode) {
+  switch (kernels()) {
+#if defined(HAVE_AVX2_KERNELS)
+  case KERNELS_AVX2:
+    encode = base64_encode_avx2;
+    decode = base64_decode_avx2;
+    break;
+  case KERNELS_SSSE3:
+    encode = base64_encode_ssse3;
+    decode = base64_decode_ssse3;
+    break;
+#endif
+  default:
+    encode = decode = base64_none;
+    break;
+  }
+}
 
-    for (j = 0; (j < i - 1); j++)
-      ret += char_array_3[j];
+size_t base64_encode(const unsigned char* bytes, size_t len, char* out) {
+  Base64Func encode, decode;
+  base64_kernels(encode, decode);
+  unsigned char* p = (unsigned char*) out;
+  size_t n = encode(bytes, len, p);
+  p += n / 3 * 4;
+  for (; n + 3 <= len; n += 3, p += 4) {
+    unsigned int v = bytes[n] << 16 | bytes[n + 1] << 8 | bytes[n + 2];
+    p[0] = base64_chars[v >> 18];
+    p[1] = base64_chars[v >> 12 & 0x3f];
+    p[2] = base64_chars[v >> 6 & 0x3f];
+    p[3] = base64_chars[v & 0x3f];
+  }
+  if (n < len) {
+    unsigned int v = bytes[n] << 16 | (n + 1 < len ? bytes[n + 1] << 8 : 0);
+    p[0] = base64_chars[v >> 18];
+    p[1] = base64_chars[v >> 12 & 0x3f];
+    p[2] = n + 1 < len ? base64_chars[v >> 6 & 0x3f] : '=';
+    p[3] = '=';
+    p += 4;
   }
+  return (char*) p - out;
+}
 
+std::string base64_encode(unsigned char const* bytes_to_encode, unsigned int in_len) {
+  std::string ret((in_len + 2) / 3 * 4, '\0');
+  if (in_len)
+    base64_encode(bytes_to_encode, in_len, &ret[0]);
   return ret;
 }
 
-std::vector<char> base64_decode_binary(std::string const& encoded_string) {
-  int in_len = encoded_string.size();
-  int i = 0;
-  int j = 0;
-  int in_ = 0;
-  unsigned char char_array_4[4] = {0};
-  unsigned char char_array_3[3] = {0};
-  std::vector<char> ret;
-
-  while (in_len-- && ( encoded_string[in_] != '=') && is_base64(encoded_string[in_])) {
-    char_array_4[i++] = encoded_string[in_]; in_++;
-    if (i ==4) {
-      for (i = 0; i <4; i++)
-        char_array_4[i] = base64_chars.find(char_array_4[i]);
-
-      char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-      char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-      char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-      for (i = 0; (i < 3); i++)
-        ret.push_back(char_array_3[i]);
-      i = 0;
-    }
+// decoding stops at padding or at the first byte outside the alphabet,
+// and a group cut short there gives the bytes it holds whole.
+size_t base64_decode(const char* encoded, size_t len, unsigned char* out) {
+  Base64Func encode, decode;
+  base64_kernels(encode, decode);
+  const unsigned char* in = (const unsigned char*) encoded;
+  unsigned char* start = out;
+  size_t n = decode(in, len, out);
+  out += n / 4 * 3;
+  for (; n + 4 <= len; n += 4, out += 3) {
+    unsigned int a = base64_values[in[n]], b = base64_values[in[n + 1]];
+    unsigned int c = base64_values[in[n + 2]], d = base64_values[in[n + 3]];
+    if ((a | b | c | d) & 0x80)
+      break;
+    unsigned int v = a << 18 | b << 12 | c << 6 | d;
+    out[0] = (unsigned char) (v >> 16);
+    out[1] = (unsigned char) (v >> 8);
+    out[2] = (unsigned char) v;
   }
+  unsigned int values[4];
+  int i = 0;
+  while (n < len && i < 4 && !(base64_values[in[n]] & 0x80))
+    values[i++] = base64_values[in[n++]];
+  if (i >= 2)
+    *out++ = (unsigned char) (values[0] << 2 | values[1] >> 4);
+  if (i >= 3)
+    *out++ = (unsigned char) (values[1] << 4 | values[2] >> 2);
+  return out - start;
+}
 
-  if (i) {
-    for (j = i; j <4; j++)
-      char_array_4[j] = 0;
+std::string base64_decode(std::string const& encoded_string) {
+  std::string ret(encoded_string.size() / 4 * 3 + 2, '\0');
+  ret.resize(base64_decode(encoded_string.data(), encoded_string.size(), (unsigned char*) &ret[0]));
+  return ret;
+}
 
-    for (j = 0; j <4; j++)
-      char_array_4[j] = base64_chars.find(char_array_4[j]);
+std::vector<char> base64_decode_binary(std::string const& encoded_string) {
+  std::vector<char> ret(encoded_string.size() / 4 * 3 + 2);
+  ret.resize(base64_decode(encoded_string.data(), encoded_string.size(), (unsigned char*) &ret[0]));
+  return ret;
+}
+
+// the mask kernels look at 32 bytes from `p' and set a bit for each of
+// them that is one of a, b and c. the callers walk the bits, so input
+// dense with such bytes costs no more scans than plain text.
+typedef unsigned int (*MaskFunc)(const char* p, char a, char b, char c);
+
+#ifdef HAVE_SSE2_KERNELS
+static unsigned int mask_sse2(const char* p, char a, char b, char c) {
+  const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), vc = _mm_set1_epi8(c);
+  __m128i lo = _mm_loadu_si128((const __m128i*) p);
+  __m128i hi = _mm_loadu_si128((const __m128i*) (p + 16));
+  lo = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(lo, va), _mm_cmpeq_epi8(lo, vb)), _mm_cmpeq_epi8(lo, vc));
+  hi = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(hi, va), _mm_cmpeq_epi8(hi, vb)), _mm_cmpeq_epi8(hi, vc));
+  return (unsigned int) _mm_movemask_epi8(lo) | (unsigned int) _mm_movemask_epi8(hi) << 16;
+}
+#endif
+
+static unsigned int mask_scalar(const char* p, char a, char b, char c) {
+  unsigned int bits = 0;
+  for (int i = 0; i < 32; i++)
+    if (p[i] == a || p[i] == b || p[i] == c)
+      bits |= 1u << i;
+  return bits;
+}
 
-    char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-    char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-    char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("avx2")))
+static unsigned int mask_avx2(const char* p, char a, char b, char c) {
+  __m256i v = _mm256_loadu_si256((const __m256i*) p);
+  __m256i hit = _mm256_or_si256(_mm256_or_si256(
+    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(a)), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(b))),
+    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+  return (unsigned int) _mm256_movemask_epi8(hit);
+}
+#endif
 
-    for (j = 0; (j < i - 1); j++)
-      ret.push_back(char_array_3[j]);
+static MaskFunc block_mask() {
+  switch (kernels()) {
+#if defined(HAVE_AVX2_KERNELS)
+  case KERNELS_AVX2:
+    return mask_avx2;
+#endif
+#if defined(HAVE_SSE2_KERNELS)
+  case KERNELS_SSSE3:
+  case KERNELS_SSE2:
+    return mask_sse2;
+#endif
+  default:
+    return mask_scalar;
   }
+}
 
-  return ret;
+static inline int first_bit(unsigned int bits) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, bits);
+  return (int) index;
+#elif defined(__GNUC__)
+  return __builtin_ctz(bits);
+#else
+  int index = 0;
+  while (!(bits & 1)) bits >>= 1, index++;
+  return index;
+#endif
 }
 
-std::string url_decode(const std::string& url) {
-  std::ostringstream rets;
-  std::string hexstr;
-  for(size_t n = 0; n < url.size(); n++) {
-    switch(url[n]) {
-    case '+':
-      rets << ' ';
-      break;
-    case '%':
-      hexstr = url.substr(n+1, 2);
-      n += 2;
-      if (hexstr == "26" || hexstr == "3D")
-        rets << '%' << hexstr;
-      else {
-        std::istringstream hexstream(hexstr);
-        int hexint;
-        hexstream >> std::hex >> hexint;
-        rets << static_cast<char>(hexint);
+static inline int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// the escape at url[n], which takes three bytes of the input.
+static char* url_unescape(const char* url, size_t len, size_t n, char* out) {
+  // %26 and %3D stay escaped, so that they do not split a query string.
+  if (n + 2 < len && ((url[n+1] == '2' && url[n+2] == '6') || (url[n+1] == '3' && url[n+2] == 'D'))) {
+    memcpy(out, url + n, 3);
+    return out + 3;
+  }
+  if (n + 2 < len && hex_value(url[n+1]) >= 0 && hex_value(url[n+2]) >= 0) {
+    *out++ = static_cast<char>(hex_value(url[n+1]) << 4 | hex_value(url[n+2]));
+    return out;
+  }
+  // a short or malformed escape reads as much as a stream would.
+  std::istringstream hexstream(std::string(url + n + 1, std::min(len - n - 1, (size_t) 2)));
+  int hexint = 0;
+  hexstream >> std::hex >> hexint;
+  *out++ = static_cast<char>(hexint);
+  return out;
+}
+
+size_t url_decode(const char* url, size_t len, char* out) {
+  MaskFunc mask = block_mask();
+  char* start = out;
+  size_t n = 0;
+  while (n + 32 <= len) {
+    unsigned int bits = mask(url + n, '%', '+', '+');
+    size_t from = n;
+    while (bits) {
+      size_t at = n + first_bit(bits);
+      bits &= bits - 1;
+      if (at < from)
+        continue;  // taken by an escape before it
+      memcpy(out, url + from, at - from);
+      out += at - from;
+      if (url[at] == '+') {
+        *out++ = ' ';
+        from = at + 1;
+      } else {
+        out = url_unescape(url, len, at, out);
+        from = at + 3;
       }
-      break;
-    default:
-      rets << url[n];
-      break;
     }
+    if (from < n + 32) {
+      memcpy(out, url + from, n + 32 - from);
+      out += n + 32 - from;
+      from = n + 32;
+    }
+    n = from;
   }
-  return rets.str();
+  while (n < len) {
+    if (url[n] == '+') {
+      *out++ = ' ';
+      n++;
+    } else if (url[n] == '%') {
+      out = url_unescape(url, len, n, out);
+      n += 3;
+    } else
+      *out++ = url[n++];
+  }
+  return out - start;
 }
 
-std::string url_encode(const std::string& url) {
-  std::ostringstream rets;
-  for(size_t n = 0; n < url.size(); n++) {
+std::string url_decode(const std::string& url) {
+  std::string ret(url.size(), '\0');
+  if (url.size())
+    ret.resize(url_decode(url.data(), url.size(), &ret[0]));
+  return ret;
+}
+
+size_t url_encode(const char* url, size_t len, char* out) {
+  static const char hex[] = "0123456789abcdef";
+  char* p = out;
+  for(size_t n = 0; n < len; n++) {
     unsigned char c = (unsigned char)url[n];
     if (isalnum(c) || c == '_' || c == '.' || c == '/' )
-      rets << c;
+      *p++ = c;
     else {
-      char buf[8];
-      sprintf(buf, "%02x", (int)c);
-      rets << '%' << buf[0] << buf[1];
+      *p++ = '%';
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 15];
     }
   }
-  return rets.str();
+  return p - out;
+}
+
+std::string url_encode(const std::string& url) {
+  std::string ret(url.size() * 3, '\0');
+  if (ret.size())
+    ret.resize(url_encode(url.data(), url.size(), &ret[0]));
+  return ret;
+}
+
+static inline char* html_escape(char c, char* out) {
+  switch (c) {
+  case '&': memcpy(out, "&amp;", 5); return out + 5;
+  case '<': memcpy(out, "&lt;", 4); return out + 4;
+  case '>': memcpy(out, "&gt;", 4); return out + 4;
+  }
+  *out = c;
+  return out + 1;
+}
+
+size_t html_encode_size(const char* html, size_t len) {
+  MaskFunc mask = block_mask();
+  size_t size = len, n = 0;
+  for (; n + 32 <= len; n += 32) {
+    unsigned int bits = mask(html + n, '&', '<', '>');
+    for (; bits; bits &= bits - 1)
+      size += html[n + first_bit(bits)] == '&' ? 4 : 3;
+  }
+  for (; n < len; n++)
+    size += html[n] == '&' ? 4 : html[n] == '<' || html[n] == '>' ? 3 : 0;
+  return size;
+}
+
+size_t html_encode(const char* html, size_t len, char* out) {
+  MaskFunc mask = block_mask();
+  char* start = out;
+  size_t n = 0;
+  for (; n + 32 <= len; n += 32) {
+    unsigned int bits = mask(html + n, '&', '<', '>');
+    size_t from = n;
+    for (; bits; bits &= bits - 1) {
+      size_t at = n + first_bit(bits);
+      memcpy(out, html + from, at - from);
+      out = html_escape(html[at], out + (at - from));
+      from = at + 1;
+    }
+    memcpy(out, html + from, n + 32 - from);
+    out += n + 32 - from;
+  }
+  for (; n < len; n++)
+    out = html_escape(html[n], out);
+  return out - start;
 }
 
 std::string html_encode(const std::string& html) {
-  std::string ret = html;
-  replace_string(ret, "&", "&amp;");
-  replace_string(ret, "<", "&lt;");
-  replace_string(ret, ">", "&gt;");
+  std::string ret(html_encode_size(html.data(), html.size()), '\0');
+  if (ret.size())
+    html_encode(html.data(), html.size(), &ret[0]);
   return ret;
 }
 
@@ -1078,6 +1420,8 @@ std::map<std::string, std::string> parse_querystring(const std::string& query_st
 #endif
 
 #ifndef _WIN32
+// <immintrin.h> has one of its own.
+#undef _rotl
 #define _rotl(x, y) ((x<<y)|(x>>(32-y)))
 #endif
 
@@ -1260,6 +1604,67 @@ std::string md5_string(const std::string& input) {
   return digest;
 }
 
+// SHA-1, for the WebSocket handshake. words are kept in unsigned int and
+// not uint32, which is as wide as a long here.
+static void sha1_process(unsigned int state[5], const unsigned char block[64]) {
+  unsigned int w[80];
+  for (int i = 0; i < 16; i++)
+    w[i] = (block[i*4] << 24) | (block[i*4+1] << 16) | (block[i*4+2] << 8) | block[i*4+3];
+  for (int i = 16; i < 80; i++) {
+    unsigned int x = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+    w[i] = (x << 1) | (x >> 31);
+  }
+  unsigned int a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+  for (int i = 0; i < 80; i++) {
+    unsigned int f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    unsigned int t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = (b << 30) | (b >> 2);
+    b = a;
+    a = t;
+  }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+std::string sha1_string(const std::string& input) {
+  unsigned int state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  size_t size = input.size();
+  size_t pos = 0;
+  for (; size - pos >= 64; pos += 64)
+    sha1_process(state, (const unsigned char*)input.data() + pos);
+
+  unsigned char block[128] = {0};
+  size_t rest = size - pos;
+  memcpy(block, input.data() + pos, rest);
+  block[rest] = 0x80;
+  size_t blocks = rest < 56 ? 1 : 2;
+  uint64 nbits = (uint64)size * 8;
+  for (int i = 0; i < 8; i++)
+    block[blocks * 64 - 1 - i] = (unsigned char)(nbits >> (i * 8));
+  for (size_t i = 0; i < blocks; i++)
+    sha1_process(state, block + i * 64);
+
+  std::string digest;
+  digest.resize(20);
+  for (int i = 0; i < 20; i++)
+    digest[i] = (char)(state[i / 4] >> (24 - (i % 4) * 8));
+  return digest;
+}
+
 std::string string_to_hex(const std::string& input) {
   const static char hex_table[] = "0123456789abcdef";
   std::string temp;
@@ -1332,6 +1737,80 @@ void set_priv(const char *chuser_name, const char *chroot_dir, const char *title
 #endif
 }
 
+#ifndef _WIN32
+/*
+ * Start argv[0] in a new session with `in', `out' and `err' as its stdio
+ * (-1 keeps ours) and `dir' as its working directory (NULL keeps ours).
+ * The child borrows our address space until execve instead of copying
+ * the page tables of the whole server, as fork would. Descriptors which
+ * should not leak into the child must be close-on-exec.
+ */
+pid_t spawn_process(char* const* argv, char* const* envp, const char* dir, int in, int out, int err) {
+  pid_t child = -1;
+  sigset_t mask;
+
+#ifdef HAVE_POSIX_SPAWN
+  bool use_spawn = true;
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+  if (dir) use_spawn = false;
+#endif
+  if (use_spawn) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+
+    posix_spawn_file_actions_init(&actions);
+    if (in >= 0) posix_spawn_file_actions_adddup2(&actions, in, 0);
+    if (out >= 0) posix_spawn_file_actions_adddup2(&actions, out, 1);
+    if (err >= 0) posix_spawn_file_actions_adddup2(&actions, err, 2);
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+    if (dir) posix_spawn_file_actions_addchdir_np(&actions, dir);
+#endif
+
+    posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_SETSID
+    flags |= POSIX_SPAWN_SETSID;
+#else
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup(&attr, 0);
+#endif
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    sigaddset(&mask, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setflags(&attr, flags);
+
+    int ret = posix_spawn(&child, argv[0], &actions, &attr, argv, envp);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (ret) {
+      errno = ret;
+      return -1;
+    }
+    return child;
+  }
+#endif
+
+  child = vfork();
+  if (child == 0) {
+    if (in >= 0) dup2(in, 0);
+    if (out >= 0) dup2(out, 1);
+    if (err >= 0) dup2(err, 2);
+    setsid();
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    if (dir && chdir(dir) != 0)
+      _exit(127);
+    execve(argv[0], argv, envp);
+    _exit(127);
+  }
+  return child;
+}
+#endif
+
 }
 
 // vim:set et:
@@ -27,8 +27,12 @@
 #include <tchar.h>
 #pragma warning(disable : 4530 4018 4786)
 #pragma comment(lib, "wininet.lib")
+#if _MSC_VER < 1800
+#define strtoull _strtoui64
+#endif
 #endif
 
+#include <string.h>
 #include <iostream>
 #include <vector>
 #include <map>
@@ -59,6 +63,9 @@ namespace tthttpd {
 #ifndef SD_BOTH
 # define SD_BOTH SHUT_RDWR
 #endif
+#ifndef SD_SEND
+# define SD_SEND SHUT_WR
+#endif
 #endif
 
 #ifdef _UNICODE
@@ -106,8 +113,75 @@ tstring convert_string(const tstring str, const tstring from_codeset, const tstr
 std::string cut_string(std::string str, int cells, std::string padding = "...");
 std::string cut_string_r(std::string str, int cells, std::string padding = "...");
 
-std::vector<std::string> split_string(const std::string strSrc, const std::string strKey);
-void split_string(const std::string strSrc, const std::string strKey, std::vector<std::string>& res);
+// a stretch of a string, by pointer and length. it owns nothing, so what
+// it points into has to outlive it.
+struct StringSpan {
+  const char* ptr;
+  size_t len;
+  StringSpan() : ptr(""), len(0) {}
+  StringSpan(const char* p, size_t n) : ptr(p), len(n) {}
+  StringSpan(const char* s) : ptr(s), len(strlen(s)) {}
+  template <class A>
+  StringSpan(const std::basic_string<char, std::char_traits<char>, A>& s) : ptr(s.data()), len(s.size()) {}
+  bool empty() const {
+    return len == 0;
+  }
+  std::string str() const {
+    return std::string(ptr, len);
+  }
+  bool operator==(const StringSpan& other) const {
+    return len == other.len && !memcmp(ptr, other.ptr, len);
+  }
+  bool operator!=(const StringSpan& other) const {
+    return !(*this == other);
+  }
+};
+
+// the pieces of `src' between `key's, one at a time and without copying
+// them, cut as split_string cuts them:
+//
+//   StringTokenizer tokens(line, " ");
+//   for (StringSpan token; tokens.next(token); )
+//     ...
+class StringTokenizer {
+public:
+  StringTokenizer(StringSpan _src, StringSpan _key) : src(_src), key(_key), pos(0) {}
+  bool next(StringSpan& token);
+private:
+  StringSpan src;
+  StringSpan key;
+  size_t pos;
+};
+
+// the first N pieces, kept in place. size() counts all of them, so that
+// a caller can tell there were more than it kept.
+template <size_t N>
+class StringTokens {
+public:
+  StringTokens(StringSpan src, StringSpan key) : count(0) {
+    StringTokenizer tokenizer(src, key);
+    StringSpan token;
+    while (tokenizer.next(token)) {
+      if (count < N) tokens[count] = token;
+      count++;
+    }
+  }
+  size_t size() const {
+    return count;
+  }
+  const StringSpan& operator[](size_t n) const {
+    return tokens[n];
+  }
+private:
+  StringSpan tokens[N];
+  size_t count;
+};
+
+std::vector<std::string> split_string(const std::string& strSrc, const std::string& strKey);
+// `res' keeps its strings between calls, so that splitting into the same
+// vector again allocates nothing once they are big enough. `strSrc' must
+// not be one of them.
+void split_string(const std::string& strSrc, const std::string& strKey, std::vector<std::string>& res);
 std::string trim_string(const std::string strSrc);
 std::string& replace_string(std::string& strSrc, const std::string strFrom, const std::string strTo);
 #ifdef UNICODE
@@ -117,17 +191,37 @@ tstring& replace_string(tstring& strSrc, tstring strFrom, tstring strTo);
 #endif
 
 std::string md5_string(const std::string& input);
+std::string sha1_string(const std::string& input);
 std::string string_to_hex(const std::string& input);
 std::string base64_encode(unsigned char const* bytes_to_encode, unsigned int in_len);
 std::string base64_decode(std::string const& encoded_string);
 std::vector<char> base64_decode_binary(std::string const& encoded_string);
+// buffer forms: `out' holds (len + 2) / 3 * 4 bytes to encode, and
+// len / 4 * 3 + 2 to decode. they return what was written.
+size_t base64_encode(const unsigned char* bytes, size_t len, char* out);
+size_t base64_decode(const char* encoded, size_t len, unsigned char* out);
 std::string url_decode(const std::string& url);
 std::string url_encode(const std::string& url);
 std::string html_decode(const std::string& html);
 std::string html_encode(const std::string& html);
+// buffer forms: `out' holds `len' bytes for url_decode, `len' * 3 for
+// url_encode, and html_encode_size() bytes for html_encode. they return
+// what was written.
+size_t url_decode(const char* url, size_t len, char* out);
+size_t url_encode(const char* url, size_t len, char* out);
+size_t html_encode_size(const char* html, size_t len);
+size_t html_encode(const char* html, size_t len, char* out);
+// the SIMD kernels of the routines above are picked for the CPU. this
+// holds them to "avx2", "ssse3", "sse2" or "scalar" instead, so that
+// utilsbench can check each; NULL goes back to the CPU's pick. false when
+// the CPU or the build has no such kernels.
+bool force_kernels(const char* name);
 std::map<std::string, std::string> parse_querystring(const std::string& query_string);
 
 void set_priv(const char *, const char *, const char *);
+#ifndef _WIN32
+pid_t spawn_process(char* const* argv, char* const* envp, const char* dir, int in, int out, int err);
+#endif
 
 }
 
@@ -0,0 +1,531 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+// microbenchmarks for the string routines in utils.cxx that sit on the
+// request path. each runs over a fixed corpus of the kind of input the
+// server sees, and reports the time and the heap allocations per call.
+// `make bench' builds and runs them.
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "httpd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#include <sstream>
+
+static unsigned long long allocations;
+
+#if __cplusplus >= 201103L
+# define THROW_BAD_ALLOC
+# define THROW_NOTHING noexcept
+#else
+# define THROW_BAD_ALLOC throw(std::bad_alloc)
+# define THROW_NOTHING throw()
+#endif
+
+void* operator new(size_t size) THROW_BAD_ALLOC {
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](size_t size) THROW_BAD_ALLOC {
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void* p) THROW_NOTHING {
+  free(p);
+}
+void operator delete[](void* p) THROW_NOTHING {
+  free(p);
+}
+
+static const char* urls[] = {
+  "/index.html",
+  "/images/logo%20small.png",
+  "/search?q=tiny+http+server&lang=ja&page=2",
+  "/wiki/%E6%97%A5%E6%9C%AC%E8%AA%9E%E3%81%AE%E3%83%9A%E3%83%BC%E3%82%B8",
+  "/cgi-bin/mt/mt.cgi?__mode=view&_type=entry&id=1024&blog_id=3",
+  "/static/js/jquery-1.3.2.min.js?v=20090601",
+  "/api/v1/items?filter=name%3Dfoo%26tag%3Dbar&sort=-date&limit=50",
+  "/~mattn/archives/2009/06/tinytinyhttpd%2Bcgi%2Bfastcgi.html",
+  NULL
+};
+
+static const char* texts[] = {
+  "index.html",
+  "Program Files",
+  "<script>alert('x')</script>",
+  "Tom & Jerry <Episodes> 1-10 & more",
+  "a directory listing entry with no markup at all in its name",
+  "&lt;already&gt; &amp; encoded",
+  NULL
+};
+
+static const char* headers[] = {
+  "Host: www.example.com",
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:52.0) Gecko/20100101 Firefox/52.0",
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8",
+  "Accept-Language: ja,en-US;q=0.7,en;q=0.3",
+  "Accept-Encoding: gzip, deflate",
+  "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; lang=ja",
+  "If-Modified-Since: Sat, 06 Jun 2009 12:34:56 GMT",
+  "Connection: keep-alive",
+  NULL
+};
+
+static const char* tokens[] = {
+  "dXNlcjpwYXNz",
+  "YWRtaW46c2VjcmV0",
+  "bWF0dG46dGlueXRpbnlodHRwZA==",
+  "QWxhZGRpbjpvcGVuIHNlc2FtZQ==",
+  "ZGF2ZTp0aGlzIGlzIGEgbXVjaCBsb25nZXIgcGFzc3dvcmQgdGhhbiB1c3VhbA==",
+  NULL
+};
+
+static const char* queries[] = {
+  "q=tiny+http+server&lang=ja&page=2",
+  "__mode=view&_type=entry&id=1024&blog_id=3",
+  "filter=name%3Dfoo%26tag%3Dbar&sort=-date&limit=50",
+  "name=%E6%9D%BE%E6%9C%AC&comment=hello+world%21&submit=",
+  "a=1&b=2&c=3&d=4&e=5&f=6&g=7&h=8",
+  NULL
+};
+
+// paths under a root that is not there, so that realpath() fails at once
+// and the time goes to the normalization.
+static const char* fs_paths[] = {
+  "/nonexistent/www/index.html",
+  "/nonexistent/www/images/../css/site.css",
+  "/nonexistent/www/a/b/c/../../d/./e/../f.txt",
+  "/nonexistent/www/wiki/\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e/",
+  "/nonexistent/www/cgi-bin/mt/mt.cgi?__mode=view",
+  NULL
+};
+
+static const char* request_head =
+  "GET /search?q=tiny+http+server HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:52.0) Gecko/20100101 Firefox/52.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: ja,en-US;q=0.7,en;q=0.3\r\n"
+  "Cookie: session=8f14e45fceea167a5a36dedd4bea2543\r\n"
+  "Connection: keep-alive\r\n";
+
+// the routines as they were before they were rewritten, to check the new
+// ones against and to see what was gained.
+static std::string url_decode_reference(const std::string& url) {
+  std::ostringstream rets;
+  std::string hexstr;
+  for(size_t n = 0; n < url.size(); n++) {
+    switch(url[n]) {
+    case '+':
+      rets << ' ';
+      break;
+    case '%':
+      hexstr = url.substr(n+1, 2);
+      n += 2;
+      if (hexstr == "26" || hexstr == "3D")
+        rets << '%' << hexstr;
+      else {
+        std::istringstream hexstream(hexstr);
+        int hexint = 0;
+        hexstream >> std::hex >> hexint;
+        rets << static_cast<char>(hexint);
+      }
+      break;
+    default:
+      rets << url[n];
+      break;
+    }
+  }
+  return rets.str();
+}
+
+static std::string html_encode_reference(const std::string& html) {
+  std::string ret = html;
+  tthttpd::replace_string(ret, "&", "&amp;");
+  tthttpd::replace_string(ret, "<", "&lt;");
+  tthttpd::replace_string(ret, ">", "&gt;");
+  return ret;
+}
+
+static const std::string base64_chars =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+  "abcdefghijklmnopqrstuvwxyz"
+  "0123456789+/";
+#define is_base64(c) ( \
+    isalnum((unsigned char)c) || \
+    ((unsigned char)c == '+') || \
+    ((unsigned char)c == '/'))
+
+static std::string base64_encode_reference(unsigned char const* bytes_to_encode, unsigned int in_len) {
+  std::string ret;
+  int i = 0;
+  int j = 0;
+  unsigned char char_array_3[3] = {0};
+  unsigned char char_array_4[4] = {0};
+
+  while (in_len--) {
+    char_array_3[i++] = *(bytes_to_encode++);
+    if (i == 3) {
+      char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
+      char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
+      char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
+      char_array_4[3] = char_array_3[2] & 0x3f;
+
+      for(i = 0; (i <4) ; i++)
+        ret += base64_chars[char_array_4[i]];
+      i = 0;
+    }
+  }
+
+  if (i) {
+    for(j = i; j < 3; j++)
+      char_array_3[j] = '\0';
+
+    char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
+    char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
+    char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
+    char_array_4[3] = char_array_3[2] & 0x3f;
+
+    for (j = 0; (j < i + 1); j++)
+      ret += base64_chars[char_array_4[j]];
+
+    while((i++ < 3))
+      ret += '=';
+  }
+
+  return ret;
+}
+
+static std::string base64_decode_reference(std::string const& encoded_string) {
+  int in_len = encoded_string.size();
+  int i = 0;
+  int j = 0;
+  int in_ = 0;
+  unsigned char char_array_4[4] = {0};
+  unsigned char char_array_3[3] = {0};
+  std::string ret;
+
+  while (in_len-- && ( encoded_string[in_] != '=') && is_base64(encoded_string[in_])) {
+    char_array_4[i++] = encoded_string[in_]; in_++;
+    if (i ==4) {
+      for (i = 0; i <4; i++)
+        char_array_4[i] = base64_chars.find(char_array_4[i]);
+
+      char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
+      char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
+      char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+
+      for (i = 0; (i < 3); i++)
+        ret += char_array_3[i];
+      i = 0;
+    }
+  }
+
+  if (i) {
+    for (j = i; j <4; j++)
+      char_array_4[j] = 0;
+
+    for (j = 0; j <4; j++)
+      char_array_4[j] = base64_chars.find(char_array_4[j]);
+
+    char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
+    char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
+    char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+
+    for (j = 0; (j < i - 1); j++)
+      ret += char_array_3[j];
+  }
+
+  return ret;
+}
+
+// random inputs thick with the bytes the routines care about, at lengths
+// around the kernels' block sizes.
+static bool fuzz(int rounds) {
+  static const char alphabet[] = "%%%++&&<<>>2263DdaF0g- xyz/\xe6\x80";
+  unsigned int seed = 12345;
+  for (int n = 0; n < rounds; n++) {
+    seed = seed * 1103515245 + 12345;
+    size_t len = (seed >> 16) % 130;
+    std::string input;
+    for (size_t i = 0; i < len; i++) {
+      seed = seed * 1103515245 + 12345;
+      unsigned int r = seed >> 16;
+      input += r % 4 ? 'a' + r % 26 : alphabet[(r >> 2) % (sizeof(alphabet) - 1)];
+    }
+    if (tthttpd::url_decode(input) != url_decode_reference(input)) {
+      fprintf(stderr, "url_decode differs for \"%s\"\n", input.c_str());
+      return false;
+    }
+    if (tthttpd::html_encode(input) != html_encode_reference(input)) {
+      fprintf(stderr, "html_encode differs for \"%s\"\n", input.c_str());
+      return false;
+    }
+    // mostly valid base64, with a stray byte or padding now and then.
+    std::string encoded;
+    for (size_t i = 0; i < len; i++) {
+      seed = seed * 1103515245 + 12345;
+      unsigned int r = seed >> 16;
+      encoded += r % 97 ? base64_chars[r % 64] : r % 3 ? '=' : (char) (r >> 8);
+    }
+    std::string decoded = base64_decode_reference(encoded);
+    if (tthttpd::base64_decode(encoded) != decoded) {
+      fprintf(stderr, "base64_decode differs for \"%s\"\n", encoded.c_str());
+      return false;
+    }
+    std::vector<char> binary = tthttpd::base64_decode_binary(encoded);
+    if (std::string(binary.begin(), binary.end()) != decoded) {
+      fprintf(stderr, "base64_decode_binary differs for \"%s\"\n", encoded.c_str());
+      return false;
+    }
+    // the buffer forms, with a guard byte past the room they are given.
+    std::string out(encoded.size() / 4 * 3 + 3, '#');
+    size_t size = tthttpd::base64_decode(encoded.data(), encoded.size(), (unsigned char*) &out[0]);
+    if (size != decoded.size() || out.compare(0, size, decoded) || out[out.size() - 1] != '#') {
+      fprintf(stderr, "base64_decode into a buffer differs for \"%s\"\n", encoded.c_str());
+      return false;
+    }
+    std::string raw;
+    for (size_t i = 0; i < len; i++) {
+      seed = seed * 1103515245 + 12345;
+      raw += (char) (seed >> 16);
+    }
+    const unsigned char* bytes = (const unsigned char*) raw.data();
+    std::string expected = base64_encode_reference(bytes, raw.size());
+    if (tthttpd::base64_encode(bytes, raw.size()) != expected) {
+      fprintf(stderr, "base64_encode differs for %d bytes\n", (int) raw.size());
+      return false;
+    }
+    out.assign((raw.size() + 2) / 3 * 4 + 1, '#');
+    size = tthttpd::base64_encode(bytes, raw.size(), &out[0]);
+    if (size != expected.size() || out.compare(0, size, expected) || out[out.size() - 1] != '#') {
+      fprintf(stderr, "base64_encode into a buffer differs for %d bytes\n", (int) raw.size());
+      return false;
+    }
+  }
+  return true;
+}
+
+typedef std::vector<std::string> Corpus;
+
+static Corpus corpus(const char** items) {
+  Corpus ret;
+  for (const char** ptr = items; *ptr; ptr++)
+    ret.push_back(*ptr);
+  return ret;
+}
+
+// keeps the results alive, so that the calls are not optimized away.
+static volatile size_t sink;
+
+typedef void (*BenchFunc)(const std::string& input);
+
+static void bench_url_decode(const std::string& input) {
+  sink += tthttpd::url_decode(input).size();
+}
+static void bench_url_decode_reference(const std::string& input) {
+  sink += url_decode_reference(input).size();
+}
+static void bench_url_encode(const std::string& input) {
+  sink += tthttpd::url_encode(input).size();
+}
+static void bench_html_encode(const std::string& input) {
+  sink += tthttpd::html_encode(input).size();
+}
+static void bench_html_encode_reference(const std::string& input) {
+  sink += html_encode_reference(input).size();
+}
+static void bench_split_string(const std::string& input) {
+  sink += tthttpd::split_string(input, "\r\n").size();
+}
+static void bench_split_string_reuse(const std::string& input) {
+  static std::vector<std::string> lines;
+  tthttpd::split_string(input, "\r\n", lines);
+  sink += lines.size();
+}
+static void bench_tokenizer(const std::string& input) {
+  tthttpd::StringTokenizer tokenizer(input, "\r\n");
+  for (tthttpd::StringSpan line; tokenizer.next(line); )
+    sink += line.len;
+}
+static void bench_get_realpath(const std::string& input) {
+  static std::string path;
+  tthttpd::server::get_realpath(input, path);
+  sink += path.size();
+}
+static void bench_trim_string(const std::string& input) {
+  size_t colon = input.find(':');
+  sink += tthttpd::trim_string(input.substr(colon + 1)).size();
+}
+static void bench_replace_string(const std::string& input) {
+  std::string copy = input;
+  sink += tthttpd::replace_string(copy, "&", "&amp;").size();
+}
+static void bench_base64_decode(const std::string& input) {
+  sink += tthttpd::base64_decode(input).size();
+}
+static void bench_base64_decode_reference(const std::string& input) {
+  sink += base64_decode_reference(input).size();
+}
+static void bench_base64_encode(const std::string& input) {
+  sink += tthttpd::base64_encode((const unsigned char*) input.data(), input.size()).size();
+}
+static void bench_base64_encode_reference(const std::string& input) {
+  sink += base64_encode_reference((const unsigned char*) input.data(), input.size()).size();
+}
+static void bench_md5_string(const std::string& input) {
+  sink += tthttpd::md5_string(input).size();
+}
+static void bench_parse_querystring(const std::string& input) {
+  sink += tthttpd::parse_querystring(input).size();
+}
+
+static unsigned long long now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run(const char* name, BenchFunc func, const Corpus& inputs, unsigned long long budget) {
+  // warm up, then double the rounds until they fill a tenth of the budget.
+  unsigned long long rounds = 1, took = 0;
+  while (true) {
+    unsigned long long start = now();
+    for (unsigned long long n = 0; n < rounds; n++)
+      for (size_t i = 0; i < inputs.size(); i++)
+        func(inputs[i]);
+    took = now() - start;
+    if (took * 10 >= budget) break;
+    rounds *= 2;
+  }
+  rounds = rounds * budget / (took ? took : 1);
+  if (!rounds) rounds = 1;
+  unsigned long long before = allocations;
+  unsigned long long start = now();
+  for (unsigned long long n = 0; n < rounds; n++)
+    for (size_t i = 0; i < inputs.size(); i++)
+      func(inputs[i]);
+  took = now() - start;
+  unsigned long long calls = rounds * inputs.size();
+  printf("%-20s %10.1f %10.2f %12llu\n", name, (double) took / calls,
+    (double) (allocations - before) / calls, calls);
+}
+
+int main(int argc, char* argv[]) {
+  unsigned long long budget = 500;  // msec per benchmark
+  const char* only = NULL;
+  for (int n = 1; n < argc; n++) {
+    if (!strcmp(argv[n], "-t") && n + 1 < argc)
+      budget = strtoull(argv[++n], NULL, 10);
+    else if (argv[n][0] != '-')
+      only = argv[n];
+    else {
+      fprintf(stderr, "usage: utilsbench [-t msec] [name]\n");
+      return -1;
+    }
+  }
+  budget *= 1000000;
+
+  Corpus paths = corpus(urls);
+  Corpus words = corpus(texts);
+  Corpus lines = corpus(headers);
+  Corpus auths = corpus(tokens);
+  Corpus forms = corpus(queries);
+  Corpus heads(1, request_head);
+  Corpus files = corpus(fs_paths);
+
+  // a 2 KB query string, and a directory listing of a few hundred names.
+  std::string query;
+  for (int n = 0; query.size() < 2048; n++) {
+    if (n) query += "&";
+    query += queries[n % 5];
+  }
+  Corpus longs(1, query);
+  std::string listing;
+  for (int n = 0; n < 300; n++)
+    listing += std::string("<li><a href=\"") + urls[n % 8] + "\">" + texts[n % 6] + "</a></li>\n";
+  Corpus pages(1, listing);
+
+  // a 4 KB payload, as a data URI would carry it.
+  std::string payload;
+  for (int n = 0; n < 4096; n++)
+    payload += (char) (n * 131 + n / 7);
+  Corpus blobs(1, payload);
+  Corpus datas(1, tthttpd::base64_encode((const unsigned char*) payload.data(), payload.size()));
+
+  // each set of kernels the CPU has is checked, not only its best.
+  static const char* kernels[] = { "avx2", "ssse3", "sse2", "scalar", NULL };
+  for (const char** k = kernels; *k; k++) {
+    if (!tthttpd::force_kernels(*k))
+      continue;
+    if (!fuzz(200000)) {
+      fprintf(stderr, "with the %s kernels\n", *k);
+      return 1;
+    }
+  }
+  tthttpd::force_kernels(NULL);
+
+  typedef struct {
+    const char* name;
+    BenchFunc func;
+    const Corpus* inputs;
+  } Bench;
+  const Bench benches[] = {
+    { "url_decode", bench_url_decode, &paths },
+    { "url_decode/2k", bench_url_decode, &longs },
+    { "url_decode/2k/old", bench_url_decode_reference, &longs },
+    { "url_encode", bench_url_encode, &paths },
+    { "html_encode", bench_html_encode, &words },
+    { "html_encode/list", bench_html_encode, &pages },
+    { "html_encode/list/old", bench_html_encode_reference, &pages },
+    { "split_string", bench_split_string, &heads },
+    { "split_string/reuse", bench_split_string_reuse, &heads },
+    { "tokenizer", bench_tokenizer, &heads },
+    { "get_realpath", bench_get_realpath, &files },
+    { "trim_string", bench_trim_string, &lines },
+    { "replace_string", bench_replace_string, &words },
+    { "base64_decode", bench_base64_decode, &auths },
+    { "base64_decode/old", bench_base64_decode_reference, &auths },
+    { "base64_decode/4k", bench_base64_decode, &datas },
+    { "base64_decode/4k/old", bench_base64_decode_reference, &datas },
+    { "base64_encode/4k", bench_base64_encode, &blobs },
+    { "base64_encode/4k/old", bench_base64_encode_reference, &blobs },
+    { "md5_string", bench_md5_string, &lines },
+    { "parse_querystring", bench_parse_querystring, &forms },
+    { NULL, NULL, NULL }
+  };
+  printf("%-20s %10s %10s %12s\n", "benchmark", "ns/op", "allocs/op", "calls");
+  for (const Bench* b = benches; b->name; b++)
+    if (!only || strstr(b->name, only))
+      run(b->name, b->func, *b->inputs, budget);
+  return 0;
+}
+
+// vim:set et:
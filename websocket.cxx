@@ -0,0 +1,487 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "websocket.h"
+#include "upstream.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+
+namespace tthttpd {
+
+#ifndef _WIN32
+
+// the largest message taken from a client or the backend, and the output
+// a client may leave unread before it is dropped. a backend that has this
+// much unread stops the reading from its clients instead.
+#define WS_MESSAGE_MAX (1024 * 1024)
+#define WS_BUFFER_MAX (1024 * 1024)
+
+enum {
+  WS_CONTINUATION = 0,
+  WS_TEXT = 1,
+  WS_BINARY = 2,
+  WS_CLOSE = 8,
+  WS_PING = 9,
+  WS_PONG = 10
+};
+
+std::string websocket_accept(const std::string& key) {
+  std::string digest = sha1_string(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+  return base64_encode((const unsigned char*)digest.data(), (unsigned int)digest.size());
+}
+
+// writes what the socket takes now. false when it is broken.
+static bool flush_output(int fd, std::string& out) {
+  while (!out.empty()) {
+    ssize_t r = send(fd, out.data(), out.size(), 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (r <= 0) return false;
+    out.erase(0, r);
+  }
+  return true;
+}
+
+WebSocketHub::WebSocketHub() {
+  next_id = 0;
+  wake[0] = wake[1] = -1;
+  running = false;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+WebSocketHub::~WebSocketHub() {
+  stop();
+  pthread_mutex_destroy(&mutex);
+}
+
+bool WebSocketHub::start() {
+  if (running)
+    return true;
+  if (pipe(wake) < 0)
+    return false;
+  for (int i = 0; i < 2; i++) {
+    fcntl(wake[i], F_SETFD, FD_CLOEXEC);
+    fcntl(wake[i], F_SETFL, fcntl(wake[i], F_GETFL) | O_NONBLOCK);
+  }
+  running = true;
+  if (pthread_create(&thread, NULL, loop_thread, this)) {
+    running = false;
+    close(wake[0]);
+    close(wake[1]);
+    wake[0] = wake[1] = -1;
+    return false;
+  }
+  return true;
+}
+
+void WebSocketHub::stop() {
+  if (!running)
+    return;
+  running = false;
+  if (write(wake[1], "", 1) < 0) {}
+  pthread_join(thread, NULL);
+  for (std::map<unsigned int, Client>::iterator it = clients.begin(); it != clients.end(); it++)
+    close(it->second.fd);
+  clients.clear();
+  for (std::vector<Backend>::iterator it = backends.begin(); it != backends.end(); it++)
+    if (it->fd >= 0) close(it->fd);
+  backends.clear();
+  for (std::vector<Pending>::iterator it = pending.begin(); it != pending.end(); it++)
+    close(it->fd);
+  pending.clear();
+  close(wake[0]);
+  close(wake[1]);
+  wake[0] = wake[1] = -1;
+}
+
+void WebSocketHub::attach(int fd, const std::string& backend, const std::string& uri) {
+  Pending p;
+  p.fd = fd;
+  p.backend = backend;
+  p.uri = uri;
+  pthread_mutex_lock(&mutex);
+  pending.push_back(p);
+  pthread_mutex_unlock(&mutex);
+  if (write(wake[1], "", 1) < 0) {}
+}
+
+void* WebSocketHub::loop_thread(void* param) {
+  ((WebSocketHub*)param)->loop();
+  return NULL;
+}
+
+bool WebSocketHub::connect_backend(Backend& backend) {
+  backend.fd = upstream_connect(backend.address);
+  if (backend.fd < 0)
+    return false;
+  fcntl(backend.fd, F_SETFL, fcntl(backend.fd, F_GETFL) | O_NONBLOCK);
+  return true;
+}
+
+// a backend gone takes its clients along: they are told 1011 (internal
+// error) and a new connection is made for the next client.
+void WebSocketHub::close_backend(int index) {
+  Backend& backend = backends[index];
+  close(backend.fd);
+  backend.fd = -1;
+  backend.in.clear();
+  backend.out.clear();
+  for (std::map<unsigned int, Client>::iterator it = clients.begin(); it != clients.end(); it++) {
+    if (it->second.backend == index && !it->second.closing)
+      send_close(it->second, 1011);
+  }
+}
+
+void WebSocketHub::accept_pending() {
+  std::vector<Pending> list;
+  pthread_mutex_lock(&mutex);
+  list.swap(pending);
+  pthread_mutex_unlock(&mutex);
+
+  for (std::vector<Pending>::iterator it = list.begin(); it != list.end(); it++) {
+    int index = 0;
+    while (index < (int)backends.size() && backends[index].address != it->backend)
+      index++;
+    if (index == (int)backends.size()) {
+      Backend backend;
+      backend.address = it->backend;
+      backend.fd = -1;
+      backends.push_back(backend);
+    }
+    if (backends[index].fd < 0 && !connect_backend(backends[index])) {
+      // the handshake is done already, so the refusal is a close frame.
+      send(it->fd, "\x88\x02\x03\xf3", 4, 0);
+      close(it->fd);
+      continue;
+    }
+    fcntl(it->fd, F_SETFL, fcntl(it->fd, F_GETFL) | O_NONBLOCK);
+    do
+      next_id++;
+    while (next_id == 0 || clients.count(next_id));
+    Client& client = clients[next_id];
+    client.fd = it->fd;
+    client.backend = index;
+    client.opcode = WS_CONTINUATION;
+    client.closing = false;
+    send_record(index, next_id, 'o', it->uri.data(), it->uri.size());
+  }
+}
+
+void WebSocketHub::send_frame(Client& client, int opcode, const char* data, size_t size) {
+  unsigned char head[10];
+  size_t head_len = 2;
+  head[0] = 0x80 | opcode;
+  if (size < 126)
+    head[1] = (unsigned char)size;
+  else if (size < 65536) {
+    head[1] = 126;
+    head[2] = (unsigned char)(size >> 8);
+    head[3] = (unsigned char)size;
+    head_len = 4;
+  } else {
+    head[1] = 127;
+    for (int i = 0; i < 8; i++)
+      head[2 + i] = (unsigned char)((unsigned long long)size >> (56 - i * 8));
+    head_len = 10;
+  }
+  client.out.append((const char*)head, head_len);
+  client.out.append(data, size);
+}
+
+// starts the closing handshake. the socket is closed once the close frame
+// is out; what the client sends meanwhile is not read.
+void WebSocketHub::send_close(Client& client, int code) {
+  char payload[2];
+  payload[0] = (char)(code >> 8);
+  payload[1] = (char)code;
+  send_frame(client, WS_CLOSE, payload, 2);
+  client.closing = true;
+}
+
+void WebSocketHub::send_record(int backend, unsigned int id, char type, const char* data, size_t size) {
+  if (backends[backend].fd < 0)
+    return;
+  unsigned char head[9];
+  for (int i = 0; i < 4; i++)
+    head[i] = (unsigned char)(id >> (24 - i * 8));
+  head[4] = type;
+  for (int i = 0; i < 4; i++)
+    head[5 + i] = (unsigned char)((unsigned int)size >> (24 - i * 8));
+  backends[backend].out.append((const char*)head, 9);
+  backends[backend].out.append(data, size);
+}
+
+void WebSocketHub::drop_client(unsigned int id, bool notify) {
+  std::map<unsigned int, Client>::iterator it = clients.find(id);
+  if (it == clients.end())
+    return;
+  if (notify)
+    send_record(it->second.backend, id, 'c', "", 0);
+  close(it->second.fd);
+  clients.erase(it);
+}
+
+// parses the frames read from a client. false on a protocol error, for
+// which the connection is closed.
+bool WebSocketHub::client_input(unsigned int id, Client& client) {
+  size_t used = 0;
+  bool ok = true;
+  while (!client.closing) {
+    size_t avail = client.in.size() - used;
+    const unsigned char* p = (const unsigned char*)client.in.data() + used;
+    if (avail < 2)
+      break;
+    bool fin = (p[0] & 0x80) != 0;
+    int opcode = p[0] & 0x0f;
+    unsigned long long size = p[1] & 0x7f;
+    size_t head_len = 2;
+    if (size == 126) {
+      if (avail < 4) break;
+      size = (p[2] << 8) | p[3];
+      head_len = 4;
+    } else if (size == 127) {
+      if (avail < 10) break;
+      size = 0;
+      for (int i = 0; i < 8; i++)
+        size = (size << 8) | p[2 + i];
+      head_len = 10;
+    }
+    // clients must mask, and control frames are short and whole.
+    if (!(p[1] & 0x80) || (opcode >= WS_CLOSE && (!fin || size > 125))) {
+      send_close(client, 1002);
+      ok = false;
+      break;
+    }
+    if (size + client.message.size() > WS_MESSAGE_MAX) {
+      send_close(client, 1009);
+      ok = false;
+      break;
+    }
+    if (avail < head_len + 4 + size)
+      break;
+    const unsigned char* mask = p + head_len;
+    std::string payload((const char*)p + head_len + 4, (size_t)size);
+    for (size_t i = 0; i < payload.size(); i++)
+      payload[i] ^= mask[i & 3];
+    used += head_len + 4 + (size_t)size;
+
+    switch (opcode) {
+    case WS_CONTINUATION:
+    case WS_TEXT:
+    case WS_BINARY:
+      if ((opcode == WS_CONTINUATION) != (client.opcode != WS_CONTINUATION)) {
+        send_close(client, 1002);
+        ok = false;
+        break;
+      }
+      if (opcode != WS_CONTINUATION)
+        client.opcode = opcode;
+      client.message += payload;
+      if (fin) {
+        send_record(client.backend, id, client.opcode == WS_TEXT ? 't' : 'b', client.message.data(), client.message.size());
+        client.message.clear();
+        client.opcode = WS_CONTINUATION;
+      }
+      break;
+    case WS_CLOSE:
+      send_frame(client, WS_CLOSE, payload.data(), payload.size() < 2 ? payload.size() : 2);
+      client.closing = true;
+      ok = false;
+      break;
+    case WS_PING:
+      send_frame(client, WS_PONG, payload.data(), payload.size());
+      break;
+    case WS_PONG:
+      break;
+    default:
+      send_close(client, 1002);
+      ok = false;
+      break;
+    }
+    if (!ok)
+      break;
+  }
+  client.in.erase(0, used);
+  return ok;
+}
+
+void WebSocketHub::backend_input(int index) {
+  Backend& backend = backends[index];
+  size_t used = 0;
+  while (backend.in.size() - used >= 9) {
+    const unsigned char* p = (const unsigned char*)backend.in.data() + used;
+    unsigned int id = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    char type = (char)p[4];
+    size_t size = (p[5] << 24) | (p[6] << 16) | (p[7] << 8) | p[8];
+    if (size > WS_MESSAGE_MAX) {
+      close_backend(index);
+      return;
+    }
+    if (backend.in.size() - used < 9 + size)
+      break;
+    const char* data = backend.in.data() + used + 9;
+    used += 9 + size;
+
+    std::map<unsigned int, Client>::iterator it, end;
+    if (id == 0) {
+      it = clients.begin();
+      end = clients.end();
+    } else {
+      it = clients.find(id);
+      end = it;
+      if (it != clients.end())
+        end++;
+    }
+    for (; it != end; it++) {
+      Client& client = it->second;
+      if (client.backend != index || client.closing)
+        continue;
+      if (type == 'c') {
+        send_close(client, 1000);
+        continue;
+      }
+      if (type != 't' && type != 'b')
+        continue;
+      bool idle = client.out.empty();
+      send_frame(client, type == 't' ? WS_TEXT : WS_BINARY, data, size);
+      // a client that does not keep up is dropped, not waited for.
+      if (client.out.size() > WS_BUFFER_MAX || (idle && !flush_output(client.fd, client.out))) {
+        client.out.clear();
+        client.closing = true;
+        send_record(index, it->first, 'c', "", 0);
+      }
+    }
+  }
+  backend.in.erase(0, used);
+}
+
+void WebSocketHub::loop() {
+  std::vector<struct pollfd> pfds;
+  std::vector<unsigned int> ids;
+  char buf[16384];
+
+  while (running) {
+    pfds.clear();
+    ids.clear();
+    struct pollfd pfd;
+    pfd.fd = wake[0];
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    pfds.push_back(pfd);
+    for (size_t i = 0; i < backends.size(); i++) {
+      pfd.fd = backends[i].fd;
+      pfd.events = backends[i].fd < 0 ? 0 : POLLIN | (backends[i].out.empty() ? 0 : POLLOUT);
+      pfds.push_back(pfd);
+    }
+    for (std::map<unsigned int, Client>::iterator it = clients.begin(); it != clients.end();) {
+      Client& client = it->second;
+      if (client.closing && client.out.empty()) {
+        close(client.fd);
+        clients.erase(it++);
+        continue;
+      }
+      pfd.fd = client.fd;
+      pfd.events = 0;
+      if (!client.closing && backends[client.backend].out.size() < WS_BUFFER_MAX)
+        pfd.events |= POLLIN;
+      if (!client.out.empty())
+        pfd.events |= POLLOUT;
+      pfds.push_back(pfd);
+      ids.push_back(it->first);
+      it++;
+    }
+
+    if (poll(&pfds[0], pfds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (!running)
+      break;
+    size_t nbackends = backends.size();
+
+    for (size_t i = 0; i < ids.size(); i++) {
+      struct pollfd& p = pfds[1 + nbackends + i];
+      if (!p.revents)
+        continue;
+      std::map<unsigned int, Client>::iterator it = clients.find(ids[i]);
+      if (it == clients.end())
+        continue;
+      Client& client = it->second;
+      bool broken = false;
+      if (p.revents & (POLLIN | POLLHUP | POLLERR)) {
+        ssize_t r = recv(client.fd, buf, sizeof(buf), 0);
+        if (r > 0) {
+          client.in.append(buf, r);
+          if (!client_input(it->first, client))
+            send_record(client.backend, it->first, 'c', "", 0);
+        } else if (r == 0 || (errno != EAGAIN && errno != EINTR))
+          broken = true;
+      }
+      if (!broken && (p.revents & POLLOUT))
+        broken = !flush_output(client.fd, client.out);
+      if (broken)
+        drop_client(it->first, !client.closing);
+    }
+
+    for (size_t i = 0; i < nbackends; i++) {
+      struct pollfd& p = pfds[1 + i];
+      if (!p.revents || backends[i].fd != p.fd)
+        continue;
+      if (p.revents & POLLOUT) {
+        if (!flush_output(backends[i].fd, backends[i].out)) {
+          close_backend((int)i);
+          continue;
+        }
+      }
+      if (p.revents & (POLLIN | POLLHUP | POLLERR)) {
+        ssize_t r = recv(backends[i].fd, buf, sizeof(buf), 0);
+        if (r > 0) {
+          backends[i].in.append(buf, r);
+          backend_input((int)i);
+        } else if (r == 0 || (errno != EAGAIN && errno != EINTR))
+          close_backend((int)i);
+      }
+    }
+
+    if (pfds[0].revents) {
+      while (read(wake[0], buf, sizeof(buf)) > 0) {}
+      accept_pending();
+    }
+  }
+}
+
+#endif
+
+}
+
+// vim:set et:
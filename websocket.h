@@ -0,0 +1,112 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _WEBSOCKET_H_
+#define _WEBSOCKET_H_
+
+#include <string>
+#include <vector>
+#include <map>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+namespace tthttpd {
+
+#ifndef _WIN32
+
+// the Sec-WebSocket-Accept value answering a Sec-WebSocket-Key.
+std::string websocket_accept(const std::string& key);
+
+// WebSocket clients after the handshake, all served by one thread polling
+// their sockets, so an idle client costs a socket and a few buffers. the
+// messages of all clients mounted on one backend go over one connection
+// to it, each in a record of
+//
+//   4 bytes  client id, big endian
+//   1 byte   'o' opened (payload: request URI), 't' text, 'b' binary,
+//            'c' closed
+//   4 bytes  payload length, big endian
+//   payload
+//
+// the backend answers in the same records; 't' and 'b' are sent to the
+// client, to every client of the backend with id 0, and 'c' closes it.
+// ping, pong, masking and fragments are handled here and never reach the
+// backend.
+class WebSocketHub {
+public:
+  WebSocketHub();
+  ~WebSocketHub();
+  bool start();
+  void stop();
+  // takes over a client socket whose handshake was answered.
+  void attach(int fd, const std::string& backend, const std::string& uri);
+private:
+  typedef struct {
+    int fd;
+    int backend;
+    std::string in;
+    std::string out;
+    std::string message;
+    int opcode;
+    bool closing;
+  } Client;
+  typedef struct {
+    std::string address;
+    int fd;
+    std::string in;
+    std::string out;
+  } Backend;
+  typedef struct {
+    int fd;
+    std::string backend;
+    std::string uri;
+  } Pending;
+  std::map<unsigned int, Client> clients;
+  std::vector<Backend> backends;
+  std::vector<Pending> pending;
+  unsigned int next_id;
+  int wake[2];
+  bool running;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  static void* loop_thread(void* param);
+  void loop();
+  void accept_pending();
+  bool connect_backend(Backend& backend);
+  void close_backend(int index);
+  bool client_input(unsigned int id, Client& client);
+  void backend_input(int index);
+  void send_frame(Client& client, int opcode, const char* data, size_t size);
+  void send_close(Client& client, int code);
+  void send_record(int backend, unsigned int id, char type, const char* data, size_t size);
+  void drop_client(unsigned int id, bool notify);
+};
+
+#endif
+
+}
+
+#endif /* _WEBSOCKET_H_ */
+
+// vim:set et: